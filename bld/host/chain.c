@@ -0,0 +1,381 @@
+// Host runtime for the chain task graph: channel reads/writes, self-channel
+// double-buffering, and a cooperative round-robin thread scheduler.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <setjmp.h>
+
+#include <msp430.h>
+#include <libchain/chain.h>
+#include <libchain/thread.h>
+
+volatile uint8_t P1DIR, P1OUT;
+volatile uint8_t P2DIR, P2OUT;
+volatile uint8_t P3DIR, P3OUT;
+volatile uint8_t P4DIR, P4OUT;
+volatile uint8_t PJDIR, PJOUT;
+
+extern task_t * const _entry_task;
+extern void _chain_init();
+
+static context_t context = { .time = 1 };
+context_t * volatile curctx = &context;
+
+static thread_t threads[MAX_THREADS];
+static unsigned num_threads;
+static bool bootstrapped; // thread_init() has been called
+static thread_t bootstrap_thread; // holds dirty self fields of bootstrap tasks
+static jmp_buf scheduler;
+static thread_t *scheduled; // next thread to run, once bootstrapped
+
+// Self and shared channels: double-buffered, committed on transition
+static bool chan_versioned(chan_meta_t *chan)
+{
+    return chan->type == CHAN_TYPE_SELF || chan->type == CHAN_TYPE_SHARED;
+}
+
+static uint8_t *field_var(chan_meta_t *chan, field_meta_t *field,
+                          size_t var_size, size_t var_offset, bool next)
+{
+    unsigned idx = 0;
+    if (chan_versioned(chan))
+        idx = next ? !field->idx : field->idx;
+    return (uint8_t *)field + var_offset + idx * var_size;
+}
+
+void *chan_in(const char *field_name, size_t var_size, size_t var_offset,
+              size_t value_offset, size_t value_size, int count, ...)
+{
+    va_list ap;
+    int i;
+    uint8_t *latest = NULL;
+    chain_time_t latest_time = 0;
+
+    va_start(ap, count);
+    for (i = 0; i < count; ++i) {
+        chan_meta_t *chan = va_arg(ap, chan_meta_t *);
+        field_meta_t *field = va_arg(ap, field_meta_t *);
+        uint8_t *var = field_var(chan, field, var_size, var_offset, false);
+        chain_time_t timestamp = ((var_meta_t *)var)->timestamp;
+
+        // A field nobody wrote yet reads as zero from the first channel
+        if (!latest || timestamp > latest_time) {
+            latest = var;
+            latest_time = timestamp;
+        }
+    }
+    va_end(ap);
+
+    return latest + value_offset;
+}
+
+void chan_out(const char *field_name, const void *value, size_t var_size,
+              size_t var_offset, size_t value_offset, size_t value_size,
+              int count, ...)
+{
+    va_list ap;
+    int i;
+    thread_t *thread = curctx->thread ? curctx->thread : &bootstrap_thread;
+
+    va_start(ap, count);
+    for (i = 0; i < count; ++i) {
+        chan_meta_t *chan = va_arg(ap, chan_meta_t *);
+        field_meta_t *field = va_arg(ap, field_meta_t *);
+        uint8_t *var = field_var(chan, field, var_size, var_offset, true);
+
+        ((var_meta_t *)var)->timestamp = curctx->time;
+        memcpy(var + value_offset, value, value_size);
+
+        if (chan_versioned(chan) && !field->dirty) {
+            field->dirty = 1;
+            field->next_dirty = thread->dirty;
+            thread->dirty = field;
+        }
+    }
+    va_end(ap);
+}
+
+// The array calls take (meta, first element, element size) per channel; the
+// element size differs between self and other channels of the same field.
+#define CHAN_ARRAY_MAX 4
+
+typedef struct {
+    chan_meta_t *chan;
+    uint8_t *first;
+    size_t stride;
+} chan_array_t;
+
+static void chan_array_args(chan_array_t *arrays, int chan_count, va_list ap)
+{
+    int i;
+
+    if (chan_count > CHAN_ARRAY_MAX) {
+        fprintf(stderr, "chain: too many channels for an array access (%d)\n",
+                chan_count);
+        exit(1);
+    }
+
+    for (i = 0; i < chan_count; ++i) {
+        arrays[i].chan = va_arg(ap, chan_meta_t *);
+        arrays[i].first = va_arg(ap, uint8_t *);
+        arrays[i].stride = va_arg(ap, size_t);
+    }
+}
+
+void chan_in_array(const char *field_name, void *dst, size_t count,
+                   size_t var_size, size_t var_offset, size_t value_offset,
+                   size_t value_size, int chan_count, ...)
+{
+    va_list ap;
+    chan_array_t arrays[CHAN_ARRAY_MAX];
+    size_t k;
+    int i;
+
+    va_start(ap, chan_count);
+    chan_array_args(arrays, chan_count, ap);
+    va_end(ap);
+
+    for (k = 0; k < count; ++k) {
+        uint8_t *latest = NULL;
+        chain_time_t latest_time = 0;
+
+        for (i = 0; i < chan_count; ++i) {
+            field_meta_t *field =
+                (field_meta_t *)(arrays[i].first + k * arrays[i].stride);
+            uint8_t *var = field_var(arrays[i].chan, field, var_size, var_offset,
+                                     false);
+            chain_time_t timestamp = ((var_meta_t *)var)->timestamp;
+
+            if (!latest || timestamp > latest_time) {
+                latest = var;
+                latest_time = timestamp;
+            }
+        }
+
+        memcpy((uint8_t *)dst + k * value_size, latest + value_offset, value_size);
+    }
+}
+
+void chan_out_array(const char *field_name, const void *values,
+                    size_t value_stride, size_t count, size_t var_size,
+                    size_t var_offset, size_t value_offset, size_t value_size,
+                    int chan_count, ...)
+{
+    va_list ap;
+    chan_array_t arrays[CHAN_ARRAY_MAX];
+    thread_t *thread = curctx->thread ? curctx->thread : &bootstrap_thread;
+    chain_time_t timestamp = curctx->time;
+    size_t k;
+    int i;
+
+    va_start(ap, chan_count);
+    chan_array_args(arrays, chan_count, ap);
+    va_end(ap);
+
+    for (i = 0; i < chan_count; ++i) {
+        bool versioned = chan_versioned(arrays[i].chan);
+        bool sliced = versioned && thread->num_dirty_slices < MAX_DIRTY_SLICES;
+
+        for (k = 0; k < count; ++k) {
+            field_meta_t *field =
+                (field_meta_t *)(arrays[i].first + k * arrays[i].stride);
+            uint8_t *var = field_var(arrays[i].chan, field, var_size, var_offset,
+                                     true);
+
+            // A single element of the slice may be read or written alone
+            // later, so each keeps the version stamp it resolves by
+            ((var_meta_t *)var)->timestamp = timestamp;
+            memcpy(var + value_offset, (const uint8_t *)values + k * value_stride,
+                   value_size);
+
+            if (versioned && !field->dirty) {
+                field->dirty = 1;
+                if (!sliced) {
+                    field->next_dirty = thread->dirty;
+                    thread->dirty = field;
+                }
+            }
+        }
+
+        // The whole slice is committed from one record
+        if (sliced && count) {
+            dirty_slice_t *slice = &thread->dirty_slices[thread->num_dirty_slices++];
+            slice->first = arrays[i].first;
+            slice->stride = arrays[i].stride;
+            slice->count = count;
+        }
+    }
+}
+
+chan_ref_t chan_array_ref(size_t var_size, size_t var_offset, size_t value_offset,
+                          size_t value_size, int chan_count, ...)
+{
+    va_list ap;
+    chan_array_t arrays[CHAN_ARRAY_MAX];
+    chan_ref_t ref;
+    chain_time_t latest_time = 0;
+    int i;
+
+    va_start(ap, chan_count);
+    chan_array_args(arrays, chan_count, ap);
+    va_end(ap);
+
+    // Resolved once, by the first element, like chan_in would resolve it.
+    // The versions of a self or shared field swap on every commit, so a
+    // reference into one would go stale.
+    for (i = 0; i < chan_count; ++i) {
+        if (chan_versioned(arrays[i].chan)) {
+            fprintf(stderr, "chain: reference into double-buffered channel %s -> %s\n",
+                    arrays[i].chan->source_name, arrays[i].chan->dest_name);
+            exit(1);
+        }
+
+        uint8_t *var = field_var(arrays[i].chan, (field_meta_t *)arrays[i].first,
+                                 var_size, var_offset, false);
+        chain_time_t timestamp = ((var_meta_t *)var)->timestamp;
+
+        if (i == 0 || timestamp > latest_time) {
+            ref.chan = arrays[i].chan;
+            ref.elems = arrays[i].first;
+            ref.stride = arrays[i].stride;
+            latest_time = timestamp;
+        }
+    }
+
+    return ref;
+}
+
+// Self- and shared-channel writes of the finished task become visible to its
+// successor. A field written both alone and in a slice, or in two slices, is
+// still dirty only until its first commit here.
+static void commit_self_fields(thread_t *thread)
+{
+    field_meta_t *field = thread->dirty;
+    unsigned i;
+    size_t k;
+
+    while (field) {
+        field_meta_t *next = field->next_dirty;
+        field->idx = !field->idx;
+        field->dirty = 0;
+        field->next_dirty = NULL;
+        field = next;
+    }
+    thread->dirty = NULL;
+
+    for (i = 0; i < thread->num_dirty_slices; ++i) {
+        dirty_slice_t *slice = &thread->dirty_slices[i];
+
+        for (k = 0; k < slice->count; ++k) {
+            field = (field_meta_t *)(slice->first + k * slice->stride);
+            if (field->dirty) {
+                field->idx = !field->idx;
+                field->dirty = 0;
+            }
+        }
+    }
+    thread->num_dirty_slices = 0;
+}
+
+void task_prologue()
+{
+}
+
+void thread_init()
+{
+    num_threads = 0;
+    bootstrapped = true;
+    curctx->thread = NULL;
+}
+
+thread_id_t thread_create(const task_t *task)
+{
+    thread_t *thread;
+
+    if (num_threads == MAX_THREADS) {
+        fprintf(stderr, "chain: too many threads (MAX_THREADS=%u)\n", MAX_THREADS);
+        exit(1);
+    }
+
+    thread = &threads[num_threads];
+    memset(thread, 0, sizeof(*thread));
+    thread->id = num_threads;
+    thread->task = task;
+    thread->live = true;
+    return num_threads++;
+}
+
+void thread_end()
+{
+    if (curctx->thread)
+        curctx->thread->live = false;
+}
+
+static thread_t *next_live_thread(thread_t *after)
+{
+    unsigned i, start = after ? after->id + 1 : 0;
+    for (i = 0; i < num_threads; ++i) {
+        thread_t *thread = &threads[(start + i) % num_threads];
+        if (thread->live)
+            return thread;
+    }
+    return NULL;
+}
+
+static void __attribute__((noreturn)) transition(const task_t *next_task)
+{
+    thread_t *thread = curctx->thread;
+
+    commit_self_fields(thread ? thread : &bootstrap_thread);
+    ++curctx->time;
+
+    if (thread) {
+        thread->task = next_task;
+        scheduled = next_live_thread(thread);
+    } else if (bootstrapped) {
+        // Bootstrap hands off: start with the thread parked at next_task
+        unsigned i;
+        scheduled = next_live_thread(NULL);
+        for (i = 0; i < num_threads; ++i) {
+            if (threads[i].live && threads[i].task == next_task) {
+                scheduled = &threads[i];
+                break;
+            }
+        }
+    } else {
+        // Single-threaded graph: the bootstrap context simply runs on
+        curctx->task = next_task;
+    }
+    longjmp(scheduler, 1);
+}
+
+void transition_to(const task_t *next_task)
+{
+    transition(next_task);
+}
+
+void transition_to_mt(const task_t *next_task)
+{
+    transition(next_task);
+}
+
+int main()
+{
+    curctx->task = _entry_task;
+    _chain_init();
+
+    if (setjmp(scheduler) && bootstrapped) {
+        if (!scheduled) // every thread has ended
+            return 0;
+        curctx->thread = scheduled;
+        curctx->task = scheduled->task;
+    }
+
+    curctx->task->func();
+
+    fprintf(stderr, "chain: task %s returned without a transition\n",
+            curctx->task->name);
+    return 1;
+}
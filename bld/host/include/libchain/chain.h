@@ -0,0 +1,433 @@
+#ifndef CHAIN_H
+#define CHAIN_H
+
+// Host stand-in for libchain: same task/channel API as the MSP430 runtime,
+// but channels live in ordinary RAM and transitions unwind to a scheduler
+// loop (see chain.c) instead of resetting the stack pointer. There are no
+// power failures on the host, so there is no commit/recovery protocol beyond
+// the double-buffering of self-channel fields.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <libmsp/mem.h>
+
+typedef void (task_func_t)(void);
+typedef unsigned chain_time_t;
+typedef uint32_t task_mask_t;
+typedef unsigned task_idx_t;
+
+typedef enum {
+    CHAN_TYPE_T2T,
+    CHAN_TYPE_SELF,
+    CHAN_TYPE_MULTICAST,
+    CHAN_TYPE_CALL,
+    CHAN_TYPE_RETURN,
+    CHAN_TYPE_SHARED,
+} chan_type_t;
+
+typedef struct _task_t {
+    task_func_t *func;
+    task_mask_t mask;
+    task_idx_t idx;
+    chain_time_t last_execute_time;
+    const char *name;
+} task_t;
+
+struct _thread_t;
+
+typedef struct _context_t {
+    const task_t *task;
+    chain_time_t time;
+    struct _thread_t *thread;
+} context_t;
+
+extern context_t * volatile curctx;
+
+typedef struct {
+    chan_type_t type;
+    const char *source_name;
+    const char *dest_name;
+} chan_meta_t;
+
+typedef struct {
+    chain_time_t timestamp;
+} var_meta_t;
+
+// Every field is an array of versions: one for ordinary fields, two for
+// self-channel and shared-channel fields (read from 'idx', written to '!idx',
+// swapped on transition). Keeping the same shape for both lets the channel macros
+// type-check any field uniformly.
+typedef struct _field_meta_t {
+    uint8_t idx;
+    uint8_t dirty;
+    struct _field_meta_t *next_dirty;
+} field_meta_t;
+
+#define VAR_TYPE(type) \
+    struct { \
+        var_meta_t meta; \
+        type value; \
+    }
+
+#define FIELD_TYPE(type) \
+    struct { \
+        field_meta_t meta; \
+        VAR_TYPE(type) var[1]; \
+    }
+
+#define SELF_FIELD_TYPE(type) \
+    struct { \
+        field_meta_t meta; \
+        VAR_TYPE(type) var[2]; \
+    }
+
+#define CHAN_FIELD(type, name)                  FIELD_TYPE(type) name
+#define CHAN_FIELD_ARRAY(type, name, size)      FIELD_TYPE(type) name[size]
+#define SELF_CHAN_FIELD(type, name)             SELF_FIELD_TYPE(type) name
+#define SELF_CHAN_FIELD_ARRAY(type, name, size) SELF_FIELD_TYPE(type) name[size]
+
+#define SELF_FIELD_INITIALIZER { { 0, 0, NULL } }
+#define SELF_FIELD_ARRAY_INITIALIZER(count) \
+    { [0 ... (count) - 1] = SELF_FIELD_INITIALIZER }
+
+#define CHANNEL(src, dest, type) \
+    __nv struct { \
+        chan_meta_t meta; \
+        struct type data; \
+    } _ch_ ## src ## _ ## dest = \
+        { { CHAN_TYPE_T2T, #src, #dest } }
+
+#define SELF_CHANNEL(task, type) \
+    __nv struct { \
+        chan_meta_t meta; \
+        struct type data; \
+    } _ch_ ## task ## _ ## task = \
+        { { CHAN_TYPE_SELF, #task, #task }, FIELD_INIT_ ## type }
+
+// Every task named by a multicast channel or reference must exist, so that a
+// misspelt source or destination fails to compile instead of naming nothing.
+// Takes up to 12 tasks.
+#define CHAN_TASK_CHECK(task) \
+    _Static_assert(sizeof(TASK_SYM_NAME(task)), "no such task: " #task);
+#define CHAN_TASKS_CHECK(...) \
+    CHAN_TASKS_PICK(__VA_ARGS__, CHAN_TASKS12, CHAN_TASKS11, CHAN_TASKS10, \
+                    CHAN_TASKS9, CHAN_TASKS8, CHAN_TASKS7, CHAN_TASKS6, \
+                    CHAN_TASKS5, CHAN_TASKS4, CHAN_TASKS3, CHAN_TASKS2, \
+                    CHAN_TASKS1)(__VA_ARGS__)
+#define CHAN_TASKS_PICK(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, \
+                        macro, ...) macro
+#define CHAN_TASKS1(t)       CHAN_TASK_CHECK(t)
+#define CHAN_TASKS2(t, ...)  CHAN_TASK_CHECK(t) CHAN_TASKS1(__VA_ARGS__)
+#define CHAN_TASKS3(t, ...)  CHAN_TASK_CHECK(t) CHAN_TASKS2(__VA_ARGS__)
+#define CHAN_TASKS4(t, ...)  CHAN_TASK_CHECK(t) CHAN_TASKS3(__VA_ARGS__)
+#define CHAN_TASKS5(t, ...)  CHAN_TASK_CHECK(t) CHAN_TASKS4(__VA_ARGS__)
+#define CHAN_TASKS6(t, ...)  CHAN_TASK_CHECK(t) CHAN_TASKS5(__VA_ARGS__)
+#define CHAN_TASKS7(t, ...)  CHAN_TASK_CHECK(t) CHAN_TASKS6(__VA_ARGS__)
+#define CHAN_TASKS8(t, ...)  CHAN_TASK_CHECK(t) CHAN_TASKS7(__VA_ARGS__)
+#define CHAN_TASKS9(t, ...)  CHAN_TASK_CHECK(t) CHAN_TASKS8(__VA_ARGS__)
+#define CHAN_TASKS10(t, ...) CHAN_TASK_CHECK(t) CHAN_TASKS9(__VA_ARGS__)
+#define CHAN_TASKS11(t, ...) CHAN_TASK_CHECK(t) CHAN_TASKS10(__VA_ARGS__)
+#define CHAN_TASKS12(t, ...) CHAN_TASK_CHECK(t) CHAN_TASKS11(__VA_ARGS__)
+
+// Each (channel, source, destination) edge of a multicast channel is an
+// extern symbol that is declared but never defined: MC_IN_CH and MC_OUT_CH
+// take its size, so naming an edge the channel does not declare fails to
+// compile.
+#define CHAN_EDGE(name, src, dest) _mc_edge_ ## src ## _ ## name ## _ ## dest
+#define CHAN_EDGE_DECL(name, src, dest) extern char CHAN_EDGE(name, src, dest);
+#define CHAN_EDGE_CHECK(name, src, dest) \
+    _Static_assert(sizeof(CHAN_EDGE(name, src, dest)), \
+                   "no such edge: " #name " from " #src " to " #dest);
+#define CHAN_EDGES(op, name, src, ...) \
+    CHAN_TASKS_PICK(__VA_ARGS__, CHAN_EDGES12, CHAN_EDGES11, CHAN_EDGES10, \
+                    CHAN_EDGES9, CHAN_EDGES8, CHAN_EDGES7, CHAN_EDGES6, \
+                    CHAN_EDGES5, CHAN_EDGES4, CHAN_EDGES3, CHAN_EDGES2, \
+                    CHAN_EDGES1)(op, name, src, __VA_ARGS__)
+#define CHAN_EDGES1(op, n, s, d)       op(n, s, d)
+#define CHAN_EDGES2(op, n, s, d, ...)  op(n, s, d) CHAN_EDGES1(op, n, s, __VA_ARGS__)
+#define CHAN_EDGES3(op, n, s, d, ...)  op(n, s, d) CHAN_EDGES2(op, n, s, __VA_ARGS__)
+#define CHAN_EDGES4(op, n, s, d, ...)  op(n, s, d) CHAN_EDGES3(op, n, s, __VA_ARGS__)
+#define CHAN_EDGES5(op, n, s, d, ...)  op(n, s, d) CHAN_EDGES4(op, n, s, __VA_ARGS__)
+#define CHAN_EDGES6(op, n, s, d, ...)  op(n, s, d) CHAN_EDGES5(op, n, s, __VA_ARGS__)
+#define CHAN_EDGES7(op, n, s, d, ...)  op(n, s, d) CHAN_EDGES6(op, n, s, __VA_ARGS__)
+#define CHAN_EDGES8(op, n, s, d, ...)  op(n, s, d) CHAN_EDGES7(op, n, s, __VA_ARGS__)
+#define CHAN_EDGES9(op, n, s, d, ...)  op(n, s, d) CHAN_EDGES8(op, n, s, __VA_ARGS__)
+#define CHAN_EDGES10(op, n, s, d, ...) op(n, s, d) CHAN_EDGES9(op, n, s, __VA_ARGS__)
+#define CHAN_EDGES11(op, n, s, d, ...) op(n, s, d) CHAN_EDGES10(op, n, s, __VA_ARGS__)
+#define CHAN_EDGES12(op, n, s, d, ...) op(n, s, d) CHAN_EDGES11(op, n, s, __VA_ARGS__)
+
+// Destinations are documentation only, as in the MSP430 runtime, but they
+// are checked to be tasks, and references to the channel to name one of them
+#define MULTICAST_CHANNEL(type, name, src, dest, ...) \
+    CHAN_TASKS_CHECK(src, dest, ##__VA_ARGS__) \
+    CHAN_EDGES(CHAN_EDGE_DECL, name, src, dest, ##__VA_ARGS__) \
+    __nv struct { \
+        chan_meta_t meta; \
+        struct type data; \
+    } _ch_ ## src ## _ ## name = \
+        { { CHAN_TYPE_MULTICAST, #src, #name } }
+
+#define CALL_CHANNEL(name, type) \
+    __nv struct { \
+        chan_meta_t meta; \
+        struct type data; \
+    } _ch_call_ ## name = \
+        { { CHAN_TYPE_CALL, "caller", #name } }
+
+#define RET_CHANNEL(name, type) \
+    __nv struct { \
+        chan_meta_t meta; \
+        struct type data; \
+    } _ch_ret_ ## name = \
+        { { CHAN_TYPE_RETURN, #name, "caller" } }
+
+// A single copy of its fields that any task may read and write, instead of
+// one channel per writer that readers must compare by timestamp. Fields are
+// declared with SELF_CHAN_FIELD: as in a self channel, a write lands in the
+// spare version and is committed on the writer's transition, so a task that
+// re-executes still reads what it read the first time. A dirty field is
+// queued on the first writer thread only, so fields of a shared channel must
+// have a single writer thread.
+#define SHARED_CHANNEL(name, type) \
+    __nv struct { \
+        chan_meta_t meta; \
+        struct type data; \
+    } _ch_shared_ ## name = \
+        { { CHAN_TYPE_SHARED, "any", #name }, FIELD_INIT_ ## type }
+
+#define CH(src, dest) (&_ch_ ## src ## _ ## dest)
+#define SELF_IN_CH(tsk)  CH(tsk, tsk)
+#define SELF_OUT_CH(tsk) CH(tsk, tsk)
+#define MC_IN_CH(name, src, dest) \
+    (CHAN_CHECK(CHAN_EDGE_CHECK(name, src, dest)), &_ch_ ## src ## _ ## name)
+#define MC_OUT_CH(name, src, dest, ...) \
+    (CHAN_CHECK(CHAN_EDGES(CHAN_EDGE_CHECK, name, src, dest, ##__VA_ARGS__)), \
+     &_ch_ ## src ## _ ## name)
+#define CALL_CH(name) (&_ch_call_ ## name)
+#define RET_CH(name)  (&_ch_ret_ ## name)
+#define SHARED_CH(name) (&_ch_shared_ ## name)
+
+#define TASK_SYM_NAME(func) _task_ ## func
+
+#define TASK(idx, func) \
+    void func(); \
+    __nv task_t TASK_SYM_NAME(func) = { func, (1UL << (idx)), idx, 0, #func };
+
+// Tasks beyond the mask width of the board runtime; the host has no mask
+#define TASK_EXT(idx, func) \
+    void func(); \
+    __nv task_t TASK_SYM_NAME(func) = { func, 0, idx, 0, #func };
+
+#define TASK_REF(func) (&TASK_SYM_NAME(func))
+
+#define ENTRY_TASK(task) task_t * const _entry_task = TASK_REF(task);
+#define INIT_FUNC(func) void _chain_init() { func(); }
+
+// Reading or writing a field as a type of a different width is a silent
+// corruption on the board, so reject it at compile time here.
+#define CHAN_FIELD_CHECK(type, field, chan) \
+    _Static_assert(sizeof(type) == sizeof((chan)->data.field.var[0].value), \
+                   "channel field " #field " accessed with mismatched type " #type);
+
+#define CHAN_FIELD_CHECK_VAL(type, val) \
+    _Static_assert(sizeof(type) == sizeof(val), \
+                   "value " #val " written with mismatched type " #type);
+
+#define CHAN_CHECK(...) ((void)sizeof(struct { __VA_ARGS__ char _c; }))
+
+#define CHAN_VAR_LAYOUT(type) \
+    sizeof(VAR_TYPE(type)), offsetof(FIELD_TYPE(type), var), \
+    offsetof(VAR_TYPE(type), value), sizeof(type)
+
+#define CHAN_ARG(field, chan) &(chan)->meta, &(chan)->data.field
+
+#define CHAN_IN1(type, field, chan0) \
+    (CHAN_CHECK(CHAN_FIELD_CHECK(type, field, chan0)), \
+     (type *)chan_in(#field, CHAN_VAR_LAYOUT(type), 1, \
+                     CHAN_ARG(field, chan0)))
+#define CHAN_IN2(type, field, chan0, chan1) \
+    (CHAN_CHECK(CHAN_FIELD_CHECK(type, field, chan0) \
+                CHAN_FIELD_CHECK(type, field, chan1)), \
+     (type *)chan_in(#field, CHAN_VAR_LAYOUT(type), 2, \
+                     CHAN_ARG(field, chan0), CHAN_ARG(field, chan1)))
+#define CHAN_IN3(type, field, chan0, chan1, chan2) \
+    (CHAN_CHECK(CHAN_FIELD_CHECK(type, field, chan0) \
+                CHAN_FIELD_CHECK(type, field, chan1) \
+                CHAN_FIELD_CHECK(type, field, chan2)), \
+     (type *)chan_in(#field, CHAN_VAR_LAYOUT(type), 3, \
+                     CHAN_ARG(field, chan0), CHAN_ARG(field, chan1), \
+                     CHAN_ARG(field, chan2)))
+#define CHAN_IN4(type, field, chan0, chan1, chan2, chan3) \
+    (CHAN_CHECK(CHAN_FIELD_CHECK(type, field, chan0) \
+                CHAN_FIELD_CHECK(type, field, chan1) \
+                CHAN_FIELD_CHECK(type, field, chan2) \
+                CHAN_FIELD_CHECK(type, field, chan3)), \
+     (type *)chan_in(#field, CHAN_VAR_LAYOUT(type), 4, \
+                     CHAN_ARG(field, chan0), CHAN_ARG(field, chan1), \
+                     CHAN_ARG(field, chan2), CHAN_ARG(field, chan3)))
+#define CHAN_IN5(type, field, chan0, chan1, chan2, chan3, chan4) \
+    (CHAN_CHECK(CHAN_FIELD_CHECK(type, field, chan0) \
+                CHAN_FIELD_CHECK(type, field, chan1) \
+                CHAN_FIELD_CHECK(type, field, chan2) \
+                CHAN_FIELD_CHECK(type, field, chan3) \
+                CHAN_FIELD_CHECK(type, field, chan4)), \
+     (type *)chan_in(#field, CHAN_VAR_LAYOUT(type), 5, \
+                     CHAN_ARG(field, chan0), CHAN_ARG(field, chan1), \
+                     CHAN_ARG(field, chan2), CHAN_ARG(field, chan3), \
+                     CHAN_ARG(field, chan4)))
+
+#define CHAN_OUT1(type, field, val, chan0) \
+    (CHAN_CHECK(CHAN_FIELD_CHECK_VAL(type, val) \
+                CHAN_FIELD_CHECK(type, field, chan0)), \
+     chan_out(#field, &(val), CHAN_VAR_LAYOUT(type), 1, \
+              CHAN_ARG(field, chan0)))
+#define CHAN_OUT2(type, field, val, chan0, chan1) \
+    (CHAN_CHECK(CHAN_FIELD_CHECK_VAL(type, val) \
+                CHAN_FIELD_CHECK(type, field, chan0) \
+                CHAN_FIELD_CHECK(type, field, chan1)), \
+     chan_out(#field, &(val), CHAN_VAR_LAYOUT(type), 2, \
+              CHAN_ARG(field, chan0), CHAN_ARG(field, chan1)))
+#define CHAN_OUT3(type, field, val, chan0, chan1, chan2) \
+    (CHAN_CHECK(CHAN_FIELD_CHECK_VAL(type, val) \
+                CHAN_FIELD_CHECK(type, field, chan0) \
+                CHAN_FIELD_CHECK(type, field, chan1) \
+                CHAN_FIELD_CHECK(type, field, chan2)), \
+     chan_out(#field, &(val), CHAN_VAR_LAYOUT(type), 3, \
+              CHAN_ARG(field, chan0), CHAN_ARG(field, chan1), \
+              CHAN_ARG(field, chan2)))
+#define CHAN_OUT4(type, field, val, chan0, chan1, chan2, chan3) \
+    (CHAN_CHECK(CHAN_FIELD_CHECK_VAL(type, val) \
+                CHAN_FIELD_CHECK(type, field, chan0) \
+                CHAN_FIELD_CHECK(type, field, chan1) \
+                CHAN_FIELD_CHECK(type, field, chan2) \
+                CHAN_FIELD_CHECK(type, field, chan3)), \
+     chan_out(#field, &(val), CHAN_VAR_LAYOUT(type), 4, \
+              CHAN_ARG(field, chan0), CHAN_ARG(field, chan1), \
+              CHAN_ARG(field, chan2), CHAN_ARG(field, chan3)))
+#define CHAN_OUT5(type, field, val, chan0, chan1, chan2, chan3, chan4) \
+    (CHAN_CHECK(CHAN_FIELD_CHECK_VAL(type, val) \
+                CHAN_FIELD_CHECK(type, field, chan0) \
+                CHAN_FIELD_CHECK(type, field, chan1) \
+                CHAN_FIELD_CHECK(type, field, chan2) \
+                CHAN_FIELD_CHECK(type, field, chan3) \
+                CHAN_FIELD_CHECK(type, field, chan4)), \
+     chan_out(#field, &(val), CHAN_VAR_LAYOUT(type), 5, \
+              CHAN_ARG(field, chan0), CHAN_ARG(field, chan1), \
+              CHAN_ARG(field, chan2), CHAN_ARG(field, chan3), \
+              CHAN_ARG(field, chan4)))
+
+// Bulk access to elements [first, first + count) of an array field: one call
+// walks the channels once for the whole slice, and every element gets the
+// same timestamp, instead of one CHAN_IN1/CHAN_OUT1 per element. The field is
+// named without a subscript, e.g. CHAN_OUT_ARRAY1(digit_t, base, 0, ...).
+// CHAN_IN_ARRAY copies the latest version of each element into dst;
+// CHAN_FILL_ARRAY writes the one value val to every element.
+#define CHAN_ARRAY_ARG(field, first, chan) \
+    &(chan)->meta, &(chan)->data.field[first], sizeof((chan)->data.field[0])
+
+#define CHAN_IN_ARRAY1(type, field, first, dst, count, chan0) \
+    (CHAN_CHECK(CHAN_FIELD_CHECK_VAL(type, (dst)[0]) \
+                CHAN_FIELD_CHECK(type, field[0], chan0)), \
+     chan_in_array(#field, (dst), (count), CHAN_VAR_LAYOUT(type), 1, \
+                   CHAN_ARRAY_ARG(field, first, chan0)))
+#define CHAN_IN_ARRAY2(type, field, first, dst, count, chan0, chan1) \
+    (CHAN_CHECK(CHAN_FIELD_CHECK_VAL(type, (dst)[0]) \
+                CHAN_FIELD_CHECK(type, field[0], chan0) \
+                CHAN_FIELD_CHECK(type, field[0], chan1)), \
+     chan_in_array(#field, (dst), (count), CHAN_VAR_LAYOUT(type), 2, \
+                   CHAN_ARRAY_ARG(field, first, chan0), \
+                   CHAN_ARRAY_ARG(field, first, chan1)))
+#define CHAN_IN_ARRAY3(type, field, first, dst, count, chan0, chan1, chan2) \
+    (CHAN_CHECK(CHAN_FIELD_CHECK_VAL(type, (dst)[0]) \
+                CHAN_FIELD_CHECK(type, field[0], chan0) \
+                CHAN_FIELD_CHECK(type, field[0], chan1) \
+                CHAN_FIELD_CHECK(type, field[0], chan2)), \
+     chan_in_array(#field, (dst), (count), CHAN_VAR_LAYOUT(type), 3, \
+                   CHAN_ARRAY_ARG(field, first, chan0), \
+                   CHAN_ARRAY_ARG(field, first, chan1), \
+                   CHAN_ARRAY_ARG(field, first, chan2)))
+#define CHAN_IN_ARRAY4(type, field, first, dst, count, chan0, chan1, chan2, chan3) \
+    (CHAN_CHECK(CHAN_FIELD_CHECK_VAL(type, (dst)[0]) \
+                CHAN_FIELD_CHECK(type, field[0], chan0) \
+                CHAN_FIELD_CHECK(type, field[0], chan1) \
+                CHAN_FIELD_CHECK(type, field[0], chan2) \
+                CHAN_FIELD_CHECK(type, field[0], chan3)), \
+     chan_in_array(#field, (dst), (count), CHAN_VAR_LAYOUT(type), 4, \
+                   CHAN_ARRAY_ARG(field, first, chan0), \
+                   CHAN_ARRAY_ARG(field, first, chan1), \
+                   CHAN_ARRAY_ARG(field, first, chan2), \
+                   CHAN_ARRAY_ARG(field, first, chan3)))
+
+#define CHAN_OUT_ARRAY1(type, field, first, vals, count, chan0) \
+    (CHAN_CHECK(CHAN_FIELD_CHECK_VAL(type, (vals)[0]) \
+                CHAN_FIELD_CHECK(type, field[0], chan0)), \
+     chan_out_array(#field, (vals), sizeof(type), (count), \
+                    CHAN_VAR_LAYOUT(type), 1, \
+                    CHAN_ARRAY_ARG(field, first, chan0)))
+#define CHAN_OUT_ARRAY2(type, field, first, vals, count, chan0, chan1) \
+    (CHAN_CHECK(CHAN_FIELD_CHECK_VAL(type, (vals)[0]) \
+                CHAN_FIELD_CHECK(type, field[0], chan0) \
+                CHAN_FIELD_CHECK(type, field[0], chan1)), \
+     chan_out_array(#field, (vals), sizeof(type), (count), \
+                    CHAN_VAR_LAYOUT(type), 2, \
+                    CHAN_ARRAY_ARG(field, first, chan0), \
+                    CHAN_ARRAY_ARG(field, first, chan1)))
+
+#define CHAN_FILL_ARRAY1(type, field, first, val, count, chan0) \
+    (CHAN_CHECK(CHAN_FIELD_CHECK_VAL(type, val) \
+                CHAN_FIELD_CHECK(type, field[0], chan0)), \
+     chan_out_array(#field, &(val), 0, (count), CHAN_VAR_LAYOUT(type), 1, \
+                    CHAN_ARRAY_ARG(field, first, chan0)))
+
+// A reference to the elements of an array field from 'first' on, to send
+// through a channel in place of the elements themselves: the receiver reads
+// them with CHAN_IN_ARRAY_REF where the sender keeps them. Sending one hands
+// the slice over: the sender must not write it until the receiver is done,
+// which nothing checks. CHAN_ARRAY_REF2 refers to whichever channel holds the
+// latest version of element 'first', so the slice must have been written as a
+// whole. Self and shared channels swap versions on commit, so a reference
+// into one is rejected at run time.
+typedef struct {
+    chan_meta_t *chan;
+    void *elems; // element 'first' of the field
+    size_t stride;
+} chan_ref_t;
+
+#define CHAN_ARRAY_REF1(type, field, first, chan0) \
+    (CHAN_CHECK(CHAN_FIELD_CHECK(type, field[0], chan0)), \
+     chan_array_ref(CHAN_VAR_LAYOUT(type), 1, CHAN_ARRAY_ARG(field, first, chan0)))
+#define CHAN_ARRAY_REF2(type, field, first, chan0, chan1) \
+    (CHAN_CHECK(CHAN_FIELD_CHECK(type, field[0], chan0) \
+                CHAN_FIELD_CHECK(type, field[0], chan1)), \
+     chan_array_ref(CHAN_VAR_LAYOUT(type), 2, CHAN_ARRAY_ARG(field, first, chan0), \
+                    CHAN_ARRAY_ARG(field, first, chan1)))
+
+#define CHAN_IN_ARRAY_REF(type, ref, first, dst, count) \
+    (CHAN_CHECK(CHAN_FIELD_CHECK_VAL(type, (dst)[0])), \
+     chan_in_array(#ref, (dst), (count), CHAN_VAR_LAYOUT(type), 1, (ref).chan, \
+                   (uint8_t *)(ref).elems + (first) * (ref).stride, (ref).stride))
+
+#define TRANSITION_TO(task) transition_to(TASK_REF(task))
+
+void *chan_in(const char *field_name, size_t var_size, size_t var_offset,
+              size_t value_offset, size_t value_size, int count, ...);
+void chan_out(const char *field_name, const void *value, size_t var_size,
+              size_t var_offset, size_t value_offset, size_t value_size,
+              int count, ...);
+
+void chan_in_array(const char *field_name, void *dst, size_t count,
+                   size_t var_size, size_t var_offset, size_t value_offset,
+                   size_t value_size, int chan_count, ...);
+void chan_out_array(const char *field_name, const void *values,
+                    size_t value_stride, size_t count, size_t var_size,
+                    size_t var_offset, size_t value_offset, size_t value_size,
+                    int chan_count, ...);
+chan_ref_t chan_array_ref(size_t var_size, size_t var_offset, size_t value_offset,
+                          size_t value_size, int chan_count, ...);
+
+void task_prologue();
+void transition_to(const task_t *next_task) __attribute__((noreturn));
+
+#endif // CHAIN_H
@@ -0,0 +1,28 @@
+#ifndef MUTEX_H
+#define MUTEX_H
+
+// Threads only switch on task boundaries on the host, so a task already runs
+// atomically with respect to the other threads and the mutex is bookkeeping.
+
+#include <libchain/chain.h>
+
+typedef struct {
+    bool locked;
+} mutex_t;
+
+#define MUTEX_INITIALIZER { false }
+
+static inline bool mutex_try_lock(mutex_t *m)
+{
+    if (m->locked)
+        return false;
+    m->locked = true;
+    return true;
+}
+
+static inline void mutex_unlock(mutex_t *m)
+{
+    m->locked = false;
+}
+
+#endif // MUTEX_H
@@ -0,0 +1,51 @@
+#ifndef THREAD_H
+#define THREAD_H
+
+// Host stand-in for the multi-threaded chain scheduler. Threads are
+// cooperative: every TRANSITION_TO_MT hands control back to the scheduler,
+// which resumes the next live thread round-robin, one task per turn.
+//
+// thread_init() turns the running task into a bootstrap context that is not a
+// thread itself; THREAD_CREATE() parks a new thread at the given task, and
+// the bootstrap's TRANSITION_TO_MT() starts the scheduler at the thread
+// parked at that task. Once every thread has called THREAD_END() the process
+// exits.
+
+#include <libchain/chain.h>
+
+#ifndef MAX_THREADS
+#define MAX_THREADS 8
+#endif
+
+typedef unsigned thread_id_t;
+
+// Array slices of self/shared fields written by the running task, one record
+// per CHAN_OUT_ARRAY call; past MAX_DIRTY_SLICES, elements are queued singly
+#define MAX_DIRTY_SLICES 8
+
+typedef struct {
+    uint8_t *first; // field_meta_t of the first element
+    size_t stride;
+    size_t count;
+} dirty_slice_t;
+
+typedef struct _thread_t {
+    thread_id_t id;
+    const task_t *task;
+    bool live;
+    field_meta_t *dirty; // self fields written by the running task
+    dirty_slice_t dirty_slices[MAX_DIRTY_SLICES];
+    unsigned num_dirty_slices;
+} thread_t;
+
+#define THREAD_CREATE(task) thread_create(TASK_REF(task))
+#define THREAD_END() thread_end()
+#define TRANSITION_TO_MT(task) transition_to_mt(TASK_REF(task))
+#define THREAD_ID() (curctx->thread ? curctx->thread->id : 0)
+
+void thread_init();
+thread_id_t thread_create(const task_t *task);
+void thread_end();
+void transition_to_mt(const task_t *next_task) __attribute__((noreturn));
+
+#endif // THREAD_H
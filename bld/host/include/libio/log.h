@@ -0,0 +1,20 @@
+#ifndef LIBIO_LOG_H
+#define LIBIO_LOG_H
+
+#include <stdio.h>
+
+#define INIT_CONSOLE()
+
+#define PRINTF(...) printf(__VA_ARGS__)
+
+#define BLOCK_PRINTF_BEGIN()
+#define BLOCK_PRINTF(...) printf(__VA_ARGS__)
+#define BLOCK_PRINTF_END()
+
+#if defined(VERBOSE)
+#define LOG(...) printf(__VA_ARGS__)
+#else
+#define LOG(...)
+#endif
+
+#endif // LIBIO_LOG_H
@@ -0,0 +1,8 @@
+#ifndef LIBMSP_MEM_H
+#define LIBMSP_MEM_H
+
+// Host memory is all volatile RAM: non-volatile placement is a no-op
+#define __nv
+#define __ro_nv
+
+#endif // LIBMSP_MEM_H
@@ -0,0 +1,11 @@
+#ifndef MSP_MATH_H
+#define MSP_MATH_H
+
+#include <stdint.h>
+
+static inline uint32_t mult16(uint16_t a, uint16_t b)
+{
+    return (uint32_t)a * b;
+}
+
+#endif // MSP_MATH_H
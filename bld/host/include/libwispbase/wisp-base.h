@@ -0,0 +1,8 @@
+#ifndef WISP_BASE_H
+#define WISP_BASE_H
+
+#define USRBANK_SIZE 1
+
+static inline void WISP_init() { }
+
+#endif // WISP_BASE_H
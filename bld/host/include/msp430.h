@@ -0,0 +1,27 @@
+#ifndef HOST_MSP430_H
+#define HOST_MSP430_H
+
+// Just enough of the device header for the application to compile on the
+// host: GPIO registers are plain variables and intrinsics are no-ops.
+
+#include <stdint.h>
+
+#define BIT0 (0x0001)
+#define BIT1 (0x0002)
+#define BIT2 (0x0004)
+#define BIT3 (0x0008)
+#define BIT4 (0x0010)
+#define BIT5 (0x0020)
+#define BIT6 (0x0040)
+#define BIT7 (0x0080)
+
+extern volatile uint8_t P1DIR, P1OUT;
+extern volatile uint8_t P2DIR, P2OUT;
+extern volatile uint8_t P3DIR, P3OUT;
+extern volatile uint8_t P4DIR, P4OUT;
+extern volatile uint8_t PJDIR, PJOUT;
+
+#define __enable_interrupt()
+#define __delay_cycles(n)
+
+#endif // HOST_MSP430_H
@@ -1 +1,3 @@
+#ifndef KEY_SIZE_BITS
 #define KEY_SIZE_BITS 128
+#endif
@@ -5,6 +5,9 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#if (defined(BENCHMARK) || defined(BLOCK_CYCLES)) && !defined(__MSP430__)
+#include <time.h>
+#endif
 
 #include <libmsp/mem.h>
 #include <libwispbase/wisp-base.h>
@@ -18,6 +21,45 @@
 #include <libchain/thread.h>
 #include <libchain/mutex.h>
 
+// Bulk access to a slice of an array field comes with the host stand-in for
+// libchain (bld/host) only: on the board, go one CHAN_IN/CHAN_OUT per element.
+#ifndef CHAN_IN_ARRAY1
+#define CHAN_ARRAY_EACH(count, stmt) do { \
+        unsigned _chan_k; \
+        for (_chan_k = 0; _chan_k < (count); ++_chan_k) { \
+            stmt; \
+        } \
+    } while (0)
+#define CHAN_IN_ARRAY1(type, field, first, dst, count, chan0) \
+    CHAN_ARRAY_EACH(count, (dst)[_chan_k] = \
+        *CHAN_IN1(type, field[(first) + _chan_k], chan0))
+#define CHAN_IN_ARRAY2(type, field, first, dst, count, chan0, chan1) \
+    CHAN_ARRAY_EACH(count, (dst)[_chan_k] = \
+        *CHAN_IN2(type, field[(first) + _chan_k], chan0, chan1))
+#define CHAN_IN_ARRAY3(type, field, first, dst, count, chan0, chan1, chan2) \
+    CHAN_ARRAY_EACH(count, (dst)[_chan_k] = \
+        *CHAN_IN3(type, field[(first) + _chan_k], chan0, chan1, chan2))
+#define CHAN_IN_ARRAY4(type, field, first, dst, count, chan0, chan1, chan2, chan3) \
+    CHAN_ARRAY_EACH(count, (dst)[_chan_k] = \
+        *CHAN_IN4(type, field[(first) + _chan_k], chan0, chan1, chan2, chan3))
+#define CHAN_OUT_ARRAY1(type, field, first, vals, count, chan0) \
+    CHAN_ARRAY_EACH(count, \
+        CHAN_OUT1(type, field[(first) + _chan_k], (vals)[_chan_k], chan0))
+#define CHAN_OUT_ARRAY2(type, field, first, vals, count, chan0, chan1) \
+    CHAN_ARRAY_EACH(count, \
+        CHAN_OUT2(type, field[(first) + _chan_k], (vals)[_chan_k], chan0, chan1))
+#define CHAN_FILL_ARRAY1(type, field, first, val, count, chan0) \
+    CHAN_ARRAY_EACH(count, CHAN_OUT1(type, field[(first) + _chan_k], val, chan0))
+#endif
+
+// Shared channels are host-only too: on the board, a self channel named after
+// the shared one stands in. Its writes are committed on the writing task's
+// transition, as the host commits them on the writer thread's.
+#ifndef SHARED_CHANNEL
+#define SHARED_CHANNEL(name, type) SELF_CHANNEL(name, type)
+#define SHARED_CH(name) SELF_IN_CH(name)
+#endif
+
 #ifdef CONFIG_LIBEDB_PRINTF
 #include <libedb/edb.h>
 #endif
@@ -31,16 +73,180 @@
 #include "../data/keysize.h"
 
 /*--------------------------cuckoo defs and channels-----------------------------*/
-#define NUM_INSERTS (NUM_BUCKETS / 4) // shoot for 25% occupancy
-#define NUM_LOOKUPS NUM_INSERTS
 #define NUM_BUCKETS 256//256 // must be a power of 2
+
+// Fingerprint slots per bucket (1, 2, 4 or 8). With one slot per bucket,
+// inserts start failing past ~50% occupancy; with 4 slots the filter stays
+// healthy beyond 90%.
+#ifndef BUCKET_SIZE
+#define BUCKET_SIZE 1
+#endif
+
+#if BUCKET_SIZE != 1 && BUCKET_SIZE != 2 && BUCKET_SIZE != 4 && BUCKET_SIZE != 8
+#error BUCKET_SIZE must be 1, 2, 4 or 8
+#endif
+
+#define NUM_SLOTS (NUM_BUCKETS * BUCKET_SIZE)
+#define SLOT(index, slot) ((index) * BUCKET_SIZE + (slot))
+
+// Fingerprint width in bits (8, 12 or 16). The filter channel holds one
+// field per bucket with its fingerprints bit-packed, so narrower
+// fingerprints shrink the filter. The false-positive rate grows to about
+// 2 * BUCKET_SIZE / 2^FP_BITS.
+#ifndef FP_BITS
+#define FP_BITS 16
+#endif
+
+#if FP_BITS != 8 && FP_BITS != 12 && FP_BITS != 16
+#error FP_BITS must be 8, 12 or 16
+#endif
+
+#define FP_MASK ((1UL << FP_BITS) - 1)
+#define BUCKET_BYTES ((BUCKET_SIZE * FP_BITS + 7) / 8)
+
+#if BUCKET_SIZE == 1
+#define NUM_INSERTS (NUM_BUCKETS / 4) // shoot for 25% occupancy
 #define MAX_RELOCATIONS 8
+#elif BUCKET_SIZE == 2
+#define NUM_INSERTS (NUM_SLOTS * 8 / 10) // shoot for 80% occupancy
+#define MAX_RELOCATIONS 64
+#else
+#define NUM_INSERTS (NUM_SLOTS * 9 / 10) // shoot for 90% occupancy
+#define MAX_RELOCATIONS 64
+#endif
+#define NUM_LOOKUPS NUM_INSERTS
+
+// Filter slots one insert can write: the new fingerprint's slot plus one per
+// relocation. With VERBOSE, task_insert_done logs only these slots; define
+// DUMP_FILTER to also dump the whole filter after every insert.
+#define JOURNAL_SIZE (MAX_RELOCATIONS + 2)
+
+// Keys handled per activation of the batched insert/lookup tasks, which
+// replace the per-key chain (insert, calc_indexes x3, add, relocate) with a
+// single task that hashes every key of the batch and commits the filter once.
+// Size it to what one charge of the energy buffer completes. 1 disables it.
+#ifndef BATCH_SIZE
+#define BATCH_SIZE 1
+#endif
+
+// Filter buckets one insert batch can touch before committing. A key can
+// touch up to JOURNAL_SIZE of them, so a batch that may not fit the next key
+// ends early and the remaining keys carry over to the next activation.
+#define BATCH_MAX_UPDATES \
+    (BATCH_SIZE * 8 > JOURNAL_SIZE ? BATCH_SIZE * 8 : JOURNAL_SIZE)
+
+#define HASH_MULTIPLIER 0x9e3779b1UL // odd, ~2^32/phi
+
+// Define FUSED_HASH to derive the fingerprint and both bucket indexes from a
+// single multiply-shift hash in task_calc_indexes, instead of three hashes
+// spread over three tasks.
+#ifdef FUSED_HASH
+#define NUM_FP_INDEXES 256 // alternate-bucket offsets, by fingerprint low byte
+#define INDEX_BITS 8 // log2(NUM_BUCKETS)
+
+#if (1 << INDEX_BITS) != NUM_BUCKETS
+#error INDEX_BITS must be log2(NUM_BUCKETS)
+#endif
+#endif
+
+// Define RELOCATE_BFS to replace the random-walk eviction with a bounded
+// breadth-first search over candidate buckets: task_relocate finds the
+// shortest path to a free slot and applies it in one task. An insert that
+// finds no path within the bounds fails without evicting anything.
+#ifdef RELOCATE_BFS
+#ifndef BFS_MAX_DEPTH
+#define BFS_MAX_DEPTH MAX_RELOCATIONS // moves of existing fingerprints
+#endif
+#ifndef BFS_MAX_NODES
+#define BFS_MAX_NODES 64 // buckets visited; at most 255
+#endif
+
+// Node indexes are uint8_t parents, with 0xff marking a root
+#if BFS_MAX_NODES < 1 || BFS_MAX_NODES > 255
+#error BFS_MAX_NODES must be between 1 and 255
+#endif
+
+// A path is journaled like a random walk, one slot per move
+#if BFS_MAX_DEPTH < 1 || BFS_MAX_DEPTH > MAX_RELOCATIONS
+#error BFS_MAX_DEPTH must be between 1 and MAX_RELOCATIONS
+#endif
+#endif
+
+// Fingerprints that run out of relocations go to a stash of this many
+// entries instead of being dropped. Lookups check the stash after both
+// buckets miss, and task_stash_rehome retries one stashed fingerprint after
+// each insert. 0 disables the stash.
+#ifndef STASH_SIZE
+#define STASH_SIZE 0
+#endif
+
+#if STASH_SIZE > 0 && BATCH_SIZE > 1
+#error STASH_SIZE is not supported with BATCH_SIZE > 1
+#endif
+
+#define STASH_NONE STASH_SIZE // eviction chain did not start from the stash
+
+// Define BENCHMARK to replace the fixed insert/lookup run with a load-factor
+// sweep: task_bench fills the filter to each load (keys offered per slot)
+// from BENCH_LOAD_MIN to BENCH_LOAD_MAX percent, and after each step times
+// BENCH_NEG_LOOKUPS lookups of keys never inserted and lookups of every key
+// inserted so far. It prints one CSV row per step, prefixed "bench,". The
+// RSA thread is not started, so the filter has the core to itself.
+#ifdef BENCHMARK
+#ifndef BENCH_LOAD_MIN
+#define BENCH_LOAD_MIN 10
+#endif
+#ifndef BENCH_LOAD_MAX
+#define BENCH_LOAD_MAX 95
+#endif
+#ifndef BENCH_LOAD_STEP
+#define BENCH_LOAD_STEP 5
+#endif
+#ifndef BENCH_NEG_LOOKUPS
+#define BENCH_NEG_LOOKUPS 1024
+#endif
+
+#if BATCH_SIZE > 1
+#error BENCHMARK is not supported with BATCH_SIZE > 1
+#endif
+
+#define BENCH_LEVELS ((BENCH_LOAD_MAX - BENCH_LOAD_MIN) / BENCH_LOAD_STEP + 1)
+
+// Negative lookups take the keys that follow the inserted ones in the key
+// sequence, which has a period of 2^16
+#if NUM_SLOTS * BENCH_LOAD_MAX / 100 + BENCH_NEG_LOOKUPS >= 65536
+#error BENCH_NEG_LOOKUPS too large for the key sequence
+#endif
+#endif
+
+// Define PROBE_LOOKUPS=N to start a second cuckoo thread that, while the
+// inserts run, looks up the N keys that follow the inserted ones in the key
+// sequence, and prints how many of them the filter's buckets hold: false
+// positives, as the filter fills. It calls ch_calc_indexes concurrently with
+// the insert thread, each in its own frame (see CALC_INDEXES_CALLERS).
+#ifdef PROBE_LOOKUPS
+#if defined(BENCHMARK) || defined(BLOCK_CYCLES) || BATCH_SIZE > 1
+#error PROBE_LOOKUPS runs next to the per-key inserts of the fixed run
+#endif
+
+#if NUM_INSERTS + PROBE_LOOKUPS >= 65536
+#error PROBE_LOOKUPS too large for the key sequence
+#endif
+#endif
 
 typedef uint16_t value_t;
 typedef uint16_t hash_t;
+#if FP_BITS == 8
+typedef uint8_t fingerprint_t;
+#else
 typedef uint16_t fingerprint_t;
+#endif
 typedef uint16_t index_t; // bucket index
 
+typedef struct {
+    uint8_t fp[BUCKET_BYTES]; // BUCKET_SIZE packed fingerprints, 0 if free
+} bucket_t;
+
 typedef struct _insert_count {
     unsigned insert_count;
     unsigned inserted_count;
@@ -51,6 +257,31 @@ typedef struct _lookup_count {
     unsigned member_count;
 } lookup_count_t;
 
+#ifdef BENCHMARK
+typedef enum {
+    BENCH_PHASE_START,
+    BENCH_PHASE_INSERTS,
+    BENCH_PHASE_POS_LOOKUPS,
+    BENCH_PHASE_NEG_LOOKUPS,
+} bench_phase_t;
+
+typedef struct {
+    unsigned phase; // bench_phase_t of the running phase
+    unsigned level;
+    uint32_t phase_start; // bench_clock() when the phase started, us
+    unsigned insert_count; // totals at the end of the last insert phase
+    unsigned failed_count;
+    // CSV row of the current level
+    unsigned inserts;
+    unsigned failed;
+    uint32_t insert_us;
+    uint32_t reloc_sum; // unsigned is 16 bits on the board
+    unsigned reloc_max;
+    unsigned missed;
+    uint32_t pos_lookup_us;
+} bench_t;
+#endif
+
 struct msg_key {
     CHAN_FIELD(value_t, key);
 };
@@ -58,11 +289,59 @@ struct msg_key {
 struct msg_genkey {
     CHAN_FIELD(value_t, key);
     CHAN_FIELD(task_t*, next_task);
+#if BATCH_SIZE > 1
+    CHAN_FIELD(unsigned, batch_count);
+#endif
+};
+
+struct msg_keys {
+    CHAN_FIELD_ARRAY(value_t, key, BATCH_SIZE);
+    CHAN_FIELD(unsigned, batch_count);
+    CHAN_FIELD(unsigned, batch_first); // first key not yet inserted
 };
 
+// The ch_calc_indexes call, and the channels inside it, keep one frame per
+// calling thread, so concurrent calls never share a field: the fields sit
+// between FRAMES_BEGIN and FRAMES_END and are accessed as FRAME(field). A
+// call runs on its caller's thread, so caller and callee agree on the frame
+// without passing anything. By default only the cuckoo thread calls it, and
+// the frame is the plain fields. With CALC_INDEXES_CALLERS frames, task_init
+// gives each calling thread its frame as it creates the thread
+// (CALC_INDEXES_CALLER), and a thread with none is stopped.
+#ifndef CALC_INDEXES_CALLERS
+#ifdef PROBE_LOOKUPS
+#define CALC_INDEXES_CALLERS 2
+#else
+#define CALC_INDEXES_CALLERS 1
+#endif
+#endif
+
+#if CALC_INDEXES_CALLERS < 1 || CALC_INDEXES_CALLERS > 4
+#error CALC_INDEXES_CALLERS must be between 1 and 4
+#endif
+
+#if defined(PROBE_LOOKUPS) && CALC_INDEXES_CALLERS < 2
+#error PROBE_LOOKUPS calls ch_calc_indexes from two threads
+#endif
+
+#if CALC_INDEXES_CALLERS > 1
+#define CALC_INDEXES_NO_CALLER 0xffff
+#define FRAMES_BEGIN struct {
+#define FRAMES_END } frame[CALC_INDEXES_CALLERS];
+#define FRAME(field) frame[calc_indexes_frame()].field
+#define CALC_INDEXES_CALLER(f, thread) (calc_indexes_caller[f] = (thread))
+#else
+#define FRAMES_BEGIN
+#define FRAMES_END
+#define FRAME(field) field
+#define CALC_INDEXES_CALLER(f, thread)
+#endif
+
 struct msg_calc_indexes {
+    FRAMES_BEGIN
     CHAN_FIELD(value_t, key);
     CHAN_FIELD(task_t*, next_task);
+    FRAMES_END
 };
 
 struct msg_self_key {
@@ -73,54 +352,91 @@ struct msg_self_key {
 }
 
 struct msg_indexes {
+    FRAMES_BEGIN
     CHAN_FIELD(fingerprint_t, fingerprint);
     CHAN_FIELD(index_t, index1);
     CHAN_FIELD(index_t, index2);
+    FRAMES_END
 };
 
 struct msg_fingerprint {
+    FRAMES_BEGIN
     CHAN_FIELD(fingerprint_t, fingerprint);
+    FRAMES_END
 };
 
 struct msg_index1 {
+    FRAMES_BEGIN
     CHAN_FIELD(index_t, index1);
+    FRAMES_END
 };
 
+// The one copy of the filter: every cuckoo task updates it in place. Only the
+// cuckoo thread may write it: a write is committed with its writer's dirty
+// fields, and a field already dirty this round is not queued for a second
+// thread, whose transition would then leave it uncommitted.
 struct msg_filter {
-    CHAN_FIELD_ARRAY(fingerprint_t, filter, NUM_BUCKETS);
+    SELF_CHAN_FIELD_ARRAY(bucket_t, filter, NUM_BUCKETS);
 };
-
-struct msg_self_filter {
-    SELF_CHAN_FIELD_ARRAY(fingerprint_t, filter, NUM_BUCKETS);
-};
-#define FIELD_INIT_msg_self_filter { \
+#define FIELD_INIT_msg_filter { \
     SELF_FIELD_ARRAY_INITIALIZER(NUM_BUCKETS) \
 }
 
 struct msg_filter_insert_done {
-    CHAN_FIELD_ARRAY(fingerprint_t, filter, NUM_BUCKETS);
+    CHAN_FIELD_ARRAY(unsigned, journal, JOURNAL_SIZE); // slots written
+    CHAN_FIELD(unsigned, journal_len);
     CHAN_FIELD(bool, success);
+#ifdef BENCHMARK
+    CHAN_FIELD(unsigned, relocations); // existing fingerprints moved
+#endif
 };
 
 struct msg_victim {
-    CHAN_FIELD_ARRAY(fingerprint_t, filter, NUM_BUCKETS);
     CHAN_FIELD(fingerprint_t, fp_victim);
     CHAN_FIELD(index_t, index_victim);
     CHAN_FIELD(unsigned, relocation_count);
+#if STASH_SIZE > 0
+    CHAN_FIELD(unsigned, stash_entry);
+#endif
 };
 
+#if STASH_SIZE > 0
+struct msg_stash {
+    CHAN_FIELD_ARRAY(fingerprint_t, stash_fp, STASH_SIZE); // 0 if free
+    CHAN_FIELD_ARRAY(index_t, stash_index, STASH_SIZE); // bucket evicted from
+    CHAN_FIELD(unsigned, stash_count);
+};
+
+struct msg_self_victim {
+    SELF_CHAN_FIELD(fingerprint_t, fp_victim);
+    SELF_CHAN_FIELD(index_t, index_victim);
+    SELF_CHAN_FIELD(unsigned, relocation_count);
+    SELF_CHAN_FIELD(unsigned, stash_entry);
+    SELF_CHAN_FIELD_ARRAY(fingerprint_t, stash_fp, STASH_SIZE);
+    SELF_CHAN_FIELD_ARRAY(index_t, stash_index, STASH_SIZE);
+    SELF_CHAN_FIELD(unsigned, stash_count);
+};
+#define FIELD_INIT_msg_self_victim { \
+    SELF_FIELD_INITIALIZER, \
+    SELF_FIELD_INITIALIZER, \
+    SELF_FIELD_INITIALIZER, \
+    SELF_FIELD_INITIALIZER, \
+    SELF_FIELD_ARRAY_INITIALIZER(STASH_SIZE), \
+    SELF_FIELD_ARRAY_INITIALIZER(STASH_SIZE), \
+    SELF_FIELD_INITIALIZER \
+}
+#else
 struct msg_self_victim {
-    SELF_CHAN_FIELD_ARRAY(fingerprint_t, filter, NUM_BUCKETS);
     SELF_CHAN_FIELD(fingerprint_t, fp_victim);
     SELF_CHAN_FIELD(index_t, index_victim);
     SELF_CHAN_FIELD(unsigned, relocation_count);
 };
 #define FIELD_INIT_msg_self_victim { \
-    SELF_FIELD_ARRAY_INITIALIZER(NUM_BUCKETS), \
     SELF_FIELD_INITIALIZER, \
     SELF_FIELD_INITIALIZER, \
     SELF_FIELD_INITIALIZER \
 }
+#endif
 
 struct msg_hash_args {
     CHAN_FIELD(value_t, data);
@@ -140,6 +456,20 @@ struct msg_lookup_result {
     CHAN_FIELD(bool, member);
 };
 
+#ifdef BENCHMARK
+struct msg_self_insert_count {
+    SELF_CHAN_FIELD(unsigned, insert_count);
+    SELF_CHAN_FIELD(unsigned, inserted_count);
+    SELF_CHAN_FIELD(uint32_t, reloc_sum);
+    SELF_CHAN_FIELD(unsigned, reloc_max);
+};
+#define FIELD_INIT_msg_self_insert_count {\
+    SELF_FIELD_INITIALIZER, \
+    SELF_FIELD_INITIALIZER, \
+    SELF_FIELD_INITIALIZER, \
+    SELF_FIELD_INITIALIZER \
+}
+#else
 struct msg_self_insert_count {
     SELF_CHAN_FIELD(unsigned, insert_count);
     SELF_CHAN_FIELD(unsigned, inserted_count);
@@ -148,6 +478,7 @@ struct msg_self_insert_count {
     SELF_FIELD_INITIALIZER, \
     SELF_FIELD_INITIALIZER \
 }
+#endif
 
 struct msg_self_lookup_count {
     SELF_CHAN_FIELD(unsigned, lookup_count);
@@ -176,10 +507,70 @@ struct msg_member_count {
     CHAN_FIELD(unsigned, member_count);
 };
 
+struct msg_batch_result {
+    CHAN_FIELD(unsigned, batch_count);
+    CHAN_FIELD(unsigned, hit_count); // keys inserted or found
+};
+
+#ifdef BENCHMARK
+struct msg_bench {
+    CHAN_FIELD(bench_t, bench);
+};
+
+struct msg_self_bench {
+    SELF_CHAN_FIELD(bench_t, bench);
+};
+#define FIELD_INIT_msg_self_bench { \
+    SELF_FIELD_INITIALIZER \
+}
+
+struct msg_bench_inserts {
+    CHAN_FIELD(unsigned, insert_target);
+    CHAN_FIELD(uint32_t, reloc_sum);
+    CHAN_FIELD(unsigned, reloc_max);
+};
+
+struct msg_bench_lookups {
+    CHAN_FIELD(unsigned, lookup_target);
+    CHAN_FIELD(unsigned, lookup_count);
+    CHAN_FIELD(unsigned, member_count);
+};
+
+struct msg_bench_insert_stats {
+    CHAN_FIELD(unsigned, insert_count);
+    CHAN_FIELD(unsigned, inserted_count);
+    CHAN_FIELD(uint32_t, reloc_sum);
+    CHAN_FIELD(unsigned, reloc_max);
+};
+#endif
+
+struct msg_batch_carry {
+    CHAN_FIELD(unsigned, batch_first);
+};
+
+#ifdef PROBE_LOOKUPS
+struct msg_probe {
+    CHAN_FIELD(value_t, key);
+    CHAN_FIELD(unsigned, probe_count);
+    CHAN_FIELD(unsigned, hit_count); // false positives
+};
+#endif
+
+struct msg_insert_batch_done {
+    CHAN_FIELD(unsigned, batch_count);
+    CHAN_FIELD(unsigned, hit_count);
+    CHAN_FIELD(unsigned, carry_first); // keys left over from here on, or 0
+    CHAN_FIELD_ARRAY(unsigned, journal, BATCH_MAX_UPDATES); // buckets written
+    CHAN_FIELD(unsigned, journal_len);
+};
+
 TASK(1,  task_init)
 TASK(2,  task_generate_key)
 TASK(3,  task_insert)
 TASK(4,  task_calc_indexes)
+#if STASH_SIZE > 0
+TASK(5,  task_stash_rehome)
+#endif
 TASK(15,  task_calc_indexes_index_1)
 TASK(6,  task_calc_indexes_index_2)
 TASK(7,  task_add) // TODO: rename: add 'insert' prefix
@@ -190,32 +581,31 @@ TASK(11, task_lookup_search)
 TASK(12, task_lookup_done)
 TASK(13, task_print_stats)
 TASK(14, task_done)
+#if BATCH_SIZE > 1
+TASK_EXT(21, task_insert_batch)
+TASK_EXT(22, task_lookup_batch)
+#endif
+#ifdef BENCHMARK
+TASK_EXT(23, task_bench)
+#endif
+#ifdef PROBE_LOOKUPS
+TASK_EXT(40, task_probe)
+TASK_EXT(41, task_probe_search)
+#endif
 
 CHANNEL(task_init, task_generate_key, msg_genkey);
 CHANNEL(task_init, task_insert_done, msg_insert_count);
 CHANNEL(task_init, task_lookup_done, msg_lookup_count);
 MULTICAST_CHANNEL(msg_key, ch_key, task_generate_key, task_insert, task_lookup);
 SELF_CHANNEL(task_insert, msg_self_key);
-MULTICAST_CHANNEL(msg_filter, ch_filter, task_init,
-                  task_add, task_relocate, task_insert_done,
-                  task_lookup_search, task_print_stats);
-MULTICAST_CHANNEL(msg_filter, ch_filter_add, task_add,
-                  tsk_relocate, task_insert_done, task_lookup_search,
-                  task_print_stats);
-MULTICAST_CHANNEL(msg_filter, ch_filter_relocate, task_relocate,
-                  task_add, task_insert_done, task_lookup_search,
-                  task_print_stats);
+SHARED_CHANNEL(ch_filter, msg_filter);
 CALL_CHANNEL(ch_calc_indexes, msg_calc_indexes);
 RET_CHANNEL(ch_calc_indexes, msg_indexes);
 CHANNEL(task_calc_indexes, task_calc_indexes_index_2, msg_fingerprint);
 CHANNEL(task_calc_indexes_index_1, task_calc_indexes_index_2, msg_index1);
 CHANNEL(task_add, task_relocate, msg_victim);
-SELF_CHANNEL(task_add, msg_self_filter);
 CHANNEL(task_add, task_insert_done, msg_filter_insert_done);
-MULTICAST_CHANNEL(msg_filter, ch_reloc_filter, task_relocate,
-                  task_add, task_insert_done);
 SELF_CHANNEL(task_relocate, msg_self_victim);
-CHANNEL(task_relocate, task_add, msg_filter);
 CHANNEL(task_relocate, task_insert_done, msg_filter_insert_done);
 CHANNEL(task_lookup, task_lookup_done, msg_lookup_result);
 SELF_CHANNEL(task_insert_done, msg_self_insert_count);
@@ -226,26 +616,289 @@ CHANNEL(task_insert_done, task_print_stats, msg_inserted_count);
 CHANNEL(task_lookup_done, task_print_stats, msg_member_count);
 SELF_CHANNEL(task_generate_key, msg_self_key);
 CHANNEL(task_lookup_search, task_lookup_done, msg_member);
+#if STASH_SIZE > 0
+MULTICAST_CHANNEL(msg_stash, ch_stash_init, task_init,
+                  task_relocate, task_stash_rehome, task_insert_done,
+                  task_lookup_search, task_print_stats);
+MULTICAST_CHANNEL(msg_stash, ch_stash, task_relocate,
+                  task_stash_rehome, task_insert_done, task_lookup_search,
+                  task_print_stats);
+CHANNEL(task_stash_rehome, task_relocate, msg_victim);
+#endif
+#if BATCH_SIZE > 1
+MULTICAST_CHANNEL(msg_keys, ch_keys, task_generate_key,
+                  task_insert_batch, task_lookup_batch);
+CHANNEL(task_insert_batch, task_insert_done, msg_insert_batch_done);
+CHANNEL(task_insert_done, task_insert_batch, msg_batch_carry);
+CHANNEL(task_lookup_batch, task_lookup_done, msg_batch_result);
+#endif
+#ifdef BENCHMARK
+CHANNEL(task_init, task_bench, msg_bench);
+SELF_CHANNEL(task_bench, msg_self_bench);
+CHANNEL(task_bench, task_generate_key, msg_genkey);
+CHANNEL(task_bench, task_insert_done, msg_bench_inserts);
+CHANNEL(task_bench, task_lookup_done, msg_bench_lookups);
+CHANNEL(task_insert_done, task_bench, msg_bench_insert_stats);
+CHANNEL(task_lookup_done, task_bench, msg_member_count);
+#endif
+#ifdef PROBE_LOOKUPS
+CHANNEL(task_init, task_probe, msg_probe);
+CHANNEL(task_probe, task_probe_search, msg_probe);
+CHANNEL(task_probe_search, task_probe, msg_probe);
+#endif
 
 /*--------------------------rsa defs and channels-----------------------------*/
+// Bits of a bignum digit (8 or 16), each held in a digit_t. With 16, the
+// digit count, and so the channel traffic, halves and the schoolbook
+// multiply does a quarter of the digit products; intermediate sums then
+// need 32-bit (and in the quotient estimate 64-bit) arithmetic.
+#ifndef DIGIT_BITS
 #define DIGIT_BITS 8
+#endif
+
+#if DIGIT_BITS == 8
 #define DIGIT_MASK 0x00ff
+#elif DIGIT_BITS == 16
+#define DIGIT_MASK 0xffff
+#else
+#error DIGIT_BITS must be 8 or 16
+#endif
+
+// Modulus width, from data/keysize.h unless overridden, e.g.
+// CONFIG="-DKEY_SIZE_BITS=1024". Each size selects its data/key<bits>.txt.
+#if KEY_SIZE_BITS != 32 && KEY_SIZE_BITS != 64 && KEY_SIZE_BITS != 128 && \
+    KEY_SIZE_BITS != 256 && KEY_SIZE_BITS != 512 && KEY_SIZE_BITS != 1024 && \
+    KEY_SIZE_BITS != 2048
+#error KEY_SIZE_BITS must be one of the key sizes in data/: 32 to 2048
+#endif
+
+#define DIGIT_BYTES (DIGIT_BITS / 8)
+#define KEY_SIZE_BYTES (KEY_SIZE_BITS / 8)
 #define NUM_DIGITS (KEY_SIZE_BITS / DIGIT_BITS)
-//Pay no attention to the hardcoded value behind the curtain... 
-#define NUM_DIGITS_x2 32
+#define NUM_DIGITS_x2 (2 * NUM_DIGITS) // digits in a product of two bignums
 
 
 typedef uint16_t digit_t;
+#if DIGIT_BITS == 8
+typedef uint16_t ddigit_t; // two digits: a digit product plus carries
+typedef uint32_t tdigit_t; // three digits
+#else
+typedef uint32_t ddigit_t;
+typedef uint64_t tdigit_t;
+#endif
+
+// Column sum of task_mult: up to NUM_DIGITS digit products, split into low
+// and high digits, plus the carry in. Two digits hold it up to 128 digits.
+#if DIGIT_BITS == 8 && NUM_DIGITS > 128
+typedef uint32_t acc_t;
+#else
+typedef ddigit_t acc_t;
+#endif
+
+typedef uint32_t exponent_t; // wide enough for e = 65537
 
 typedef struct {
-    uint8_t n[NUM_DIGITS]; // modulus
-    digit_t e;  // exponent
+    uint8_t n[KEY_SIZE_BYTES]; // modulus
+    exponent_t e;  // exponent
 } pubkey_t;
 
 #if NUM_DIGITS < 2
 #error The modular reduction implementation requires at least 2 digits
 #endif
 
+// Define MONTGOMERY to run the exponentiation in Montgomery form: task_pad
+// converts each block into it, task_mult_mod multiplies and reduces in one
+// interleaved loop (instead of calling task_mult and the long-division reduce
+// chain), and task_mult_block_get_result converts the result back. R^2 mod N
+// and N' = -N^-1 mod 2^DIGIT_BITS are computed once in task_init.
+
+// Define BARRETT to replace the long-division reduce chain with Barrett
+// reduction: mu = floor(b^2k / N), for the k-digit modulus N and digit base
+// b, is computed once in task_init, and the product of task_mult or
+// task_square is reduced in two hops: task_reduce_barrett_quotient estimates
+// the quotient with one multiply by mu, task_reduce_barrett_subtract
+// subtracts that multiple of N and corrects the remainder with at most two
+// more subtractions of N.
+#if defined(BARRETT) && defined(MONTGOMERY)
+#error BARRETT and MONTGOMERY are alternative reductions
+#endif
+
+// Moduli of at least KARATSUBA_THRESHOLD digits are multiplied by Karatsuba
+// instead of task_mult's column-wise schoolbook: task_karatsuba forms the
+// three half-size products a0 * b0, a1 * b1 and (a0 + a1) * (b0 + b1), one
+// per hop, into scratch channels, recursing down to KARATSUBA_THRESHOLD
+// digits within each, and task_karatsuba_combine assembles the product. 0,
+// the default, leaves task_mult on. MONTGOMERY multiplies inside mont_mult
+// and is unaffected.
+#ifndef KARATSUBA_THRESHOLD
+#define KARATSUBA_THRESHOLD 0
+#endif
+
+#if KARATSUBA_THRESHOLD > 0 && KARATSUBA_THRESHOLD < 4
+#error KARATSUBA_THRESHOLD must be 0 (off) or at least 4
+#endif
+
+#if KARATSUBA_THRESHOLD > 0 && NUM_DIGITS >= KARATSUBA_THRESHOLD && !defined(MONTGOMERY)
+#define MULT_KARATSUBA
+#define KARATSUBA_LO (NUM_DIGITS / 2)            // digits of a0, b0
+#define KARATSUBA_HI (NUM_DIGITS - KARATSUBA_LO) // digits of a1, b1
+#endif
+
+// With PRINT_PRODUCT set, task_mult and the reduce tasks copy every
+// intermediate product into ch_print_product and hop through
+// task_print_product, which logs it. Otherwise they transition straight to
+// their successor. Defaults to on with VERBOSE only.
+#ifndef PRINT_PRODUCT
+#ifdef VERBOSE
+#define PRINT_PRODUCT 1
+#else
+#define PRINT_PRODUCT 0
+#endif
+#endif
+
+#if PRINT_PRODUCT
+#define PRINT_PRODUCT_DIGIT(i, val) \
+    CHAN_OUT1(digit_t, LANE(product[i]), val, CALL_CH(ch_print_product))
+#define PRINT_PRODUCT_DIGITS(first, vals, count) \
+    CHAN_OUT_ARRAY1(digit_t, LANE(product), first, vals, count, CALL_CH(ch_print_product))
+#define PRINT_PRODUCT_ZEROS(first, count) do { \
+        digit_t _zero = 0; \
+        CHAN_FILL_ARRAY1(digit_t, LANE(product), first, _zero, count, \
+                         CALL_CH(ch_print_product)); \
+    } while (0)
+#define TRANSITION_VIA_PRINT_PRODUCT(next) do { \
+        const task_t *_next_task = (next); \
+        CHAN_OUT1(task_t *, LANE(next_task), _next_task, CALL_CH(ch_print_product)); \
+        TRANSITION_TO_MT(task_print_product); \
+    } while (0)
+#else
+#define PRINT_PRODUCT_DIGIT(i, val)
+#define PRINT_PRODUCT_DIGITS(first, vals, count)
+#define PRINT_PRODUCT_ZEROS(first, count)
+#define TRANSITION_VIA_PRINT_PRODUCT(next) transition_to_mt(next)
+#endif
+
+// Number of threads encrypting blocks side by side. Thread l takes blocks l,
+// l + RSA_THREADS, ... and writes them to their place in the cyphertext;
+// the thread that finishes last prints it. Every channel of the RSA chain,
+// except the key constants and the cyphertext itself, then holds one
+// instance per thread: its fields sit between LANES_BEGIN and LANES_END, and
+// are accessed as LANE(field), or as LANE_AT(l, field) from task_init. The
+// lane threads are created first, so a thread id is its lane.
+#ifndef RSA_THREADS
+#define RSA_THREADS 1
+#endif
+
+#if RSA_THREADS < 1 || RSA_THREADS > 4
+#error RSA_THREADS must be between 1 and 4
+#endif
+
+#if RSA_THREADS > 1
+#ifdef BLOCK_CYCLES
+#error BLOCK_CYCLES times one block at a time and needs RSA_THREADS=1
+#endif
+#define RSA_LANE THREAD_ID()
+#define LANES_BEGIN struct {
+#define LANES_END } lane[RSA_THREADS];
+#define LANES_INIT(...) { [0 ... RSA_THREADS - 1] = { __VA_ARGS__ } }
+#define LANE(field) lane[RSA_LANE].field
+#define LANE_AT(l, field) lane[l].field
+#else
+#define LANES_BEGIN
+#define LANES_END
+#define LANES_INIT(...) __VA_ARGS__
+#define LANE(field) field
+#define LANE_AT(l, field) field
+#endif
+
+// Define STREAM_CYPHERTEXT to print each block as soon as it is encrypted,
+// as "Cyphertext block <index>:", instead of collecting the whole cyphertext
+// for task_print_cyphertext. Blocks pass through a ring of one block slot
+// per lane, emptied by task_emit_block before the lane starts its next
+// block, so memory no longer grows with the message. With RSA_THREADS > 1,
+// blocks come out in the order they finish.
+#if defined(STREAM_CYPHERTEXT) && defined(CRT_DECRYPT)
+#error CRT_DECRYPT decrypts the collected cyphertext, which STREAM_CYPHERTEXT does not keep
+#endif
+
+// Define BLOCK_CYCLES to time the encryption of each block and print a
+// per-key-size summary after the cyphertext ('make rsa-scaling' in bld/host
+// sweeps the key sizes). On the board the clock counts CPU cycles; the host
+// has no portable cycle counter and reports microseconds instead. Only the
+// RSA thread is started, so the cuckoo filter does not inflate the count.
+#ifdef BLOCK_CYCLES
+#ifdef BENCHMARK
+#error BLOCK_CYCLES and BENCHMARK each run their own thread only
+#endif
+typedef uint64_t block_time_t;
+#endif
+
+// Exponent bits consumed per table multiply. With 1, task_exp scans the
+// exponent right to left, one bit per task hop, and every set bit costs a
+// multiply. With EXP_WINDOW = k > 1, it scans left to right in windows of up
+// to k bits that end in a set bit, multiplying by a table of the odd powers
+// base^1, base^3, ..., base^(2^k - 1) built once per block, so a set bit
+// costs about 1/(k+1) multiplies.
+#ifndef EXP_WINDOW
+#define EXP_WINDOW 1
+#endif
+
+#if EXP_WINDOW < 1 || EXP_WINDOW > 6
+#error EXP_WINDOW must be between 1 and 6
+#endif
+
+#if EXP_WINDOW > 1
+#define EXP_TABLE_SIZE (1 << (EXP_WINDOW - 1))
+
+typedef struct {
+    int bit;          // next exponent bit to scan, from the MSB down
+    unsigned squares; // squarings of the block due before...
+    int window;       // ...multiplying it by this table entry, or -1
+    bool started;     // block is no longer 1, so squaring it is not a no-op
+} exp_state_t;
+#endif
+
+// Define CRT_DECRYPT to decrypt the cyphertext once it is printed and check
+// it against the plaintext. Decryption uses the CRT form of the private key
+// (data/privkey<bits>.txt, from data/private<bits>.txt). Two threads raise
+// each block to dP mod p and to dQ mod q: half-size exponents on half-size
+// numbers, in Montgomery form. task_crt_combine then joins the halves with
+// Garner's formula.
+#ifdef CRT_DECRYPT
+#if KEY_SIZE_BITS == 256
+#error data/key256.txt is not the public half of data/private256.txt
+#endif
+
+#define CRT_DIGITS (NUM_DIGITS / 2)
+#define CRT_BYTES (KEY_SIZE_BYTES / 2)
+
+typedef struct {
+    uint8_t p[CRT_BYTES];
+    uint8_t q[CRT_BYTES];    // < p
+    uint8_t dp[CRT_BYTES];   // d mod (p - 1)
+    uint8_t dq[CRT_BYTES];   // d mod (q - 1)
+    uint8_t qinv[CRT_BYTES]; // q^-1 mod p
+} privkey_t;
+
+// Constants of one prime, computed once in task_init
+typedef struct {
+    digit_t n[CRT_DIGITS];  // the prime
+    digit_t d[CRT_DIGITS];  // its exponent
+    digit_t r1[CRT_DIGITS]; // R mod n
+    digit_t r2[CRT_DIGITS]; // R^2 mod n
+    digit_t n_prime;
+    int d_msb;              // index of the top set bit of d
+} crt_prime_t;
+
+// Exponentiation of one block by one prime's thread, a bit per task hop
+typedef struct {
+    unsigned block;           // cyphertext block
+    int bit;                  // next bit of d, or -1 to load the block
+    digit_t base[CRT_DIGITS]; // block mod n, in Montgomery form
+    digit_t acc[CRT_DIGITS];
+} crt_state_t;
+#endif
+
 #define LED1 (1 << 0)
 #define LED2 (1 << 1)
 
@@ -261,51 +914,169 @@ typedef struct {
 // #define SHOW_PROGRESS_ON_LED
 // #define SHOW_COARSE_PROGRESS_ON_LED
 
-// Blocks are padded with these digits (on the MSD side). Padding value must be
+// Blocks are padded with these bytes (on the MSB side). Padding value must be
 // chosen such that block value is less than the modulus. This is accomplished
 // by any value below 0x80, because the modulus is restricted to be above
 // 0x80 (see comments below).
-static const uint8_t PAD_DIGITS[] = { 0x01 };
-#define NUM_PAD_DIGITS (sizeof(PAD_DIGITS) / sizeof(PAD_DIGITS[0]))
+static const uint8_t PAD_BYTES[] = { 0x01 };
+#define NUM_PAD_BYTES (sizeof(PAD_BYTES) / sizeof(PAD_BYTES[0]))
 
 // To generate a key pair: see scripts/
 
 // modulus: byte order: LSB to MSB, constraint MSB>=0x80
 static __ro_nv const pubkey_t pubkey = {
+#if KEY_SIZE_BITS == 32
+#include "../data/key32.txt"
+#elif KEY_SIZE_BITS == 64
+#include "../data/key64.txt"
+#elif KEY_SIZE_BITS == 128
 #include "../data/key.txt"
+#elif KEY_SIZE_BITS == 256
+#include "../data/key256.txt"
+#elif KEY_SIZE_BITS == 512
+#include "../data/key512.txt"
+#elif KEY_SIZE_BITS == 1024
+#include "../data/key1024.txt"
+#elif KEY_SIZE_BITS == 2048
+#include "../data/key2048.txt"
+#endif
 };
 
 static __ro_nv const unsigned char PLAINTEXT[] =
 #include "../data/plaintext.txt"
 ;
 
-#define NUM_PLAINTEXT_BLOCKS (sizeof(PLAINTEXT) / (NUM_DIGITS - NUM_PAD_DIGITS) + 1)
+#define NUM_PLAINTEXT_BLOCKS (sizeof(PLAINTEXT) / (KEY_SIZE_BYTES - NUM_PAD_BYTES) + 1)
 #define CYPHERTEXT_SIZE (NUM_PLAINTEXT_BLOCKS * NUM_DIGITS)
 
+#ifdef CRT_DECRYPT
+static __ro_nv const privkey_t privkey = {
+#if KEY_SIZE_BITS == 32
+#include "../data/privkey32.txt"
+#elif KEY_SIZE_BITS == 64
+#include "../data/privkey64.txt"
+#elif KEY_SIZE_BITS == 128
+#include "../data/privkey128.txt"
+#elif KEY_SIZE_BITS == 512
+#include "../data/privkey512.txt"
+#elif KEY_SIZE_BITS == 1024
+#include "../data/privkey1024.txt"
+#elif KEY_SIZE_BITS == 2048
+#include "../data/privkey2048.txt"
+#endif
+};
+#endif
+
 // If you link-in wisp-base, then you have to define some symbols.
 uint8_t usrBank[USRBANK_SIZE];
 
+// The operands stay where the caller keeps them: the call passes references
+// to them (see CHAN_ARRAY_REF), and the caller must leave them alone until the
+// call returns, which nothing checks. Channel references come with the host
+// stand-in for libchain only: on the board, every operand is read out and
+// copied into the call channel, so only the host saves the copies.
+// Either way, a caller passes an operand with CALL_OPERAND and every task of
+// the call reads it with OPERAND_IN.
+#ifdef CHAN_ARRAY_REF1
+#define OPERAND_FIELD(name) CHAN_FIELD(chan_ref_t, name)
+#define CALL_OPERAND1(call, arg, field, first, chan0) do { \
+        chan_ref_t _ref = CHAN_ARRAY_REF1(digit_t, field, first, chan0); \
+        CHAN_OUT1(chan_ref_t, LANE(arg), _ref, CALL_CH(call)); \
+    } while (0)
+#define CALL_OPERAND2(call, arg, field, first, chan0, chan1) do { \
+        chan_ref_t _ref = CHAN_ARRAY_REF2(digit_t, field, first, chan0, chan1); \
+        CHAN_OUT1(chan_ref_t, LANE(arg), _ref, CALL_CH(call)); \
+    } while (0)
+#define OPERAND_IN(call, arg, first, dst, count) do { \
+        chan_ref_t _ref = *CHAN_IN1(chan_ref_t, LANE(arg), CALL_CH(call)); \
+        CHAN_IN_ARRAY_REF(digit_t, _ref, first, dst, count); \
+    } while (0)
+#else
+#define OPERAND_FIELD(name) CHAN_FIELD_ARRAY(digit_t, name, NUM_DIGITS)
+#define CALL_OPERAND1(call, arg, field, first, chan0) do { \
+        digit_t _digits[NUM_DIGITS]; \
+        CHAN_IN_ARRAY1(digit_t, field, first, _digits, NUM_DIGITS, chan0); \
+        CHAN_OUT_ARRAY1(digit_t, LANE(arg), 0, _digits, NUM_DIGITS, CALL_CH(call)); \
+    } while (0)
+#define CALL_OPERAND2(call, arg, field, first, chan0, chan1) do { \
+        digit_t _digits[NUM_DIGITS]; \
+        CHAN_IN_ARRAY2(digit_t, field, first, _digits, NUM_DIGITS, chan0, chan1); \
+        CHAN_OUT_ARRAY1(digit_t, LANE(arg), 0, _digits, NUM_DIGITS, CALL_CH(call)); \
+    } while (0)
+#define OPERAND_IN(call, arg, first, dst, count) \
+    CHAN_IN_ARRAY1(digit_t, LANE(arg), first, dst, count, CALL_CH(call))
+#endif
+
 struct msg_mult_mod_args {
-    CHAN_FIELD_ARRAY(digit_t, A, NUM_DIGITS);
-    CHAN_FIELD_ARRAY(digit_t, B, NUM_DIGITS);
+    LANES_BEGIN
+    OPERAND_FIELD(A);
+    OPERAND_FIELD(B);
     CHAN_FIELD(task_t*, next_task);
+    LANES_END
 };
 
+// A reference to the low NUM_DIGITS digits of the reduced product, wherever
+// the reduction left them; 'product' holds results computed in one task, and
+// every result on the board. Good until the next call, so the caller copies
+// out what it keeps (RESULT_IN).
+#ifdef CHAN_ARRAY_REF1
+#define RETURN_DIGITS(digits) do { \
+        chan_ref_t _ref; \
+        CHAN_OUT_ARRAY1(digit_t, LANE(product), 0, digits, NUM_DIGITS, \
+                        RET_CH(ch_mult_mod)); \
+        _ref = CHAN_ARRAY_REF1(digit_t, LANE(product), 0, RET_CH(ch_mult_mod)); \
+        CHAN_OUT1(chan_ref_t, LANE(result), _ref, RET_CH(ch_mult_mod)); \
+    } while (0)
+#define RETURN_IN_PLACE(field, chan) do { \
+        chan_ref_t _ref = CHAN_ARRAY_REF1(digit_t, field, 0, chan); \
+        CHAN_OUT1(chan_ref_t, LANE(result), _ref, RET_CH(ch_mult_mod)); \
+    } while (0)
+#define RESULT_IN(dst) do { \
+        chan_ref_t _ref = *CHAN_IN1(chan_ref_t, LANE(result), RET_CH(ch_mult_mod)); \
+        CHAN_IN_ARRAY_REF(digit_t, _ref, 0, dst, NUM_DIGITS); \
+    } while (0)
+#else
+#define RETURN_DIGITS(digits) \
+    CHAN_OUT_ARRAY1(digit_t, LANE(product), 0, digits, NUM_DIGITS, RET_CH(ch_mult_mod))
+#define RETURN_IN_PLACE(field, chan) do { \
+        digit_t _digits[NUM_DIGITS]; \
+        CHAN_IN_ARRAY1(digit_t, field, 0, _digits, NUM_DIGITS, chan); \
+        RETURN_DIGITS(_digits); \
+    } while (0)
+#define RESULT_IN(dst) \
+    CHAN_IN_ARRAY1(digit_t, LANE(product), 0, dst, NUM_DIGITS, RET_CH(ch_mult_mod))
+#endif
+
 struct msg_mult_mod_result {
-    CHAN_FIELD_ARRAY(digit_t, R, NUM_DIGITS);
+    LANES_BEGIN
+#ifdef CHAN_ARRAY_REF1
+    CHAN_FIELD(chan_ref_t, result);
+#endif
+    CHAN_FIELD_ARRAY(digit_t, product, NUM_DIGITS);
+    LANES_END
+};
+
+// A square needs only one operand
+struct msg_square_mod_args {
+    LANES_BEGIN
+    OPERAND_FIELD(A);
+    CHAN_FIELD(task_t*, next_task);
+    LANES_END
 };
 
 struct msg_mult{
-    CHAN_FIELD_ARRAY(digit_t, A, NUM_DIGITS); 
-    CHAN_FIELD_ARRAY(digit_t, B, NUM_DIGITS);
+    LANES_BEGIN
     CHAN_FIELD(unsigned, digit);
-    CHAN_FIELD(unsigned, carry);
+    CHAN_FIELD(acc_t, carry);
+    LANES_END
 };
 
 struct msg_reduce {
+    LANES_BEGIN
     CHAN_FIELD_ARRAY(digit_t, N, NUM_DIGITS);
     CHAN_FIELD_ARRAY(digit_t, M, NUM_DIGITS);
     CHAN_FIELD(task_t*, next_task);
+    LANES_END
 };
 
 struct msg_modulus {
@@ -313,119 +1084,324 @@ struct msg_modulus {
 };
 
 struct msg_exponent {
-    CHAN_FIELD(digit_t, E);
+    LANES_BEGIN
+    CHAN_FIELD(exponent_t, E);
+    LANES_END
 };
 
 struct msg_self_exponent {
-    SELF_CHAN_FIELD(digit_t, E);
+    LANES_BEGIN
+    SELF_CHAN_FIELD(exponent_t, E);
+    LANES_END
 };
-#define FIELD_INIT_msg_self_exponent { \
+#define FIELD_INIT_msg_self_exponent { LANES_INIT( \
     SELF_FIELD_INITIALIZER \
-}
+) }
+
+#if EXP_WINDOW > 1
+struct msg_exp_start {
+    LANES_BEGIN
+    CHAN_FIELD(exponent_t, E);
+    CHAN_FIELD(exp_state_t, exp_state);
+    LANES_END
+};
+
+struct msg_self_exp_state {
+    LANES_BEGIN
+    SELF_CHAN_FIELD(exp_state_t, exp_state);
+    LANES_END
+};
+#define FIELD_INIT_msg_self_exp_state { LANES_INIT( \
+    SELF_FIELD_INITIALIZER \
+) }
+
+// Entry i of the table is base^(2i + 1), at digits [i * NUM_DIGITS, ...)
+struct msg_exp_table {
+    LANES_BEGIN
+    CHAN_FIELD_ARRAY(digit_t, table, EXP_TABLE_SIZE * NUM_DIGITS);
+    CHAN_FIELD_ARRAY(digit_t, base_sq, NUM_DIGITS);
+    LANES_END
+};
+
+struct msg_table_index {
+    LANES_BEGIN
+    CHAN_FIELD(unsigned, table_index);
+    LANES_END
+};
+#endif
 
 struct msg_mult_digit {
+    LANES_BEGIN
     CHAN_FIELD(unsigned, digit);
-    CHAN_FIELD(unsigned, carry);
+    CHAN_FIELD(acc_t, carry);
+    LANES_END
 };
 
 struct msg_self_mult_digit {
+    LANES_BEGIN
     SELF_CHAN_FIELD(unsigned, digit);
-    SELF_CHAN_FIELD(unsigned, carry);
+    SELF_CHAN_FIELD(acc_t, carry);
+    LANES_END
 };
-#define FIELD_INIT_msg_self_mult_digit { \
+#define FIELD_INIT_msg_self_mult_digit { LANES_INIT( \
     SELF_FIELD_INITIALIZER, \
     SELF_FIELD_INITIALIZER \
-}
+) }
 
 struct msg_product {
-    CHAN_FIELD_ARRAY(digit_t, product, 32);
+    LANES_BEGIN
+    CHAN_FIELD_ARRAY(digit_t, product, NUM_DIGITS_x2);
+    LANES_END
 };
 
 struct msg_self_product {
-    SELF_CHAN_FIELD_ARRAY(digit_t, product, 32);
+    LANES_BEGIN
+    SELF_CHAN_FIELD_ARRAY(digit_t, product, NUM_DIGITS_x2);
+    LANES_END
 };
-#define FIELD_INIT_msg_self_product { \
-    SELF_FIELD_ARRAY_INITIALIZER(32) \
-}
+#define FIELD_INIT_msg_self_product { LANES_INIT( \
+    SELF_FIELD_ARRAY_INITIALIZER(NUM_DIGITS_x2) \
+) }
 
 struct msg_base {
+    LANES_BEGIN
     CHAN_FIELD_ARRAY(digit_t, base, NUM_DIGITS_x2);
+    LANES_END
 };
 
 struct msg_block {
+    LANES_BEGIN
     CHAN_FIELD_ARRAY(digit_t, block, NUM_DIGITS_x2);
+    LANES_END
 };
 
 struct msg_base_block {
+    LANES_BEGIN
     CHAN_FIELD_ARRAY(digit_t, base, NUM_DIGITS_x2);
     CHAN_FIELD_ARRAY(digit_t, block, NUM_DIGITS_x2);
+    LANES_END
 };
 
 struct msg_cyphertext_len {
+    LANES_BEGIN
     CHAN_FIELD(unsigned, cyphertext_len);
+#ifdef BLOCK_CYCLES
+    CHAN_FIELD(block_time_t, block_time); // total over the finished blocks
+#endif
+    LANES_END
 };
 
 struct msg_self_cyphertext_len {
+    LANES_BEGIN
     SELF_CHAN_FIELD(unsigned, cyphertext_len);
+#ifdef BLOCK_CYCLES
+    SELF_CHAN_FIELD(block_time_t, block_time);
+#endif
+    LANES_END
 };
-#define FIELD_INIT_msg_self_cyphertext_len { \
+#ifdef BLOCK_CYCLES
+#define FIELD_INIT_msg_self_cyphertext_len { LANES_INIT( \
+    SELF_FIELD_INITIALIZER, \
     SELF_FIELD_INITIALIZER \
-}
+) }
+#else
+#define FIELD_INIT_msg_self_cyphertext_len { LANES_INIT( \
+    SELF_FIELD_INITIALIZER \
+) }
+#endif
 
 struct msg_cyphertext {
+#ifndef STREAM_CYPHERTEXT
     CHAN_FIELD_ARRAY(digit_t, cyphertext, CYPHERTEXT_SIZE);
+#endif
+    LANES_BEGIN
     CHAN_FIELD(unsigned, cyphertext_len);
+#ifdef BLOCK_CYCLES
+    CHAN_FIELD(block_time_t, block_time);
+#endif
+    LANES_END
+};
+
+#ifdef STREAM_CYPHERTEXT
+struct msg_cyphertext_slot {
+    LANES_BEGIN
+    CHAN_FIELD_ARRAY(digit_t, slot, NUM_DIGITS);
+    CHAN_FIELD(unsigned, block); // index in the message
+    LANES_END
+};
+#endif
+
+#ifdef BLOCK_CYCLES
+struct msg_block_start {
+    LANES_BEGIN
+    CHAN_FIELD(block_time_t, block_start);
+    LANES_END
 };
+#endif
 
 struct msg_divisor {
+    LANES_BEGIN
     CHAN_FIELD(unsigned, digit);
-    CHAN_FIELD(digit_t, n_div);
+    CHAN_FIELD(ddigit_t, n_div);
+    LANES_END
 };
 
 struct msg_digit {
+    LANES_BEGIN
     CHAN_FIELD(unsigned, digit);
+    LANES_END
 };
 
 struct msg_self_digit {
+    LANES_BEGIN
     SELF_CHAN_FIELD(unsigned, digit);
+    LANES_END
 };
-#define FIELD_INIT_msg_self_digit { \
+#define FIELD_INIT_msg_self_digit { LANES_INIT( \
     SELF_FIELD_INITIALIZER \
-}
+) }
 
 struct msg_offset {
+    LANES_BEGIN
     CHAN_FIELD(unsigned, offset);
+    LANES_END
 };
 
 struct msg_block_offset {
+    LANES_BEGIN
     CHAN_FIELD(unsigned, block_offset);
+    LANES_END
 };
 
 struct msg_self_block_offset {
+    LANES_BEGIN
     SELF_CHAN_FIELD(unsigned, block_offset);
+    LANES_END
+};
+#define FIELD_INIT_msg_self_block_offset { LANES_INIT(\
+    SELF_FIELD_INITIALIZER \
+) }
+
+#ifdef CRT_DECRYPT
+struct msg_crt {
+    CHAN_FIELD(crt_prime_t, crt_p);
+    CHAN_FIELD(crt_prime_t, crt_q);
+    CHAN_FIELD_ARRAY(digit_t, qinv, CRT_DIGITS);
+};
+
+struct msg_crt_start {
+    CHAN_FIELD(crt_state_t, crt_state);
+    CHAN_FIELD(unsigned, crt_blocks);
+};
+
+struct msg_self_crt_state {
+    SELF_CHAN_FIELD(crt_state_t, crt_state);
 };
-#define FIELD_INIT_msg_self_block_offset {\
+#define FIELD_INIT_msg_self_crt_state { \
     SELF_FIELD_INITIALIZER \
 }
 
-struct msg_message_info {
-    CHAN_FIELD(unsigned, message_length);
-    CHAN_FIELD(unsigned, block_offset);
-    CHAN_FIELD(digit_t, E);
+struct msg_crt_done {
+    CHAN_FIELD(bool, crt_done);
 };
 
-struct msg_quotient {
-    CHAN_FIELD(digit_t, quotient);
+// m^dP mod p (or m^dQ mod q) of every block
+struct msg_crt_result {
+    CHAN_FIELD_ARRAY(digit_t, m, NUM_PLAINTEXT_BLOCKS * CRT_DIGITS);
 };
 
-struct msg_print {
-    CHAN_FIELD_ARRAY(digit_t, product, NUM_DIGITS_x2);
-    CHAN_FIELD(task_t*, next_task);
+struct msg_crt_combine {
+    CHAN_FIELD(unsigned, crt_block);
+    CHAN_FIELD(unsigned, crt_blocks);
 };
 
-TASK(22,  task_pad)
-TASK(23,  task_exp)
-TASK(24,  task_mult_block)
+struct msg_self_crt_block {
+    SELF_CHAN_FIELD(unsigned, crt_block);
+};
+#define FIELD_INIT_msg_self_crt_block { \
+    SELF_FIELD_INITIALIZER \
+}
+
+struct msg_decrypted {
+    CHAN_FIELD_ARRAY(uint8_t, plaintext, sizeof(PLAINTEXT));
+};
+#endif
+
+#if RSA_THREADS > 1
+struct msg_lane_done {
+    CHAN_FIELD_ARRAY(bool, lane_done, RSA_THREADS);
+};
+#endif
+
+struct msg_message_info {
+    LANES_BEGIN
+    CHAN_FIELD(unsigned, message_length);
+    CHAN_FIELD(unsigned, block_offset);
+    CHAN_FIELD(exponent_t, E);
+    LANES_END
+};
+
+struct msg_quotient {
+    LANES_BEGIN
+    CHAN_FIELD(digit_t, quotient);
+    LANES_END
+};
+
+#ifdef MONTGOMERY
+struct msg_montgomery {
+    CHAN_FIELD_ARRAY(digit_t, R2, NUM_DIGITS); // R^2 mod N
+    CHAN_FIELD_ARRAY(digit_t, R1, NUM_DIGITS); // R mod N, i.e. 1 in Montgomery form
+    CHAN_FIELD(digit_t, n_prime);
+};
+#endif
+
+#ifdef MULT_KARATSUBA
+struct msg_karatsuba_args {
+    LANES_BEGIN
+    CHAN_FIELD(unsigned, stage);
+    LANES_END
+};
+
+struct msg_self_karatsuba_stage {
+    LANES_BEGIN
+    SELF_CHAN_FIELD(unsigned, stage);
+    LANES_END
+};
+#define FIELD_INIT_msg_self_karatsuba_stage { LANES_INIT( \
+    SELF_FIELD_INITIALIZER \
+) }
+
+struct msg_karatsuba_scratch {
+    LANES_BEGIN
+    CHAN_FIELD_ARRAY(digit_t, z0, 2 * KARATSUBA_LO);       // a0 * b0
+    CHAN_FIELD_ARRAY(digit_t, z2, 2 * KARATSUBA_HI);       // a1 * b1
+    CHAN_FIELD_ARRAY(digit_t, z1, 2 * (KARATSUBA_HI + 1)); // (a0 + a1) * (b0 + b1)
+    LANES_END
+};
+#endif
+
+#ifdef BARRETT
+struct msg_barrett {
+    CHAN_FIELD_ARRAY(digit_t, mu, NUM_DIGITS + 1); // floor(b^2k / N)
+};
+
+struct msg_barrett_quotient {
+    LANES_BEGIN
+    CHAN_FIELD_ARRAY(digit_t, q, NUM_DIGITS + 1);
+    LANES_END
+};
+#endif
+
+struct msg_print {
+    LANES_BEGIN
+    CHAN_FIELD_ARRAY(digit_t, product, NUM_DIGITS_x2);
+    CHAN_FIELD(task_t*, next_task);
+    LANES_END
+};
+
+TASK(22,  task_pad)
+TASK(23,  task_exp)
+TASK(24,  task_mult_block)
 TASK(25,  task_mult_block_get_result)
 TASK(26,  task_square_base)
 TASK(27,  task_square_base_get_result)
@@ -445,42 +1421,122 @@ TASK(21, task_reduce_compare)
 //TASK(34, task_print_product)
 TASK_EXT(18, task_reduce_add)
 TASK_EXT(19, task_reduce_subtract)
+#if PRINT_PRODUCT
 TASK_EXT(20, task_print_product)
+#endif
+TASK_EXT(24, task_square_mod)
+TASK_EXT(25, task_square)
+#if EXP_WINDOW > 1
+TASK_EXT(26, task_exp_table)
+TASK_EXT(27, task_exp_table_get_result)
+TASK_EXT(28, task_exp_square)
+TASK_EXT(29, task_exp_mult)
+TASK_EXT(30, task_exp_get_result)
+#endif
+#ifdef CRT_DECRYPT
+TASK_EXT(31, task_crt_exp_p)
+TASK_EXT(32, task_crt_exp_q)
+TASK_EXT(33, task_crt_combine)
+TASK_EXT(34, task_crt_print)
+#endif
+#ifdef MULT_KARATSUBA
+TASK_EXT(37, task_karatsuba)
+TASK_EXT(38, task_karatsuba_combine)
+#endif
+#ifdef STREAM_CYPHERTEXT
+TASK_EXT(39, task_emit_block)
+#endif
+#ifdef BARRETT
+TASK_EXT(35, task_reduce_barrett_quotient)
+TASK_EXT(36, task_reduce_barrett_subtract)
+#endif
 
 MULTICAST_CHANNEL(msg_base, ch_base, task_init, task_square_base, task_mult_block);
 CHANNEL(task_init, task_pad, msg_message_info);
 CHANNEL(task_init, task_mult_block_get_result, msg_cyphertext_len);
-CHANNEL(task_pad, task_exp, msg_exponent);
 CHANNEL(task_pad, task_mult_block, msg_block);
 SELF_CHANNEL(task_pad, msg_self_block_offset);
+#if EXP_WINDOW > 1
+MULTICAST_CHANNEL(msg_base, ch_base, task_pad, task_mult_block, task_square_base,
+                  task_exp_table, task_exp_table_get_result);
+#else
 MULTICAST_CHANNEL(msg_base, ch_base, task_pad, task_mult_block, task_square_base);
+#endif
+#if EXP_WINDOW > 1
+CHANNEL(task_pad, task_exp, msg_exp_start);
+SELF_CHANNEL(task_exp, msg_self_exp_state);
+CHANNEL(task_pad, task_exp_table, msg_table_index);
+CHANNEL(task_exp_table, task_exp_table_get_result, msg_table_index);
+CHANNEL(task_exp_table_get_result, task_exp_table, msg_table_index);
+MULTICAST_CHANNEL(msg_exp_table, ch_exp_table, task_exp_table_get_result,
+                  task_exp_table, task_exp_mult);
+CHANNEL(task_exp, task_exp_mult, msg_table_index);
+MULTICAST_CHANNEL(msg_block, ch_exp_block, task_exp_get_result,
+                  task_exp_square, task_exp_mult);
+#else
+CHANNEL(task_pad, task_exp, msg_exponent);
 SELF_CHANNEL(task_exp, msg_self_exponent);
+#endif
 CHANNEL(task_exp, task_mult_block_get_result, msg_exponent);
 CHANNEL(task_mult_block_get_result, task_mult_block, msg_block);
 SELF_CHANNEL(task_mult_block_get_result, msg_self_cyphertext_len);
 CHANNEL(task_mult_block_get_result, task_print_cyphertext, msg_cyphertext);
+#ifdef STREAM_CYPHERTEXT
+CHANNEL(task_mult_block_get_result, task_emit_block, msg_cyphertext_slot);
+#endif
+#ifdef BLOCK_CYCLES
+CHANNEL(task_pad, task_mult_block_get_result, msg_block_start);
+#endif
 MULTICAST_CHANNEL(msg_base, ch_square_base, task_square_base_get_result,
                   task_square_base, task_mult_block);
 CALL_CHANNEL(ch_mult_mod, msg_mult_mod_args);
-RET_CHANNEL(ch_mult_mod, msg_product);
+RET_CHANNEL(ch_mult_mod, msg_mult_mod_result);
 CHANNEL(task_mult_mod, task_mult, msg_mult);
+#ifdef MULT_KARATSUBA
+CHANNEL(task_mult_mod, task_karatsuba, msg_karatsuba_args);
+SELF_CHANNEL(task_karatsuba, msg_self_karatsuba_stage);
+CHANNEL(task_karatsuba, task_karatsuba_combine, msg_karatsuba_scratch);
+#endif
+CALL_CHANNEL(ch_square_mod, msg_square_mod_args);
+CHANNEL(task_square_mod, task_square, msg_mult_digit);
+SELF_CHANNEL(task_square, msg_self_mult_digit);
+#ifdef BARRETT
 MULTICAST_CHANNEL(msg_modulus, ch_modulus, task_init,
                   task_reduce_normalizable, task_reduce_normalize,
-                  task_reduce_n_divisor, task_reduce_quotient, task_reduce_multiply);
+                  task_reduce_n_divisor, task_reduce_quotient, task_reduce_multiply,
+                  task_reduce_add, task_pad, task_mult_mod, task_square_mod,
+                  task_mult_block_get_result, task_reduce_barrett_subtract);
+#else
+MULTICAST_CHANNEL(msg_modulus, ch_modulus, task_init,
+                  task_reduce_normalizable, task_reduce_normalize,
+                  task_reduce_n_divisor, task_reduce_quotient, task_reduce_multiply,
+                  task_reduce_add, task_pad, task_mult_mod, task_square_mod,
+                  task_mult_block_get_result);
+#endif
 SELF_CHANNEL(task_mult, msg_self_mult_digit);
 MULTICAST_CHANNEL(msg_product, ch_mult_product, task_mult,
                   task_reduce_normalizable, task_reduce_normalize,
                   task_reduce_quotient, task_reduce_compare,
                   task_reduce_add, task_reduce_subtract);
 MULTICAST_CHANNEL(msg_digit, ch_digit, task_reduce_digits,
-                  task_reduce_normalizable, task_reduce_quotient);
+                  task_reduce_normalizable, task_reduce_normalize,
+                  task_reduce_quotient);
 CHANNEL(task_reduce_normalizable, task_reduce_normalize, msg_offset);
 // TODO: rename 'product' to 'block' or something
+#ifdef BARRETT
+MULTICAST_CHANNEL(msg_product, ch_product, task_mult,
+                  task_reduce_digits, task_reduce_n_divisor,
+                  task_reduce_normalizable, task_reduce_normalize,
+                  task_reduce_quotient, task_reduce_compare,
+                  task_reduce_add, task_reduce_subtract,
+                  task_reduce_barrett_quotient, task_reduce_barrett_subtract);
+#else
 MULTICAST_CHANNEL(msg_product, ch_product, task_mult,
                   task_reduce_digits, task_reduce_n_divisor,
                   task_reduce_normalizable, task_reduce_normalize,
                   task_reduce_quotient, task_reduce_compare,
                   task_reduce_add, task_reduce_subtract);
+#endif
 MULTICAST_CHANNEL(msg_product, ch_normalized_product, task_reduce_normalize,
                   task_reduce_quotient, task_reduce_compare,
                   task_reduce_add, task_reduce_subtract);
@@ -496,7 +1552,38 @@ MULTICAST_CHANNEL(msg_digit, ch_reduce_digit, task_reduce_quotient,
 CHANNEL(task_reduce_quotient, task_reduce_multiply, msg_quotient);
 MULTICAST_CHANNEL(msg_product, ch_qn, task_reduce_multiply,
                   task_reduce_compare, task_reduce_subtract);
+#if PRINT_PRODUCT
 CALL_CHANNEL(ch_print_product, msg_print);
+#endif
+#if RSA_THREADS > 1
+MULTICAST_CHANNEL(msg_lane_done, ch_lane_done, task_init, task_pad);
+MULTICAST_CHANNEL(msg_lane_done, ch_lane_done, task_pad, task_pad);
+#endif
+#ifdef MONTGOMERY
+MULTICAST_CHANNEL(msg_montgomery, ch_montgomery, task_init,
+                  task_pad, task_mult_mod, task_square_mod, task_mult_block_get_result);
+#endif
+#ifdef BARRETT
+MULTICAST_CHANNEL(msg_barrett, ch_barrett, task_init, task_reduce_barrett_quotient);
+CHANNEL(task_reduce_barrett_quotient, task_reduce_barrett_subtract, msg_barrett_quotient);
+#endif
+#ifdef CRT_DECRYPT
+MULTICAST_CHANNEL(msg_crt, ch_crt, task_init,
+                  task_crt_exp_p, task_crt_exp_q, task_crt_combine);
+CHANNEL(task_init, task_crt_exp_p, msg_crt_done);
+CHANNEL(task_init, task_crt_exp_q, msg_crt_done);
+CHANNEL(task_print_cyphertext, task_crt_exp_p, msg_crt_start);
+CHANNEL(task_print_cyphertext, task_crt_exp_q, msg_crt_start);
+CHANNEL(task_print_cyphertext, task_crt_combine, msg_crt_combine);
+SELF_CHANNEL(task_crt_exp_p, msg_self_crt_state);
+SELF_CHANNEL(task_crt_exp_q, msg_self_crt_state);
+CHANNEL(task_crt_exp_p, task_crt_exp_q, msg_crt_done);
+CHANNEL(task_crt_exp_q, task_crt_exp_p, msg_crt_done);
+CHANNEL(task_crt_exp_p, task_crt_combine, msg_crt_result);
+CHANNEL(task_crt_exp_q, task_crt_combine, msg_crt_result);
+SELF_CHANNEL(task_crt_combine, msg_self_crt_block);
+CHANNEL(task_crt_combine, task_crt_print, msg_decrypted);
+#endif
 
 
 
@@ -504,6 +1591,12 @@ CALL_CHANNEL(ch_print_product, msg_print);
 
 static value_t init_key = 0x0001; // seeds the pseudo-random sequence of keys
 
+// Full-period LCG: no key repeats within 2^16 steps
+static value_t next_key(value_t key)
+{
+    return (key + 1) * 17;
+}
+
 static hash_t djb_hash(uint8_t* data, unsigned len)
 {
    uint32_t hash = 5381;
@@ -515,17 +1608,337 @@ static hash_t djb_hash(uint8_t* data, unsigned len)
    return hash & 0xFFFF;
 }
 
-static index_t hash_to_index(fingerprint_t fp)
+// Hashes a key or a fingerprint
+static index_t hash_to_index(value_t value)
 {
-    hash_t hash = djb_hash((uint8_t *)&fp, sizeof(fingerprint_t));
+    hash_t hash = djb_hash((uint8_t *)&value, sizeof(value_t));
     return hash & (NUM_BUCKETS - 1); // NUM_BUCKETS must be power of 2
 }
 
+static uint32_t mult_hash(value_t key)
+{
+    return (uint32_t)key * HASH_MULTIPLIER;
+}
+
+#ifndef FUSED_HASH
 static fingerprint_t hash_to_fingerprint(value_t key)
 {
-    return djb_hash((uint8_t *)&key, sizeof(value_t));
+    // The DJB hash of a 2-byte key takes only ~8.7k values, and keys that
+    // share one also share the bucket: take the top bits of the
+    // multiply-shift hash instead
+    fingerprint_t fp = mult_hash(key) >> (32 - FP_BITS);
+    return fp ? fp : 1; // zero marks an empty slot
+}
+#endif
+
+#ifdef FUSED_HASH
+// Filled in by task_init
+static __nv index_t fp_index[NUM_FP_INDEXES];
+#endif
+
+#if CALC_INDEXES_CALLERS > 1
+// Thread id of the caller that owns each ch_calc_indexes frame, or
+// CALC_INDEXES_NO_CALLER; filled in by task_init
+static __nv unsigned calc_indexes_caller[CALC_INDEXES_CALLERS];
+
+static unsigned calc_indexes_frame()
+{
+    unsigned thread = THREAD_ID();
+    unsigned f;
+
+    for (f = 0; f < CALC_INDEXES_CALLERS; ++f) {
+        if (calc_indexes_caller[f] == thread)
+            return f;
+    }
+
+    PRINTF("calc indexes: thread %u has no frame\r\n", thread);
+    TRANSITION_TO_MT(task_done);
+}
+#endif
+
+// Offset between the two candidate buckets of a fingerprint
+static index_t fp_to_index(fingerprint_t fp)
+{
+#ifdef FUSED_HASH
+    return fp_index[fp & (NUM_FP_INDEXES - 1)];
+#else
+    return hash_to_index(fp);
+#endif
+}
+
+static inline void calc_indexes(value_t key, fingerprint_t *fp,
+                                index_t *index1, index_t *index2)
+{
+#ifdef FUSED_HASH
+    // The top FP_BITS bits are the fingerprint and the INDEX_BITS bits right
+    // below them pick the bucket: the high bits of a multiply-shift hash are
+    // the well-mixed ones
+    uint32_t hash = mult_hash(key);
+
+    *fp = hash >> (32 - FP_BITS);
+    if (!*fp)
+        *fp = 1; // zero marks an empty slot
+    *index1 = (hash >> (32 - FP_BITS - INDEX_BITS)) & (NUM_BUCKETS - 1);
+#else
+    *fp = hash_to_fingerprint(key);
+    *index1 = hash_to_index(key);
+#endif
+    *index2 = *index1 ^ fp_to_index(*fp);
 }
 
+// Fingerprints are packed little-endian at FP_BITS apiece, so each one
+// spans at most two bytes of the bucket
+static fingerprint_t bucket_get(const bucket_t *bucket, unsigned slot)
+{
+    unsigned bit = slot * FP_BITS;
+    const uint8_t *p = &bucket->fp[bit / 8];
+    uint16_t word = p[0];
+
+    if (FP_BITS > 8)
+        word |= (uint16_t)p[1] << 8;
+    return (word >> (bit % 8)) & FP_MASK;
+}
+
+static void bucket_set(bucket_t *bucket, unsigned slot, fingerprint_t fp)
+{
+    unsigned bit = slot * FP_BITS;
+    uint8_t *p = &bucket->fp[bit / 8];
+    uint16_t mask = FP_MASK << (bit % 8);
+    uint16_t word = p[0];
+
+    if (FP_BITS > 8)
+        word |= (uint16_t)p[1] << 8;
+    word = (word & ~mask) | (((uint16_t)fp << (bit % 8)) & mask);
+    p[0] = word;
+    if (FP_BITS > 8)
+        p[1] = word >> 8;
+}
+
+#ifdef RELOCATE_BFS
+// Search tree: each node is a bucket, reached by moving fingerprint 'fp'
+// out of slot 'slot' of the parent bucket into its alternate bucket.
+// Volatile scratch, rebuilt from scratch if the task re-executes.
+#define BFS_ROOT 0xff
+static struct {
+    index_t bucket;
+    uint8_t parent;
+    uint8_t slot;
+    fingerprint_t fp;
+} bfs_nodes[BFS_MAX_NODES];
+
+typedef bucket_t (filter_in_t)(index_t index);
+
+static bool bfs_on_path(unsigned node, index_t bucket)
+{
+    for (; node != BFS_ROOT; node = bfs_nodes[node].parent) {
+        if (bfs_nodes[node].bucket == bucket)
+            return true;
+    }
+    return false;
+}
+
+// Returns the node of the nearest bucket with a free slot (in *free_slot),
+// or BFS_ROOT if there is none within the depth and node bounds
+static unsigned bfs_search(index_t index1, index_t index2,
+                           filter_in_t *filter_in, unsigned *free_slot)
+{
+    unsigned i, node;
+    unsigned head = 0, tail = 0, depth = 0, depth_end;
+    fingerprint_t fp[BUCKET_SIZE];
+    bucket_t bucket;
+
+    bfs_nodes[tail].bucket = index1;
+    bfs_nodes[tail++].parent = BFS_ROOT;
+    if (index2 != index1) {
+        bfs_nodes[tail].bucket = index2;
+        bfs_nodes[tail++].parent = BFS_ROOT;
+    }
+    depth_end = tail;
+
+    while (head < tail) {
+        if (head == depth_end) {
+            depth++;
+            depth_end = tail;
+        }
+        node = head++;
+
+        bucket = filter_in(bfs_nodes[node].bucket);
+        for (i = 0; i < BUCKET_SIZE; ++i) {
+            fp[i] = bucket_get(&bucket, i);
+            if (!fp[i]) {
+                *free_slot = i;
+                return node;
+            }
+        }
+
+        if (depth == BFS_MAX_DEPTH)
+            continue;
+
+        for (i = 0; i < BUCKET_SIZE && tail < BFS_MAX_NODES; ++i) {
+            index_t index = bfs_nodes[node].bucket ^ fp_to_index(fp[i]);
+            if (bfs_on_path(node, index))
+                continue;
+            bfs_nodes[tail].bucket = index;
+            bfs_nodes[tail].parent = node;
+            bfs_nodes[tail].slot = i;
+            bfs_nodes[tail].fp = fp[i];
+            tail++;
+        }
+    }
+
+    LOG("bfs: no free slot in %u buckets\r\n", tail);
+    return BFS_ROOT;
+}
+
+// Filter writes needed to insert along the path ending at node
+static inline unsigned bfs_path_len(unsigned node)
+{
+    unsigned len = 0;
+
+    for (; node != BFS_ROOT; node = bfs_nodes[node].parent)
+        len++;
+    return len;
+}
+#endif // RELOCATE_BFS
+
+#if BATCH_SIZE > 1
+// Buckets written by the running insert batch: the batch reads its own writes
+// from here, since channel writes only become visible after the transition.
+// Volatile scratch, rebuilt from scratch if the task re-executes.
+static struct {
+    index_t index;
+    bucket_t bucket;
+} batch_updates[BATCH_MAX_UPDATES];
+static unsigned num_batch_updates;
+
+static bucket_t batch_filter_in(index_t index)
+{
+    unsigned i;
+
+    for (i = 0; i < num_batch_updates; ++i) {
+        if (batch_updates[i].index == index)
+            return batch_updates[i].bucket;
+    }
+    return *CHAN_IN1(bucket_t, filter[index], SHARED_CH(ch_filter));
+}
+
+static bool batch_filter_out(index_t index, unsigned slot, fingerprint_t fp)
+{
+    unsigned i;
+
+    for (i = 0; i < num_batch_updates; ++i) {
+        if (batch_updates[i].index == index) {
+            bucket_set(&batch_updates[i].bucket, slot, fp);
+            return true;
+        }
+    }
+    if (num_batch_updates == BATCH_MAX_UPDATES)
+        return false;
+    batch_updates[num_batch_updates].index = index;
+    batch_updates[num_batch_updates].bucket = batch_filter_in(index);
+    bucket_set(&batch_updates[num_batch_updates].bucket, slot, fp);
+    num_batch_updates++;
+    return true;
+}
+
+static bool batch_add_to_bucket(fingerprint_t fp, index_t index)
+{
+    unsigned i;
+    bucket_t bucket = batch_filter_in(index);
+
+    for (i = 0; i < BUCKET_SIZE; ++i) {
+        if (!bucket_get(&bucket, i))
+            return batch_filter_out(index, i, fp);
+    }
+    return false;
+}
+
+// Same placement policy as task_add/task_relocate, run to completion in
+// the batch. task_insert_batch leaves JOURNAL_SIZE update slots free for it.
+static bool batch_add(fingerprint_t fp, index_t index1, index_t index2)
+{
+#ifdef RELOCATE_BFS
+    unsigned node, parent, free_slot;
+#else
+    unsigned relocation_count;
+    fingerprint_t fp_victim;
+    bucket_t bucket;
+#endif
+    index_t index;
+    unsigned slot;
+
+    if (batch_add_to_bucket(fp, index1) || batch_add_to_bucket(fp, index2))
+        return true;
+
+#ifdef RELOCATE_BFS
+    node = bfs_search(index1, index2, batch_filter_in, &free_slot);
+    if (node != BFS_ROOT &&
+        num_batch_updates + bfs_path_len(node) <= BATCH_MAX_UPDATES) {
+        index = bfs_nodes[node].bucket;
+        slot = free_slot;
+        for (; node != BFS_ROOT; node = parent) {
+            parent = bfs_nodes[node].parent;
+            batch_filter_out(index, slot, parent == BFS_ROOT ? fp : bfs_nodes[node].fp);
+            if (parent != BFS_ROOT) {
+                index = bfs_nodes[parent].bucket;
+                slot = bfs_nodes[node].slot;
+            }
+        }
+        return true;
+    }
+#else
+    index = (rand() % 2) ? index1 : index2;
+    for (relocation_count = 0; relocation_count < MAX_RELOCATIONS; ++relocation_count) {
+        slot = BUCKET_SIZE > 1 ? rand() % BUCKET_SIZE : 0;
+        bucket = batch_filter_in(index);
+        fp_victim = bucket_get(&bucket, slot);
+        if (!batch_filter_out(index, slot, fp))
+            break;
+        LOG("insert batch: evict [%u] = %04x\r\n", SLOT(index, slot), fp_victim);
+
+        fp = fp_victim;
+        index ^= fp_to_index(fp);
+        if (batch_add_to_bucket(fp, index))
+            return true;
+    }
+#endif
+
+    PRINTF("insert: lost fp %04x\r\n", fp);
+    return false;
+}
+#endif // BATCH_SIZE
+
+#ifdef BENCHMARK
+#ifdef __MSP430__
+// TA0 counts SMCLK / 8, i.e. microseconds at the 8 MHz DCO (LIBMSP_DCO_FREQ).
+// Its 16-bit count wraps every 65 ms, so the clock is also sampled once per
+// insert and per lookup, and the elapsed ticks accumulate here.
+static uint32_t bench_time;
+static uint16_t bench_last;
+
+static uint32_t bench_clock()
+{
+    uint16_t now = TA0R;
+    bench_time += (uint16_t)(now - bench_last);
+    bench_last = now;
+    return bench_time;
+}
+#else
+static uint32_t bench_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+#endif
+
+// Events per second, from a count and a duration in microseconds
+static unsigned long bench_rate(unsigned count, uint32_t us)
+{
+    return us ? (uint64_t)count * 1000000 / us : 0;
+}
+#endif
+
 /*----------------------------rsa  inits and functions----------------------------*/
 
 #ifdef SHOW_PROGRESS_ON_LED
@@ -570,6 +1983,420 @@ static void print_hex_ascii(const uint8_t *m, unsigned len)
     }
 }
 
+/*--------------------------rsa functions---------------------------------*/
+
+#ifdef BLOCK_CYCLES
+#ifdef __MSP430__
+#define BLOCK_TIME_UNIT "kcycles"
+
+// TA1 counts SMCLK, which runs at the CPU clock, and the overflow interrupt
+// extends its 16-bit count.
+static volatile uint32_t block_clock_hi;
+
+__attribute__((interrupt(TIMER1_A1_VECTOR)))
+void timer1_a1_isr()
+{
+    if (TA1IV == TA1IV_TAIFG)
+        ++block_clock_hi;
+}
+
+static block_time_t block_clock()
+{
+    uint32_t hi;
+    uint16_t lo;
+
+    do { // retry if the count overflowed between the two reads
+        hi = block_clock_hi;
+        lo = TA1R;
+    } while (hi != block_clock_hi);
+
+    return ((block_time_t)hi << 16) | lo;
+}
+#else
+#define BLOCK_TIME_UNIT "us"
+
+// Nanoseconds, so that both clocks are reported in thousands of their unit
+static block_time_t block_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (block_time_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+#endif
+
+// Digit i of a bignum stored as bytes, LSB first
+static digit_t bytes_to_digit(const uint8_t *bytes, unsigned i)
+{
+#if DIGIT_BITS == 8
+    return bytes[i];
+#else
+    return bytes[2 * i] | ((digit_t)bytes[2 * i + 1] << 8);
+#endif
+}
+
+#if defined(MONTGOMERY) || defined(CRT_DECRYPT)
+
+// Bignums of 'len' digits, up to NUM_DIGITS: the modulus N, or, for
+// CRT_DECRYPT, one of its primes
+
+// r = (top:t) - n if (top:t) >= n, else t. Both have len digits,
+// plus a carry digit 'top' on t.
+static void mont_sub_if_geq(digit_t *r, const digit_t *t, digit_t top,
+                            const digit_t *n, unsigned len)
+{
+    int i;
+    bool geq = true;
+    digit_t borrow = 0;
+
+    if (!top) {
+        for (i = len - 1; i >= 0; --i) {
+            if (t[i] != n[i]) {
+                geq = t[i] > n[i];
+                break;
+            }
+        }
+    }
+
+    for (i = 0; i < len; ++i) {
+        ddigit_t s = (ddigit_t)(geq ? n[i] : 0) + borrow;
+        borrow = t[i] < s;
+        r[i] = ((ddigit_t)t[i] + ((ddigit_t)borrow << DIGIT_BITS) - s) & DIGIT_MASK;
+    }
+}
+
+// r = a * b * R^-1 mod n, for a, b < n, with R = 2^(DIGIT_BITS * len).
+// Each row adds a * b[i] and then the multiple of n that zeroes the low
+// digit, which it shifts out, so the partial sum never exceeds 2n.
+static void mont_mult(digit_t *r, const digit_t *a, const digit_t *b,
+                      const digit_t *n, digit_t n_prime, unsigned len)
+{
+    digit_t t[NUM_DIGITS + 2] = { 0 };
+    digit_t q;
+    ddigit_t cs;
+    int i, j;
+
+    for (i = 0; i < len; ++i) {
+        cs = 0;
+        for (j = 0; j < len; ++j) {
+            cs += t[j] + (ddigit_t)a[j] * b[i];
+            t[j] = cs & DIGIT_MASK;
+            cs >>= DIGIT_BITS;
+        }
+        cs += t[len];
+        t[len] = cs & DIGIT_MASK;
+        t[len + 1] = cs >> DIGIT_BITS;
+
+        q = ((ddigit_t)t[0] * n_prime) & DIGIT_MASK;
+        cs = (t[0] + (ddigit_t)q * n[0]) >> DIGIT_BITS;
+        for (j = 1; j < len; ++j) {
+            cs += t[j] + (ddigit_t)q * n[j];
+            t[j - 1] = cs & DIGIT_MASK;
+            cs >>= DIGIT_BITS;
+        }
+        cs += t[len];
+        t[len - 1] = cs & DIGIT_MASK;
+        t[len] = t[len + 1] + (cs >> DIGIT_BITS);
+    }
+
+    mont_sub_if_geq(r, t, t[len], n, len);
+}
+
+// r = a^2 * R^-1 mod n, for a < n. The full square is formed first, with
+// each cross product a[i] * a[j], i < j, computed once and doubled by a
+// shift, then reduced a digit at a time as in mont_mult.
+static void mont_square(digit_t *r, const digit_t *a, const digit_t *n,
+                        digit_t n_prime, unsigned len)
+{
+    digit_t t[NUM_DIGITS_x2 + 1] = { 0 };
+    digit_t q, msb;
+    ddigit_t cs;
+    int i, j;
+
+    for (i = 0; i < len - 1; ++i) {
+        cs = 0;
+        for (j = i + 1; j < len; ++j) {
+            cs += t[i + j] + (ddigit_t)a[i] * a[j];
+            t[i + j] = cs & DIGIT_MASK;
+            cs >>= DIGIT_BITS;
+        }
+        t[i + len] = cs;
+    }
+
+    msb = 0;
+    for (i = 0; i < 2 * len; ++i) {
+        digit_t d = t[i];
+        t[i] = ((d << 1) | msb) & DIGIT_MASK;
+        msb = d >> (DIGIT_BITS - 1);
+    }
+
+    cs = 0;
+    for (i = 0; i < len; ++i) {
+        cs += t[2 * i] + (ddigit_t)a[i] * a[i];
+        t[2 * i] = cs & DIGIT_MASK;
+        cs >>= DIGIT_BITS;
+        cs += t[2 * i + 1];
+        t[2 * i + 1] = cs & DIGIT_MASK;
+        cs >>= DIGIT_BITS;
+    }
+
+    for (i = 0; i < len; ++i) {
+        q = ((ddigit_t)t[i] * n_prime) & DIGIT_MASK;
+        cs = 0;
+        for (j = 0; j < len; ++j) {
+            cs += t[i + j] + (ddigit_t)q * n[j];
+            t[i + j] = cs & DIGIT_MASK;
+            cs >>= DIGIT_BITS;
+        }
+        for (j = i + len; cs && j <= 2 * len; ++j) {
+            cs += t[j];
+            t[j] = cs & DIGIT_MASK;
+            cs >>= DIGIT_BITS;
+        }
+    }
+
+    mont_sub_if_geq(r, t + len, t[2 * len], n, len);
+}
+
+// x = 2x mod n, for x < n
+static void mont_double(digit_t *x, const digit_t *n, unsigned len)
+{
+    digit_t carry = 0;
+    int i;
+
+    for (i = 0; i < len; ++i) {
+        ddigit_t d = ((ddigit_t)x[i] << 1) | carry;
+        x[i] = d & DIGIT_MASK;
+        carry = d >> DIGIT_BITS;
+    }
+    mont_sub_if_geq(x, x, carry, n, len);
+}
+
+// R mod n and R^2 mod n, by doubling 1 (< n) a bit at a time
+static void mont_constants(digit_t *r1, digit_t *r2, const digit_t *n,
+                           unsigned len)
+{
+    unsigned i, j;
+
+    for (i = 0; i < len; ++i)
+        r2[i] = i == 0;
+    for (i = 0; i < 2 * len * DIGIT_BITS; ++i) {
+        mont_double(r2, n, len);
+        if (i == len * DIGIT_BITS - 1) {
+            for (j = 0; j < len; ++j)
+                r1[j] = r2[j];
+        }
+    }
+}
+
+// -n^-1 mod 2^DIGIT_BITS by Newton's iteration: n is odd, so n is its own
+// inverse mod 2^3, and each step doubles the number of correct bits
+static digit_t mont_n_prime(digit_t n0)
+{
+    uint32_t inv = n0;
+    unsigned i;
+
+    for (i = 0; i < 4; ++i)
+        inv *= 2 - n0 * inv;
+    return -inv & DIGIT_MASK;
+}
+#endif
+
+#ifdef MULT_KARATSUBA
+// Scratch of karatsuba_mult on up to NUM_DIGITS digits: 4 * (ceil(n / 2) + 1)
+// for each level, which adds up to less than 4n + 64 over the recursion
+#define KARATSUBA_SCRATCH (4 * NUM_DIGITS + 8 * 8)
+
+// r holds z0 = a0 * b0 below digit 2 lo and z2 = a1 * b1 above it, for an
+// n-digit product split at lo = n / 2; adds in the middle term z1 - z0 - z2,
+// where z1 = (a0 + a1) * (b0 + b1) has 2 * (n - lo + 1) digits. z1 is
+// clobbered.
+static void karatsuba_middle(digit_t *r, digit_t *z1, unsigned n)
+{
+    unsigned lo = n / 2, hi = n - lo;
+    ddigit_t cs;
+    digit_t borrow;
+    unsigned i;
+
+    borrow = 0;
+    for (i = 0; i < 2 * (hi + 1); ++i) {
+        cs = (ddigit_t)(i < 2 * lo ? r[i] : 0) + (i < 2 * hi ? r[2 * lo + i] : 0) + borrow;
+        borrow = cs >> DIGIT_BITS;
+        cs &= DIGIT_MASK;
+        borrow += z1[i] < cs;
+        z1[i] = ((ddigit_t)z1[i] + ((ddigit_t)1 << DIGIT_BITS) - cs) & DIGIT_MASK;
+    }
+    cs = 0;
+    for (i = 0; lo + i < 2 * n; ++i) {
+        cs += r[lo + i] + (ddigit_t)(i < 2 * (hi + 1) ? z1[i] : 0);
+        r[lo + i] = cs & DIGIT_MASK;
+        cs >>= DIGIT_BITS;
+    }
+}
+
+// r = a * b, 2n digits, for a and b of n digits. Recurses on the halves
+// down to KARATSUBA_THRESHOLD digits, below which it is schoolbook.
+static void karatsuba_mult(digit_t *r, const digit_t *a, const digit_t *b,
+                           unsigned n, digit_t *scratch)
+{
+    unsigned lo = n / 2, hi = n - lo;
+    digit_t *sa = scratch, *sb = sa + hi + 1, *z1 = sb + hi + 1;
+    ddigit_t cs;
+    unsigned i, j;
+
+    if (n < KARATSUBA_THRESHOLD) {
+        for (i = 0; i < 2 * n; ++i)
+            r[i] = 0;
+        for (i = 0; i < n; ++i) {
+            cs = 0;
+            for (j = 0; j < n; ++j) {
+                cs += r[i + j] + (ddigit_t)a[i] * b[j];
+                r[i + j] = cs & DIGIT_MASK;
+                cs >>= DIGIT_BITS;
+            }
+            r[i + n] = cs;
+        }
+        return;
+    }
+
+    karatsuba_mult(r, a, b, lo, z1);                      // z0
+    karatsuba_mult(r + 2 * lo, a + lo, b + lo, hi, z1);   // z2
+
+    // sa = a0 + a1, sb = b0 + b1, hi + 1 digits each
+    cs = 0;
+    for (i = 0; i < hi; ++i) {
+        cs += (ddigit_t)a[lo + i] + (i < lo ? a[i] : 0);
+        sa[i] = cs & DIGIT_MASK;
+        cs >>= DIGIT_BITS;
+    }
+    sa[hi] = cs;
+    cs = 0;
+    for (i = 0; i < hi; ++i) {
+        cs += (ddigit_t)b[lo + i] + (i < lo ? b[i] : 0);
+        sb[i] = cs & DIGIT_MASK;
+        cs >>= DIGIT_BITS;
+    }
+    sb[hi] = cs;
+
+    karatsuba_mult(z1, sa, sb, hi + 1, z1 + 2 * (hi + 1));
+    karatsuba_middle(r, z1, n);
+}
+#endif
+
+#ifdef BARRETT
+// r -= n if r >= n, for r of k + 1 digits and n of k digits
+static bool barrett_sub_if_geq(digit_t *r, const digit_t *n)
+{
+    int i;
+    digit_t borrow = 0;
+
+    if (!r[NUM_DIGITS]) {
+        for (i = NUM_DIGITS - 1; i >= 0; --i) {
+            if (r[i] != n[i]) {
+                if (r[i] < n[i])
+                    return false;
+                break;
+            }
+        }
+    }
+
+    for (i = 0; i <= NUM_DIGITS; ++i) {
+        ddigit_t s = (ddigit_t)(i < NUM_DIGITS ? n[i] : 0) + borrow;
+        borrow = r[i] < s;
+        r[i] = ((ddigit_t)r[i] + ((ddigit_t)borrow << DIGIT_BITS) - s) & DIGIT_MASK;
+    }
+    return true;
+}
+
+// mu = floor(b^2k / n), by binary long division of b^2k, whose only set bit
+// is the top one. mu < b^(k+1) since n >= b^(k-1), and the remainder stays
+// below 2n, so both fit in k + 1 digits.
+static void barrett_mu(digit_t *mu, const digit_t *n)
+{
+    digit_t r[NUM_DIGITS + 1] = { 1 };
+    unsigned i;
+    int j;
+
+    for (j = 0; j <= NUM_DIGITS; ++j)
+        mu[j] = 0;
+
+    for (i = 0; i < NUM_DIGITS_x2 * DIGIT_BITS; ++i) {
+        digit_t r_msb = 0, mu_msb = 0;
+        for (j = 0; j <= NUM_DIGITS; ++j) {
+            ddigit_t d = ((ddigit_t)r[j] << 1) | r_msb;
+            r[j] = d & DIGIT_MASK;
+            r_msb = d >> DIGIT_BITS;
+            d = ((ddigit_t)mu[j] << 1) | mu_msb;
+            mu[j] = d & DIGIT_MASK;
+            mu_msb = d >> DIGIT_BITS;
+        }
+        if (barrett_sub_if_geq(r, n))
+            mu[0] |= 1;
+    }
+}
+#endif
+
+#ifdef CRT_DECRYPT
+static void crt_prime_init(crt_prime_t *k, const uint8_t *n, const uint8_t *d)
+{
+    int i;
+
+    for (i = 0; i < CRT_DIGITS; ++i) {
+        k->n[i] = bytes_to_digit(n, i);
+        k->d[i] = bytes_to_digit(d, i);
+    }
+    mont_constants(k->r1, k->r2, k->n, CRT_DIGITS);
+    k->n_prime = mont_n_prime(k->n[0]);
+
+    k->d_msb = CRT_DIGITS * DIGIT_BITS - 1;
+    while (k->d_msb > 0 && !((k->d[k->d_msb / DIGIT_BITS] >> (k->d_msb % DIGIT_BITS)) & 0x1))
+        k->d_msb--;
+}
+
+// Starts the exponentiation of cyphertext block c (NUM_DIGITS digits): the
+// base is c mod n = (c_hi * R + c_lo) mod n, where both halves are below R,
+// and R < 2n since the prime has all CRT_DIGITS digits.
+static void crt_load(crt_state_t *st, const crt_prime_t *k, const digit_t *c)
+{
+    digit_t x[CRT_DIGITS], y[CRT_DIGITS];
+    ddigit_t cs = 0;
+    int i;
+
+    mont_mult(x, c + CRT_DIGITS, k->r2, k->n, k->n_prime, CRT_DIGITS); // c_hi R
+    mont_sub_if_geq(y, c, 0, k->n, CRT_DIGITS); // c_lo mod n
+
+    for (i = 0; i < CRT_DIGITS; ++i) {
+        cs += (ddigit_t)x[i] + y[i];
+        x[i] = cs & DIGIT_MASK;
+        cs >>= DIGIT_BITS;
+    }
+    mont_sub_if_geq(x, x, cs, k->n, CRT_DIGITS);
+
+    mont_mult(st->base, x, k->r2, k->n, k->n_prime, CRT_DIGITS);
+    for (i = 0; i < CRT_DIGITS; ++i)
+        st->acc[i] = k->r1[i];
+    st->bit = k->d_msb;
+}
+
+// One left-to-right step of the exponentiation. Returns true, with the
+// result out of Montgomery form in m, once the last bit is done.
+static bool crt_exp_bit(crt_state_t *st, const crt_prime_t *k, digit_t *m)
+{
+    digit_t one[CRT_DIGITS] = { 1 };
+
+    mont_square(st->acc, st->acc, k->n, k->n_prime, CRT_DIGITS);
+    if ((k->d[st->bit / DIGIT_BITS] >> (st->bit % DIGIT_BITS)) & 0x1)
+        mont_mult(st->acc, st->acc, st->base, k->n, k->n_prime, CRT_DIGITS);
+
+    if (--st->bit >= 0)
+        return false;
+
+    mont_mult(m, st->acc, one, k->n, k->n_prime, CRT_DIGITS);
+    st->block++;
+    return true;
+}
+#endif
+
 
 /*-------------------------Joint init task -------------------------------*/
 
@@ -584,12 +2411,27 @@ void task_init()
 
     LOG("init\r\n");
 
-    for (i = 0; i < NUM_BUCKETS; ++i) {
-        fingerprint_t fp = 0;
-        CHAN_OUT1(fingerprint_t, filter[i], fp, MC_OUT_CH(ch_filter, task_init,
-                               task_add, task_relocate, task_insert_done,
+#ifdef FUSED_HASH
+    // Nonzero, so that the two candidate buckets always differ
+    for (i = 0; i < NUM_FP_INDEXES; ++i)
+        fp_index[i] = (mult_hash(i) >> 16) % (NUM_BUCKETS - 1) + 1;
+#endif
+
+    bucket_t bucket = { { 0 } };
+    CHAN_FILL_ARRAY1(bucket_t, filter, 0, bucket, NUM_BUCKETS, SHARED_CH(ch_filter));
+
+#if STASH_SIZE > 0
+    fingerprint_t fp = 0;
+    CHAN_FILL_ARRAY1(fingerprint_t, stash_fp, 0, fp, STASH_SIZE,
+                     MC_OUT_CH(ch_stash_init, task_init,
+                               task_relocate, task_stash_rehome, task_insert_done,
                                task_lookup_search, task_print_stats));
-    }
+    unsigned stash_count = 0;
+    CHAN_OUT1(unsigned, stash_count, stash_count,
+              MC_OUT_CH(ch_stash_init, task_init,
+                        task_relocate, task_stash_rehome, task_insert_done,
+                        task_lookup_search, task_print_stats));
+#endif
 
     unsigned count = 0;
     CHAN_OUT1(unsigned, insert_count, count, CH(task_init, task_insert_done));
@@ -599,8 +2441,20 @@ void task_init()
     CHAN_OUT1(unsigned, member_count, count, CH(task_init, task_lookup_done));
 
     CHAN_OUT1(value_t, key, init_key, CH(task_init, task_generate_key));
+#if BATCH_SIZE > 1
+    unsigned batch_count = NUM_INSERTS < BATCH_SIZE ? NUM_INSERTS : BATCH_SIZE;
+    CHAN_OUT1(unsigned, batch_count, batch_count, CH(task_init, task_generate_key));
+    task_t *next_task = TASK_REF(task_insert_batch);
+#else
     task_t *next_task = TASK_REF(task_insert);
+#endif
     CHAN_OUT1(task_t *, next_task, next_task, CH(task_init, task_generate_key));
+
+#ifdef BENCHMARK
+    bench_t bench = { 0 };
+    bench.phase = BENCH_PHASE_START;
+    CHAN_OUT1(bench_t, bench, bench, CH(task_init, task_bench));
+#endif
 /*-------------------------RSA  app init start----------------------------*/
     
     unsigned message_length = sizeof(PLAINTEXT) - 1; // skip the terminating null byte
@@ -612,33 +2466,129 @@ void task_init()
 #endif
 
     printf("Message:\r\n"); print_hex_ascii(PLAINTEXT, message_length);
-    printf("Public key: exp = 0x%x  N = \r\n", pubkey.e);
-    print_hex_ascii(pubkey.n, NUM_DIGITS);
+    printf("Public key: exp = 0x%lx  N = \r\n", (unsigned long)pubkey.e);
+    print_hex_ascii(pubkey.n, KEY_SIZE_BYTES);
 
     LOG("init: out modulus\r\n");
 
     // TODO: consider passing pubkey as a structure type
-    for (i = 0; i < NUM_DIGITS; ++i) {
-        CHAN_OUT1(digit_t, N[i], pubkey.n[i], MC_OUT_CH(ch_modulus, task_init,
-                 task_reduce_normalizable, task_reduce_normalize,
-                 task_reduce_m_divisor, task_reduce_quotient,
-                 task_reduce_multiply, task_reduce_add));
-    }
+    digit_t n[NUM_DIGITS];
+    for (i = 0; i < NUM_DIGITS; ++i)
+        n[i] = bytes_to_digit(pubkey.n, i);
+    CHAN_OUT_ARRAY1(digit_t, N, 0, n, NUM_DIGITS, MC_OUT_CH(ch_modulus, task_init,
+                    task_reduce_normalizable, task_reduce_normalize,
+                    task_reduce_n_divisor, task_reduce_quotient,
+                    task_reduce_multiply, task_reduce_add));
+
+#ifdef MONTGOMERY
+    digit_t r1[NUM_DIGITS], r2[NUM_DIGITS];
+
+    mont_constants(r1, r2, n, NUM_DIGITS);
+    CHAN_OUT_ARRAY1(digit_t, R1, 0, r1, NUM_DIGITS, MC_OUT_CH(ch_montgomery, task_init,
+                    task_pad, task_mult_mod, task_mult_block_get_result));
+    CHAN_OUT_ARRAY1(digit_t, R2, 0, r2, NUM_DIGITS, MC_OUT_CH(ch_montgomery, task_init,
+                    task_pad, task_mult_mod, task_mult_block_get_result));
+
+    digit_t n_prime = mont_n_prime(n[0]);
+    CHAN_OUT1(digit_t, n_prime, n_prime, MC_OUT_CH(ch_montgomery, task_init,
+              task_pad, task_mult_mod, task_mult_block_get_result));
+#endif
+
+#ifdef BARRETT
+    digit_t mu[NUM_DIGITS + 1];
+
+    barrett_mu(mu, n);
+    CHAN_OUT_ARRAY1(digit_t, mu, 0, mu, NUM_DIGITS + 1, MC_OUT_CH(ch_barrett, task_init,
+                    task_reduce_barrett_quotient));
+#endif
+
+#ifdef CRT_DECRYPT
+    crt_prime_t crt_prime;
+    crt_prime_init(&crt_prime, privkey.p, privkey.dp);
+    CHAN_OUT1(crt_prime_t, crt_p, crt_prime, MC_OUT_CH(ch_crt, task_init,
+              task_crt_exp_p, task_crt_exp_q, task_crt_combine));
+    crt_prime_init(&crt_prime, privkey.q, privkey.dq);
+    CHAN_OUT1(crt_prime_t, crt_q, crt_prime, MC_OUT_CH(ch_crt, task_init,
+              task_crt_exp_p, task_crt_exp_q, task_crt_combine));
+    digit_t qinv[CRT_DIGITS];
+    for (i = 0; i < CRT_DIGITS; ++i)
+        qinv[i] = bytes_to_digit(privkey.qinv, i);
+    CHAN_OUT_ARRAY1(digit_t, qinv, 0, qinv, CRT_DIGITS, MC_OUT_CH(ch_crt, task_init,
+                    task_crt_exp_p, task_crt_exp_q, task_crt_combine));
+
+    bool crt_done = false;
+    CHAN_OUT1(bool, crt_done, crt_done, CH(task_init, task_crt_exp_p));
+    CHAN_OUT1(bool, crt_done, crt_done, CH(task_init, task_crt_exp_q));
+#endif
 
     LOG("init: out exp\r\n");
 
-    unsigned zero = 0;
-    CHAN_OUT1(digit_t, E, pubkey.e, CH(task_init, task_pad));
-    CHAN_OUT1(unsigned, message_length, message_length, CH(task_init, task_pad));
-    CHAN_OUT1(unsigned, block_offset, zero, CH(task_init, task_pad));
-    CHAN_OUT1(unsigned, cyphertext_len, zero, CH(task_init, task_mult_block_get_result));
+    for (i = 0; i < RSA_THREADS; ++i) {
+        unsigned block_offset = i * (KEY_SIZE_BYTES - NUM_PAD_BYTES);
+        unsigned cyphertext_len = i * NUM_DIGITS;
+        CHAN_OUT1(exponent_t, LANE_AT(i, E), pubkey.e, CH(task_init, task_pad));
+        CHAN_OUT1(unsigned, LANE_AT(i, message_length), message_length,
+                  CH(task_init, task_pad));
+        CHAN_OUT1(unsigned, LANE_AT(i, block_offset), block_offset, CH(task_init, task_pad));
+        CHAN_OUT1(unsigned, LANE_AT(i, cyphertext_len), cyphertext_len,
+                  CH(task_init, task_mult_block_get_result));
+#ifdef BLOCK_CYCLES
+        block_time_t block_time = 0;
+        CHAN_OUT1(block_time_t, LANE_AT(i, block_time), block_time,
+                  CH(task_init, task_mult_block_get_result));
+#endif
+#if RSA_THREADS > 1
+        bool lane_done = false;
+        CHAN_OUT1(bool, lane_done[i], lane_done, MC_OUT_CH(ch_lane_done, task_init, task_pad));
+#endif
+    }
 
     LOG("init: done\r\n");
 
+#ifdef PROBE_LOOKUPS
+    // The probe keys follow the inserted ones
+    value_t probe_key = init_key;
+    for (i = 0; i < NUM_INSERTS; ++i)
+        probe_key = next_key(probe_key);
+    CHAN_OUT1(value_t, key, probe_key, CH(task_init, task_probe));
+    CHAN_OUT1(unsigned, probe_count, count, CH(task_init, task_probe));
+    CHAN_OUT1(unsigned, hit_count, count, CH(task_init, task_probe));
+#endif
+
 /*-----------------------THREAD_CREATE calls to separate programs--------------------------*/
+    // Thread ids count up from 0 in creation order; the threads that call
+    // ch_calc_indexes get a frame of it each
+#if CALC_INDEXES_CALLERS > 1
+    for (i = 0; i < CALC_INDEXES_CALLERS; ++i)
+        CALC_INDEXES_CALLER(i, CALC_INDEXES_NO_CALLER);
+#endif
+#ifdef BENCHMARK
+    CALC_INDEXES_CALLER(0, 0);
+    THREAD_CREATE(task_bench);
+    TRANSITION_TO_MT(task_bench);
+#elif defined(BLOCK_CYCLES)
+    THREAD_CREATE(task_pad);
+    TRANSITION_TO_MT(task_pad);
+#elif RSA_THREADS > 1
+    for (i = 0; i < RSA_THREADS; ++i)
+        THREAD_CREATE(task_pad); // lane i, see RSA_LANE
+    CALC_INDEXES_CALLER(0, RSA_THREADS);
+    THREAD_CREATE(task_generate_key);
+#ifdef PROBE_LOOKUPS
+    CALC_INDEXES_CALLER(1, RSA_THREADS + 1);
+    THREAD_CREATE(task_probe);
+#endif
+    TRANSITION_TO_MT(task_pad);
+#else
+    CALC_INDEXES_CALLER(0, 0);
     THREAD_CREATE(task_generate_key); 
     THREAD_CREATE(task_pad); 
+#ifdef PROBE_LOOKUPS
+    CALC_INDEXES_CALLER(1, 2);
+    THREAD_CREATE(task_probe);
+#endif
     TRANSITION_TO_MT(task_pad);
+#endif
 }
 
 
@@ -647,26 +2597,65 @@ void task_generate_key()
 {
     task_prologue();
 
+#ifdef BENCHMARK
+    value_t key = *CHAN_IN5(value_t, key, CH(task_init, task_generate_key),
+                                          CH(task_insert_done, task_generate_key),
+                                          CH(task_lookup_done, task_generate_key),
+                                          CH(task_bench, task_generate_key),
+                                          SELF_IN_CH(task_generate_key));
+#else
     value_t key = *CHAN_IN4(value_t, key, CH(task_init, task_generate_key),
                                           CH(task_insert_done, task_generate_key),
                                           CH(task_lookup_done, task_generate_key),
                                           SELF_IN_CH(task_generate_key));
+#endif
 
     // insert pseufo-random integers, for testing
     // If we use consecutive ints, they hash to consecutive DJB hashes...
     // NOTE: we are not using rand(), to have the sequence available to verify
     // that that are no false negatives (and avoid having to save the values).
-    key = (key + 1) * 17;
+#if BATCH_SIZE > 1
+    unsigned i;
+    unsigned batch_count = *CHAN_IN3(unsigned, batch_count,
+                                     CH(task_init, task_generate_key),
+                                     CH(task_insert_done, task_generate_key),
+                                     CH(task_lookup_done, task_generate_key));
+
+    for (i = 0; i < batch_count; ++i) {
+        key = next_key(key);
+
+        LOG("generate_key: key[%u]: %x\r\n", i, key);
+
+        CHAN_OUT1(value_t, key[i], key, MC_OUT_CH(ch_keys, task_generate_key,
+                                                  task_insert_batch, task_lookup_batch));
+    }
+    CHAN_OUT1(unsigned, batch_count, batch_count,
+              MC_OUT_CH(ch_keys, task_generate_key,
+                        task_insert_batch, task_lookup_batch));
+    unsigned batch_first = 0;
+    CHAN_OUT1(unsigned, batch_first, batch_first,
+              MC_OUT_CH(ch_keys, task_generate_key, task_insert_batch));
+    CHAN_OUT1(value_t, key, key, SELF_OUT_CH(task_generate_key));
+#else
+    key = next_key(key);
 
     LOG("generate_key: key: %x\r\n", key);
 
     CHAN_OUT2(value_t, key, key, MC_OUT_CH(ch_key, task_generate_key,
-                                           task_fingerprint, task_lookup),
+                                           task_insert, task_lookup),
                                  SELF_OUT_CH(task_generate_key));
+#endif
 
+#ifdef BENCHMARK
+    task_t *next_task = *CHAN_IN3(task_t *, next_task,
+                                  CH(task_init, task_generate_key),
+                                  CH(task_insert_done, task_generate_key),
+                                  CH(task_bench, task_generate_key));
+#else
     task_t *next_task = *CHAN_IN2(task_t *, next_task,
                                   CH(task_init, task_generate_key),
                                   CH(task_insert_done, task_generate_key));
+#endif
     transition_to_mt(next_task);
 }
 
@@ -674,16 +2663,33 @@ void task_calc_indexes()
 {
     task_prologue();
 
-    value_t key = *CHAN_IN1(value_t, key, CALL_CH(ch_calc_indexes));
+    value_t key = *CHAN_IN1(value_t, FRAME(key), CALL_CH(ch_calc_indexes));
 
+#ifdef FUSED_HASH
+    fingerprint_t fp;
+    index_t index1, index2;
+
+    calc_indexes(key, &fp, &index1, &index2);
+    LOG("calc indexes: key %04x fp %04x idx1 %u idx2 %u\r\n",
+        key, fp, index1, index2);
+
+    CHAN_OUT1(fingerprint_t, FRAME(fingerprint), fp, RET_CH(ch_calc_indexes));
+    CHAN_OUT1(index_t, FRAME(index1), index1, RET_CH(ch_calc_indexes));
+    CHAN_OUT1(index_t, FRAME(index2), index2, RET_CH(ch_calc_indexes));
+
+    task_t *next_task = *CHAN_IN1(task_t *, FRAME(next_task),
+                                  CALL_CH(ch_calc_indexes));
+    transition_to_mt(next_task);
+#else
     fingerprint_t fp = hash_to_fingerprint(key);
     LOG("calc indexes: fingerprint: key %04x fp %04x\r\n", key, fp);
 
-    CHAN_OUT2(fingerprint_t, fingerprint, fp,
+    CHAN_OUT2(fingerprint_t, FRAME(fingerprint), fp,
               CH(task_calc_indexes, task_calc_indexes_index_2),
               RET_CH(ch_calc_indexes));
 
     TRANSITION_TO_MT(task_calc_indexes_index_1);
+#endif
 }
 
 void task_calc_indexes_index_1()
@@ -691,12 +2697,12 @@ void task_calc_indexes_index_1()
     task_prologue();
     LOG("CALC_INDEXES_cuckoo\r\n"); 
 
-    value_t key = *CHAN_IN1(value_t, key, CALL_CH(ch_calc_indexes));
+    value_t key = *CHAN_IN1(value_t, FRAME(key), CALL_CH(ch_calc_indexes));
 
     index_t index1 = hash_to_index(key);
     LOG("calc indexes: index1: key %04x idx1 %u\r\n", key, index1);
 
-    CHAN_OUT2(index_t, index1, index1,
+    CHAN_OUT2(index_t, FRAME(index1), index1,
               CH(task_calc_indexes_index_1, task_calc_indexes_index_2),
               RET_CH(ch_calc_indexes));
 
@@ -707,9 +2713,9 @@ void task_calc_indexes_index_2()
 {
     task_prologue();
     LOG("CALC_INDEXES_2_cuckoo\r\n"); 
-    fingerprint_t fp = *CHAN_IN1(fingerprint_t, fingerprint,
+    fingerprint_t fp = *CHAN_IN1(fingerprint_t, FRAME(fingerprint),
                                  CH(task_calc_indexes, task_calc_indexes_index_2));
-    index_t index1 = *CHAN_IN1(index_t, index1,
+    index_t index1 = *CHAN_IN1(index_t, FRAME(index1),
                                CH(task_calc_indexes_index_1, task_calc_indexes_index_2));
 
     index_t fp_hash = hash_to_index(fp);
@@ -718,9 +2724,9 @@ void task_calc_indexes_index_2()
     LOG("calc indexes: index2: fp hash: %04x idx1 %u idx2 %u\r\n",
         fp_hash, index1, index2);
 
-    CHAN_OUT1(index_t, index2, index2, RET_CH(ch_calc_indexes));
+    CHAN_OUT1(index_t, FRAME(index2), index2, RET_CH(ch_calc_indexes));
 
-    task_t *next_task = *CHAN_IN1(task_t *, next_task,
+    task_t *next_task = *CHAN_IN1(task_t *, FRAME(next_task),
                                   CALL_CH(ch_calc_indexes));
     transition_to_mt(next_task);
 }
@@ -736,10 +2742,10 @@ void task_insert()
 
     LOG("insert: key %04x\r\n", key);
 
-    CHAN_OUT1(value_t, key, key, CALL_CH(ch_calc_indexes));
+    CHAN_OUT1(value_t, FRAME(key), key, CALL_CH(ch_calc_indexes));
 
     task_t *next_task = TASK_REF(task_add);
-    CHAN_OUT1(task_t *, next_task, next_task, CALL_CH(ch_calc_indexes));
+    CHAN_OUT1(task_t *, FRAME(next_task), next_task, CALL_CH(ch_calc_indexes));
     TRANSITION_TO_MT(task_calc_indexes);
 }
 
@@ -750,87 +2756,293 @@ void task_add()
     LOG("TASK_ADD_cuckoo\r\n");
 
     bool success = true;
+    unsigned i, slot;
+    bucket_t bucket;
 
     // Fingerprint being inserted
-    fingerprint_t fp = *CHAN_IN1(fingerprint_t, fingerprint,
+    fingerprint_t fp = *CHAN_IN1(fingerprint_t, FRAME(fingerprint),
                                  RET_CH(ch_calc_indexes));
     LOG("add: fp %04x\r\n", fp);
 
-    // index1,fp1 and index2,fp2 are the two alternative buckets
+    // index1 and index2 are the two alternative buckets, of BUCKET_SIZE slots each
 
-    index_t index1 = *CHAN_IN1(index_t, index1, RET_CH(ch_calc_indexes));
+    index_t index1 = *CHAN_IN1(index_t, FRAME(index1), RET_CH(ch_calc_indexes));
 
-    fingerprint_t fp1 = *CHAN_IN3(fingerprint_t, filter[index1],
-                                 MC_IN_CH(ch_filter, task_init, task_add),
-                                 CH(task_relocate, task_add),
-                                 SELF_IN_CH(task_add));
-    LOG("add: idx1 %u fp1 %04x\r\n", index1, fp1);
+    bucket = *CHAN_IN1(bucket_t, filter[index1], SHARED_CH(ch_filter));
 
-    if (!fp1) {
-        LOG("add: filled empty slot at idx1 %u\r\n", index1);
+    for (i = 0; i < BUCKET_SIZE; ++i) {
+        slot = SLOT(index1, i);
+        fingerprint_t fp1 = bucket_get(&bucket, i);
+        LOG("add: idx1 %u slot %u fp1 %04x\r\n", index1, i, fp1);
 
-        CHAN_OUT2(fingerprint_t, filter[index1], fp,
-                  MC_OUT_CH(ch_filter_add, task_add,
-                            task_relocate, task_insert_done,
-                            task_lookup_search, task_print_stats),
-                  SELF_OUT_CH(task_add));
+        if (!fp1) {
+            LOG("add: filled empty slot at idx1 %u slot %u\r\n", index1, i);
 
-        CHAN_OUT1(bool, success, success, CH(task_add, task_insert_done));
-        TRANSITION_TO_MT(task_insert_done);
-    } else {
-        index_t index2 = *CHAN_IN1(index_t, index2, RET_CH(ch_calc_indexes));
-        fingerprint_t fp2 = *CHAN_IN3(fingerprint_t, filter[index2],
-                                     MC_IN_CH(ch_filter, task_init, task_add),
-                                     CH(task_relocate, task_add),
-                                     SELF_IN_CH(task_add));
-        LOG("add: fp2 %04x\r\n", fp2);
+            bucket_set(&bucket, i, fp);
+            CHAN_OUT1(bucket_t, filter[index1], bucket, SHARED_CH(ch_filter));
+
+#ifdef VERBOSE
+            unsigned journal_len = 1;
+            CHAN_OUT1(unsigned, journal[0], slot, CH(task_add, task_insert_done));
+            CHAN_OUT1(unsigned, journal_len, journal_len, CH(task_add, task_insert_done));
+#endif
+#ifdef BENCHMARK
+            unsigned relocations = 0;
+            CHAN_OUT1(unsigned, relocations, relocations, CH(task_add, task_insert_done));
+#endif
+            CHAN_OUT1(bool, success, success, CH(task_add, task_insert_done));
+            TRANSITION_TO_MT(task_insert_done);
+        }
+    }
+
+    index_t index2 = *CHAN_IN1(index_t, FRAME(index2), RET_CH(ch_calc_indexes));
+
+    bucket = *CHAN_IN1(bucket_t, filter[index2], SHARED_CH(ch_filter));
+
+    for (i = 0; i < BUCKET_SIZE; ++i) {
+        slot = SLOT(index2, i);
+        fingerprint_t fp2 = bucket_get(&bucket, i);
+        LOG("add: idx2 %u slot %u fp2 %04x\r\n", index2, i, fp2);
 
         if (!fp2) {
-            LOG("add: filled empty slot at idx2 %u\r\n", index2);
+            LOG("add: filled empty slot at idx2 %u slot %u\r\n", index2, i);
+
+            bucket_set(&bucket, i, fp);
+            CHAN_OUT1(bucket_t, filter[index2], bucket, SHARED_CH(ch_filter));
+
+#ifdef VERBOSE
+            unsigned journal_len = 1;
+            CHAN_OUT1(unsigned, journal[0], slot, CH(task_add, task_insert_done));
+            CHAN_OUT1(unsigned, journal_len, journal_len, CH(task_add, task_insert_done));
+#endif
+#ifdef BENCHMARK
+            unsigned relocations = 0;
+            CHAN_OUT1(unsigned, relocations, relocations, CH(task_add, task_insert_done));
+#endif
+            CHAN_OUT1(bool, success, success, CH(task_add, task_insert_done));
+            TRANSITION_TO_MT(task_insert_done);
+        }
+    }
+
+#ifdef RELOCATE_BFS
+    // Both buckets are full: task_relocate searches for an eviction path,
+    // starting from the fingerprint being inserted
+    CHAN_OUT1(index_t, index_victim, index1, CH(task_add, task_relocate));
+    CHAN_OUT1(fingerprint_t, fp_victim, fp, CH(task_add, task_relocate));
+#if STASH_SIZE > 0
+    unsigned stash_entry = STASH_NONE;
+    CHAN_OUT1(unsigned, stash_entry, stash_entry, CH(task_add, task_relocate));
+#endif
+
+    TRANSITION_TO_MT(task_relocate);
+#else
+    // Both buckets are full: evict one entry from one of them
+    index_t index_victim = (rand() % 2) ? index1 : index2;
+    i = BUCKET_SIZE > 1 ? rand() % BUCKET_SIZE : 0;
+    slot = SLOT(index_victim, i);
+
+    bucket = *CHAN_IN1(bucket_t, filter[index_victim], SHARED_CH(ch_filter));
+    fingerprint_t fp_victim = bucket_get(&bucket, i);
+
+    LOG("add: evict [%u] = %04x\r\n", slot, fp_victim);
+
+    // Evict the victim
+    bucket_set(&bucket, i, fp);
+    CHAN_OUT1(bucket_t, filter[index_victim], bucket, SHARED_CH(ch_filter));
+
+#ifdef VERBOSE
+    // task_relocate extends this journal and reports its length
+    CHAN_OUT1(unsigned, journal[0], slot, CH(task_add, task_insert_done));
+#endif
+
+    CHAN_OUT1(index_t, index_victim, index_victim, CH(task_add, task_relocate));
+    CHAN_OUT1(fingerprint_t, fp_victim, fp_victim, CH(task_add, task_relocate));
+    unsigned relocation_count = 0;
+    CHAN_OUT1(unsigned, relocation_count, relocation_count,
+              CH(task_add, task_relocate));
+#if STASH_SIZE > 0
+    unsigned stash_entry = STASH_NONE;
+    CHAN_OUT1(unsigned, stash_entry, stash_entry, CH(task_add, task_relocate));
+#endif
+
+    TRANSITION_TO_MT(task_relocate);
+#endif
+}
+
+#if STASH_SIZE > 0
+static void stash_out(unsigned entry, fingerprint_t fp, index_t index,
+                      unsigned count)
+{
+    CHAN_OUT2(fingerprint_t, stash_fp[entry], fp,
+              MC_OUT_CH(ch_stash, task_relocate,
+                        task_stash_rehome, task_insert_done, task_lookup_search,
+                        task_print_stats),
+              SELF_OUT_CH(task_relocate));
+    CHAN_OUT2(index_t, stash_index[entry], index,
+              MC_OUT_CH(ch_stash, task_relocate,
+                        task_stash_rehome, task_insert_done, task_lookup_search,
+                        task_print_stats),
+              SELF_OUT_CH(task_relocate));
+    CHAN_OUT2(unsigned, stash_count, count,
+              MC_OUT_CH(ch_stash, task_relocate,
+                        task_stash_rehome, task_insert_done, task_lookup_search,
+                        task_print_stats),
+              SELF_OUT_CH(task_relocate));
+}
+#endif
+
+// Ends an eviction chain of task_relocate. fp_lost is the fingerprint left
+// without a slot (0 if none), last evicted from bucket index_lost, after
+// moving 'relocations' fingerprints. A chain started by task_stash_rehome
+// (stash_entry) frees or reuses its entry and resumes the key generator,
+// which task_insert_done already set up.
+static void relocate_finish(fingerprint_t fp_lost, index_t index_lost,
+                            unsigned stash_entry, unsigned relocations)
+{
+    bool success = !fp_lost;
+
+#if STASH_SIZE > 0
+    unsigned entry = stash_entry;
+    unsigned stash_count = *CHAN_IN2(unsigned, stash_count,
+                                     MC_IN_CH(ch_stash_init, task_init, task_relocate),
+                                     SELF_IN_CH(task_relocate));
+
+    if (fp_lost && entry == STASH_NONE) {
+        for (entry = 0; entry < STASH_SIZE; ++entry) {
+            fingerprint_t fp = *CHAN_IN2(fingerprint_t, stash_fp[entry],
+                                         MC_IN_CH(ch_stash_init, task_init, task_relocate),
+                                         SELF_IN_CH(task_relocate));
+            if (!fp)
+                break;
+        }
+        if (entry < STASH_SIZE)
+            stash_count++;
+    }
+
+    if (fp_lost && entry < STASH_SIZE) {
+        LOG("relocate: stash [%u] = %04x\r\n", entry, fp_lost);
+        stash_out(entry, fp_lost, index_lost, stash_count);
+        success = true;
+    } else if (!fp_lost && entry < STASH_SIZE) {
+        LOG("relocate: rehomed stash [%u]\r\n", entry);
+        stash_out(entry, 0, 0, stash_count - 1);
+    }
+#endif
+
+#ifndef BENCHMARK // counted as failed inserts instead
+    if (!success)
+        PRINTF("insert: lost fp %04x\r\n", fp_lost);
+#endif
 
-            CHAN_OUT2(fingerprint_t, filter[index2], fp,
-                      MC_OUT_CH(ch_filter_add, task_add,
-                                task_relocate, task_insert_done, task_lookup_search),
-                      SELF_OUT_CH(task_add));
+#if STASH_SIZE > 0
+    if (stash_entry != STASH_NONE)
+        TRANSITION_TO_MT(task_generate_key);
+#endif
 
-            CHAN_OUT1(bool, success, success, CH(task_add, task_insert_done));
-            TRANSITION_TO_MT(task_insert_done);
-        } else { // evict one of the two entries
-            fingerprint_t fp_victim;
-            index_t index_victim;
-
-            if (rand() % 2) {
-                index_victim = index1;
-                fp_victim = fp1;
-            } else {
-                index_victim = index2;
-                fp_victim = fp2;
-            }
+#ifdef BENCHMARK
+    CHAN_OUT1(unsigned, relocations, relocations, CH(task_relocate, task_insert_done));
+#endif
+    CHAN_OUT1(bool, success, success, CH(task_relocate, task_insert_done));
+    TRANSITION_TO_MT(task_insert_done);
+}
 
-            LOG("add: evict [%u] = %04x\r\n", index_victim, fp_victim);
+#ifdef RELOCATE_BFS
+static bucket_t relocate_filter_in(index_t index)
+{
+    return *CHAN_IN1(bucket_t, filter[index], SHARED_CH(ch_filter));
+}
 
-            // Evict the victim
-            CHAN_OUT2(fingerprint_t, filter[index_victim], fp,
-                      MC_OUT_CH(ch_filter_add, task_add,
-                                task_relocate, task_insert_done, task_lookup_search),
-                      SELF_OUT_CH(task_add));
+void task_relocate()
+{
+    task_prologue();
+    LOG("TASK_RELOCATE_cuckoo\r\n");
 
-            CHAN_OUT1(index_t, index_victim, index_victim, CH(task_add, task_relocate));
-            CHAN_OUT1(fingerprint_t, fp_victim, fp_victim, CH(task_add, task_relocate));
-            unsigned relocation_count = 0;
-            CHAN_OUT1(unsigned, relocation_count, relocation_count,
-                      CH(task_add, task_relocate));
+    unsigned node, parent, slot, free_slot;
+    unsigned journal_len = 0;
+    index_t index;
+    bucket_t bucket;
+    unsigned stash_entry = STASH_NONE;
+
+#if STASH_SIZE > 0
+    fingerprint_t fp = *CHAN_IN2(fingerprint_t, fp_victim,
+                                 CH(task_add, task_relocate),
+                                 CH(task_stash_rehome, task_relocate));
+    index_t index1 = *CHAN_IN2(index_t, index_victim,
+                               CH(task_add, task_relocate),
+                               CH(task_stash_rehome, task_relocate));
+    stash_entry = *CHAN_IN2(unsigned, stash_entry,
+                            CH(task_add, task_relocate),
+                            CH(task_stash_rehome, task_relocate));
+#else
+    fingerprint_t fp = *CHAN_IN1(fingerprint_t, fp_victim, CH(task_add, task_relocate));
+    index_t index1 = *CHAN_IN1(index_t, index_victim, CH(task_add, task_relocate));
+#endif
+    index_t index2 = index1 ^ fp_to_index(fp);
+
+    node = bfs_search(index1, index2, relocate_filter_in, &free_slot);
+
+    if (node != BFS_ROOT) {
+        LOG("relocate: path of %u moves\r\n", bfs_path_len(node) - 1);
+
+        // Walk back from the free slot: each fingerprint on the path moves
+        // into the slot vacated by the next, and fp takes the first one
+        // The buckets on a path are distinct, so each is read and written once
+        index = bfs_nodes[node].bucket;
+        slot = free_slot;
+        for (; node != BFS_ROOT; node = parent) {
+            parent = bfs_nodes[node].parent;
+            fingerprint_t fp_move = parent == BFS_ROOT ? fp : bfs_nodes[node].fp;
+
+            LOG("relocate: [%u] = %04x\r\n", SLOT(index, slot), fp_move);
+            bucket = relocate_filter_in(index);
+            bucket_set(&bucket, slot, fp_move);
+            CHAN_OUT1(bucket_t, filter[index], bucket, SHARED_CH(ch_filter));
+#ifdef VERBOSE
+            unsigned journal_slot = SLOT(index, slot);
+            CHAN_OUT1(unsigned, journal[journal_len], journal_slot,
+                      CH(task_relocate, task_insert_done));
+#endif
+            journal_len++;
 
-            TRANSITION_TO_MT(task_relocate);
+            if (parent != BFS_ROOT) {
+                index = bfs_nodes[parent].bucket;
+                slot = bfs_nodes[node].slot;
+            }
         }
+        fp = 0;
     }
-}
 
+#ifdef VERBOSE
+    CHAN_OUT1(unsigned, journal_len, journal_len, CH(task_relocate, task_insert_done));
+#endif
+    // Without a path nothing was evicted: only fp itself is left over
+    relocate_finish(fp, index1, stash_entry, journal_len ? journal_len - 1 : 0);
+}
+#else
 void task_relocate()
 {
     task_prologue();
     LOG("TASK_RELOCATE_cuckoo\r\n");
 
+    unsigned i, slot;
+    unsigned stash_entry = STASH_NONE;
+
+#if STASH_SIZE > 0
+    fingerprint_t fp_victim = *CHAN_IN3(fingerprint_t, fp_victim,
+                                        CH(task_add, task_relocate),
+                                        CH(task_stash_rehome, task_relocate),
+                                        SELF_IN_CH(task_relocate));
+
+    index_t index1_victim = *CHAN_IN3(index_t, index_victim,
+                                      CH(task_add, task_relocate),
+                                      CH(task_stash_rehome, task_relocate),
+                                      SELF_IN_CH(task_relocate));
+
+    stash_entry = *CHAN_IN3(unsigned, stash_entry,
+                            CH(task_add, task_relocate),
+                            CH(task_stash_rehome, task_relocate),
+                            SELF_IN_CH(task_relocate));
+#else
     fingerprint_t fp_victim = *CHAN_IN2(fingerprint_t, fp_victim,
                                         CH(task_add, task_relocate),
                                         SELF_IN_CH(task_relocate));
@@ -838,51 +3050,73 @@ void task_relocate()
     index_t index1_victim = *CHAN_IN2(index_t, index_victim,
                                       CH(task_add, task_relocate),
                                       SELF_IN_CH(task_relocate));
+#endif
 
-    index_t fp_hash_victim = hash_to_index(fp_victim);
+    index_t fp_hash_victim = fp_to_index(fp_victim);
     index_t index2_victim = index1_victim ^ fp_hash_victim;
 
     LOG("relocate: victim fp hash %04x idx1 %u idx2 %u\r\n",
         fp_hash_victim, index1_victim, index2_victim);
 
-    fingerprint_t fp_next_victim =
-        *CHAN_IN3(fingerprint_t, filter[index2_victim],
-                  MC_IN_CH(ch_filter, task_init, task_relocate),
-                  MC_IN_CH(ch_filter_add, task_add, task_relocate),
-                  SELF_IN_CH(task_relocate));
+    fingerprint_t fp_next_victim;
+    bucket_t bucket = *CHAN_IN1(bucket_t, filter[index2_victim], SHARED_CH(ch_filter));
 
-    LOG("relocate: next victim fp %04x\r\n", fp_next_victim);
+    // Prefer a free slot in the alternate bucket, otherwise displace a
+    // random occupant of it
+    for (i = 0; i < BUCKET_SIZE; ++i) {
+        fp_next_victim = bucket_get(&bucket, i);
+        if (!fp_next_victim)
+            break;
+    }
+    if (fp_next_victim) {
+        i = BUCKET_SIZE > 1 ? rand() % BUCKET_SIZE : 0;
+        fp_next_victim = bucket_get(&bucket, i);
+    }
+    slot = SLOT(index2_victim, i);
+
+    LOG("relocate: next victim [%u] fp %04x\r\n", slot, fp_next_victim);
+
+#if STASH_SIZE > 0
+    unsigned relocation_count = *CHAN_IN3(unsigned, relocation_count,
+                                          CH(task_add, task_relocate),
+                                          CH(task_stash_rehome, task_relocate),
+                                          SELF_IN_CH(task_relocate));
+#else
+    unsigned relocation_count = *CHAN_IN2(unsigned, relocation_count,
+                                          CH(task_add, task_relocate),
+                                          SELF_IN_CH(task_relocate));
+#endif
 
     // Take victim's place
-    CHAN_OUT2(fingerprint_t, filter[index2_victim], fp_victim,
-             MC_OUT_CH(ch_filter_relocate, task_relocate,
-                       task_add, task_insert_done, task_lookup_search,
-                       task_print_stats),
-             SELF_OUT_CH(task_relocate));
+    bucket_set(&bucket, i, fp_victim);
+    CHAN_OUT1(bucket_t, filter[index2_victim], bucket, SHARED_CH(ch_filter));
+
+#ifdef VERBOSE
+    // journal[0] is the slot task_add filled
+    unsigned journal_len = relocation_count + 2;
+    CHAN_OUT1(unsigned, journal[relocation_count + 1], slot,
+              CH(task_relocate, task_insert_done));
+    CHAN_OUT1(unsigned, journal_len, journal_len, CH(task_relocate, task_insert_done));
+#endif
 
     if (!fp_next_victim) { // slot was free
-        bool success = true;
-        CHAN_OUT1(bool, success, success, CH(task_relocate, task_insert_done));
-        TRANSITION_TO_MT(task_insert_done);
+        relocate_finish(0, 0, stash_entry, relocation_count + 1);
     } else { // slot was occupied, rellocate the next victim
 
-        unsigned relocation_count = *CHAN_IN2(unsigned, relocation_count,
-                                              CH(task_add, task_relocate),
-                                              SELF_IN_CH(task_relocate));
-
         LOG("relocate: relocs %u\r\n", relocation_count);
 
         if (relocation_count >= MAX_RELOCATIONS) { // insert failed
             LOG("relocate: max relocs reached: %u\r\n", relocation_count);
-            PRINTF("insert: lost fp %04x\r\n", fp_next_victim);
-            bool success = false;
-            CHAN_OUT1(bool, success, success, CH(task_relocate, task_insert_done));
-            TRANSITION_TO_MT(task_insert_done);
+            relocate_finish(fp_next_victim, index2_victim, stash_entry,
+                            relocation_count + 1);
         }
 
         relocation_count++;
         CHAN_OUT1(unsigned, relocation_count, relocation_count,
                  SELF_OUT_CH(task_relocate));
+#if STASH_SIZE > 0
+        CHAN_OUT1(unsigned, stash_entry, stash_entry, SELF_OUT_CH(task_relocate));
+#endif
 
         CHAN_OUT1(index_t, index_victim, index2_victim, SELF_OUT_CH(task_relocate));
         CHAN_OUT1(fingerprint_t, fp_victim, fp_next_victim, SELF_OUT_CH(task_relocate));
@@ -890,38 +3124,79 @@ void task_relocate()
         TRANSITION_TO_MT(task_relocate);
     }
 }
+#endif // RELOCATE_BFS
 
 void task_insert_done()
 {
     task_prologue();
     LOG("TASK_INSERT_DONE_cuckoo\r\n"); 
 
-//#if VERBOSE > 0
     unsigned i;
 
+#ifdef VERBOSE
+    // Log only the slots this insert wrote
+#if BATCH_SIZE > 1
+    unsigned journal_len = *CHAN_IN1(unsigned, journal_len,
+                                     CH(task_insert_batch, task_insert_done));
+#else
+    unsigned journal_len = *CHAN_IN2(unsigned, journal_len,
+                                     CH(task_add, task_insert_done),
+                                     CH(task_relocate, task_insert_done));
+#endif
+    for (i = 0; i < journal_len; ++i) {
+#if BATCH_SIZE > 1
+        unsigned index = *CHAN_IN1(unsigned, journal[i],
+                                   CH(task_insert_batch, task_insert_done));
+        bucket_t bucket = *CHAN_IN1(bucket_t, filter[index], SHARED_CH(ch_filter));
+        unsigned j;
+
+        for (j = 0; j < BUCKET_SIZE; ++j)
+            LOG("insert done: [%u] = %04x\r\n", SLOT(index, j), bucket_get(&bucket, j));
+#else
+        unsigned slot = *CHAN_IN2(unsigned, journal[i],
+                                  CH(task_add, task_insert_done),
+                                  CH(task_relocate, task_insert_done));
+        bucket_t bucket = *CHAN_IN1(bucket_t, filter[slot / BUCKET_SIZE],
+                                    SHARED_CH(ch_filter));
+
+        LOG("insert done: [%u] = %04x\r\n", slot,
+            bucket_get(&bucket, slot % BUCKET_SIZE));
+#endif
+    }
+#endif
+
+#ifdef DUMP_FILTER
+    unsigned j;
+
     LOG("insert done: filter:\r\n");
     for (i = 0; i < NUM_BUCKETS; ++i) {
-        fingerprint_t fp = *CHAN_IN3(fingerprint_t, filter[i],
-                 MC_IN_CH(ch_filter, task_init, task_insert_done),
-                 MC_IN_CH(ch_filter_add, task_add, task_insert_done),
-                 MC_IN_CH(ch_filter_relocate, task_relocate, task_insert_done));
+        bucket_t bucket = *CHAN_IN1(bucket_t, filter[i], SHARED_CH(ch_filter));
 
-        LOG("%04x ", fp);
-        if (i > 0 && (i + 1) % 8 == 0)
-            LOG("\r\n");
+        for (j = 0; j < BUCKET_SIZE; ++j) {
+            LOG("%04x ", bucket_get(&bucket, j));
+            if ((SLOT(i, j) + 1) % 8 == 0)
+                LOG("\r\n");
+        }
     }
     LOG("\r\n");
-//#endif
+#endif
 
     unsigned insert_count = *CHAN_IN2(unsigned, insert_count,
                                       CH(task_init, task_insert_done),
                                       SELF_IN_CH(task_insert_done));
+#if BATCH_SIZE > 1
+    insert_count += *CHAN_IN1(unsigned, batch_count,
+                              CH(task_insert_batch, task_insert_done));
+    unsigned success = *CHAN_IN1(unsigned, hit_count,
+                                 CH(task_insert_batch, task_insert_done));
+#else
     insert_count++;
-    CHAN_OUT1(unsigned, insert_count, insert_count, SELF_OUT_CH(task_insert_done));
 
     bool success = *CHAN_IN2(bool, success,
                              CH(task_add, task_insert_done),
                              CH(task_relocate, task_insert_done));
+#endif
+    CHAN_OUT1(unsigned, insert_count, insert_count, SELF_OUT_CH(task_insert_done));
 
     unsigned inserted_count = *CHAN_IN2(unsigned, inserted_count,
                                         CH(task_init, task_insert_done),
@@ -931,25 +3206,126 @@ void task_insert_done()
 
     LOG("insert done: insert %u inserted %u\r\n", insert_count, inserted_count);
 
-#ifdef CONT_POWER
+#ifdef BENCHMARK
+    unsigned relocations = *CHAN_IN2(unsigned, relocations,
+                                     CH(task_add, task_insert_done),
+                                     CH(task_relocate, task_insert_done));
+    uint32_t reloc_sum = *CHAN_IN2(uint32_t, reloc_sum,
+                                   CH(task_bench, task_insert_done),
+                                   SELF_IN_CH(task_insert_done));
+    unsigned reloc_max = *CHAN_IN2(unsigned, reloc_max,
+                                   CH(task_bench, task_insert_done),
+                                   SELF_IN_CH(task_insert_done));
+    reloc_sum += relocations;
+    if (relocations > reloc_max)
+        reloc_max = relocations;
+    CHAN_OUT1(uint32_t, reloc_sum, reloc_sum, SELF_OUT_CH(task_insert_done));
+    CHAN_OUT1(unsigned, reloc_max, reloc_max, SELF_OUT_CH(task_insert_done));
+
+    bench_clock();
+
+    unsigned insert_target = *CHAN_IN1(unsigned, insert_target,
+                                       CH(task_bench, task_insert_done));
+#else
+    unsigned insert_target = NUM_INSERTS;
+#endif
+
+#if defined(CONT_POWER) && !defined(BENCHMARK)
     volatile uint32_t delay = 0x8ffff;
     while (delay--);
 #endif
 
-    if (insert_count < NUM_INSERTS) {
+#if BATCH_SIZE > 1
+    // Keys of the batch that did not fit its update log go first
+    unsigned batch_first = *CHAN_IN1(unsigned, carry_first,
+                                     CH(task_insert_batch, task_insert_done));
+    if (batch_first) {
+        CHAN_OUT1(unsigned, batch_first, batch_first,
+                  CH(task_insert_done, task_insert_batch));
+        TRANSITION_TO_MT(task_insert_batch);
+    }
+#endif
+
+    if (insert_count < insert_target) {
+#if BATCH_SIZE > 1
+        unsigned batch_count = insert_target - insert_count;
+        if (batch_count > BATCH_SIZE)
+            batch_count = BATCH_SIZE;
+        CHAN_OUT1(unsigned, batch_count, batch_count,
+                  CH(task_insert_done, task_generate_key));
+        task_t *next_task = TASK_REF(task_insert_batch);
+#else
         task_t *next_task = TASK_REF(task_insert);
+#endif
         CHAN_OUT1(task_t *, next_task, next_task, CH(task_insert_done, task_generate_key));
-        TRANSITION_TO_MT(task_generate_key);
     } else {
+#ifdef BENCHMARK
+        CHAN_OUT1(unsigned, insert_count, insert_count, CH(task_insert_done, task_bench));
+        CHAN_OUT1(unsigned, inserted_count, inserted_count, CH(task_insert_done, task_bench));
+        CHAN_OUT1(uint32_t, reloc_sum, reloc_sum, CH(task_insert_done, task_bench));
+        CHAN_OUT1(unsigned, reloc_max, reloc_max, CH(task_insert_done, task_bench));
+        TRANSITION_TO_MT(task_bench);
+#endif
         CHAN_OUT1(unsigned, inserted_count, inserted_count,
                   CH(task_insert_done, task_print_stats));
 
+#if BATCH_SIZE > 1
+        unsigned batch_count = NUM_LOOKUPS < BATCH_SIZE ? NUM_LOOKUPS : BATCH_SIZE;
+        CHAN_OUT1(unsigned, batch_count, batch_count,
+                  CH(task_insert_done, task_generate_key));
+        task_t *next_task = TASK_REF(task_lookup_batch);
+#else
         task_t *next_task = TASK_REF(task_lookup);
+#endif
         CHAN_OUT1(value_t, key, init_key, CH(task_insert_done, task_generate_key));
         CHAN_OUT1(task_t *, next_task, next_task, CH(task_insert_done, task_generate_key));
-        TRANSITION_TO_MT(task_generate_key);
     }
+
+#if STASH_SIZE > 0
+    // Spend one eviction chain on a stashed fingerprint before the next key
+    unsigned stash_count = *CHAN_IN2(unsigned, stash_count,
+                                     MC_IN_CH(ch_stash_init, task_init, task_insert_done),
+                                     MC_IN_CH(ch_stash, task_relocate, task_insert_done));
+    if (stash_count)
+        TRANSITION_TO_MT(task_stash_rehome);
+#endif
+    TRANSITION_TO_MT(task_generate_key);
+}
+
+#if STASH_SIZE > 0
+void task_stash_rehome()
+{
+    task_prologue();
+    LOG("TASK_STASH_REHOME_cuckoo\r\n");
+
+    unsigned stash_entry;
+    fingerprint_t fp;
+
+    for (stash_entry = 0; stash_entry < STASH_SIZE; ++stash_entry) {
+        fp = *CHAN_IN2(fingerprint_t, stash_fp[stash_entry],
+                       MC_IN_CH(ch_stash_init, task_init, task_stash_rehome),
+                       MC_IN_CH(ch_stash, task_relocate, task_stash_rehome));
+        if (fp)
+            break;
+    }
+    if (stash_entry == STASH_SIZE)
+        TRANSITION_TO_MT(task_generate_key);
+
+    index_t index = *CHAN_IN1(index_t, stash_index[stash_entry],
+                              MC_IN_CH(ch_stash, task_relocate, task_stash_rehome));
+
+    LOG("stash rehome: [%u] fp %04x idx %u\r\n", stash_entry, fp, index);
+
+    // Relocate it as if just evicted from the bucket it was stashed from
+    unsigned relocation_count = 0;
+    CHAN_OUT1(fingerprint_t, fp_victim, fp, CH(task_stash_rehome, task_relocate));
+    CHAN_OUT1(index_t, index_victim, index, CH(task_stash_rehome, task_relocate));
+    CHAN_OUT1(unsigned, relocation_count, relocation_count,
+              CH(task_stash_rehome, task_relocate));
+    CHAN_OUT1(unsigned, stash_entry, stash_entry, CH(task_stash_rehome, task_relocate));
+    TRANSITION_TO_MT(task_relocate);
 }
+#endif
 
 void task_lookup()
 {
@@ -960,11 +3336,11 @@ void task_lookup()
                             MC_IN_CH(ch_key, task_generate_key,task_lookup));
     LOG("lookup: key %04x\r\n", key);
 
-    CHAN_OUT2(value_t, key, key, CALL_CH(ch_calc_indexes),
-                                 CH(task_lookup, task_lookup_done));
+    CHAN_OUT1(value_t, FRAME(key), key, CALL_CH(ch_calc_indexes));
+    CHAN_OUT1(value_t, key, key, CH(task_lookup, task_lookup_done));
     
     task_t *next_task = TASK_REF(task_lookup_search);
-    CHAN_OUT1(task_t *, next_task, next_task, CALL_CH(ch_calc_indexes));
+    CHAN_OUT1(task_t *, FRAME(next_task), next_task, CALL_CH(ch_calc_indexes));
     TRANSITION_TO_MT(task_calc_indexes);
 }
 
@@ -975,26 +3351,32 @@ void task_lookup_search()
 
     fingerprint_t fp1, fp2;
     bool member = false;
+    unsigned i;
+    bucket_t bucket;
 
-    index_t index1 = *CHAN_IN1(index_t, index1, RET_CH(ch_calc_indexes));
-    index_t index2 = *CHAN_IN1(index_t, index2, RET_CH(ch_calc_indexes));
-    fingerprint_t fp = *CHAN_IN1(fingerprint_t, fingerprint, RET_CH(ch_calc_indexes));
+    index_t index1 = *CHAN_IN1(index_t, FRAME(index1), RET_CH(ch_calc_indexes));
+    index_t index2 = *CHAN_IN1(index_t, FRAME(index2), RET_CH(ch_calc_indexes));
+    fingerprint_t fp = *CHAN_IN1(fingerprint_t, FRAME(fingerprint), RET_CH(ch_calc_indexes));
 
     LOG("lookup search: fp %04x idx1 %u idx2 %u\r\n", fp, index1, index2);
 
-    fp1 = *CHAN_IN3(fingerprint_t, filter[index1],
-                    MC_IN_CH(ch_filter, task_init, task_lookup_search),
-                    MC_IN_CH(ch_filter_add, task_add, task_lookup_search),
-                    MC_IN_CH(ch_filter_relocate, task_relocate, task_lookup_search));
-    LOG("lookup search: fp1 %04x\r\n", fp1);
+    bucket = *CHAN_IN1(bucket_t, filter[index1], SHARED_CH(ch_filter));
 
-    if (fp1 == fp) {
-        member = true;
-    } else {
-        fp2 = *CHAN_IN3(fingerprint_t, filter[index2],
-                MC_IN_CH(ch_filter, task_init, task_lookup_search),
-                MC_IN_CH(ch_filter_add, task_add, task_lookup_search),
-                MC_IN_CH(ch_filter_relocate, task_relocate, task_lookup_search));
+    for (i = 0; i < BUCKET_SIZE && !member; ++i) {
+        fp1 = bucket_get(&bucket, i);
+        LOG("lookup search: fp1 %04x\r\n", fp1);
+
+        if (fp1 == fp) {
+            member = true;
+        }
+    }
+
+    if (!member) {
+        bucket = *CHAN_IN1(bucket_t, filter[index2], SHARED_CH(ch_filter));
+    }
+
+    for (i = 0; i < BUCKET_SIZE && !member; ++i) {
+        fp2 = bucket_get(&bucket, i);
         LOG("lookup search: fp2 %04x\r\n", fp2);
 
         if (fp2 == fp) {
@@ -1002,12 +3384,32 @@ void task_lookup_search()
         }
     }
 
+#if STASH_SIZE > 0
+    for (i = 0; i < STASH_SIZE && !member; ++i) {
+        fingerprint_t fp_stash = *CHAN_IN2(fingerprint_t, stash_fp[i],
+                MC_IN_CH(ch_stash_init, task_init, task_lookup_search),
+                MC_IN_CH(ch_stash, task_relocate, task_lookup_search));
+        if (fp_stash != fp)
+            continue;
+
+        index_t index_stash = *CHAN_IN1(index_t, stash_index[i],
+                MC_IN_CH(ch_stash, task_relocate, task_lookup_search));
+        LOG("lookup search: stash [%u] fp %04x idx %u\r\n", i, fp_stash, index_stash);
+
+        if (index_stash == index1 || index_stash == index2) {
+            member = true;
+        }
+    }
+#endif
+
     LOG("lookup search: fp %04x member %u\r\n", fp, member);
     CHAN_OUT1(bool, member, member, CH(task_lookup_search, task_lookup_done));
 
+#ifndef BENCHMARK // negative lookups miss by design
     if (!member) {
         PRINTF("lookup: key %04x not member\r\n", fp);
     }
+#endif
 
     TRANSITION_TO_MT(task_lookup_done);
 }
@@ -1017,12 +3419,25 @@ void task_lookup_done()
     task_prologue();
     LOG("TASK_LOOKUP_DONE_cuckoo\r\n"); 
 
-    bool member = *CHAN_IN1(bool, member, CH(task_lookup_search, task_lookup_done));
-
+#ifdef BENCHMARK
+    unsigned lookup_count = *CHAN_IN3(unsigned, lookup_count,
+                                      CH(task_init, task_lookup_done),
+                                      CH(task_bench, task_lookup_done),
+                                      SELF_IN_CH(task_lookup_done));
+#else
     unsigned lookup_count = *CHAN_IN2(unsigned, lookup_count,
                                       CH(task_init, task_lookup_done),
                                       SELF_IN_CH(task_lookup_done));
+#endif
 
+#if BATCH_SIZE > 1
+    lookup_count += *CHAN_IN1(unsigned, batch_count,
+                              CH(task_lookup_batch, task_lookup_done));
+    unsigned member = *CHAN_IN1(unsigned, hit_count,
+                                CH(task_lookup_batch, task_lookup_done));
+    CHAN_OUT1(unsigned, lookup_count, lookup_count, SELF_OUT_CH(task_lookup_done));
+#else
+    bool member = *CHAN_IN1(bool, member, CH(task_lookup_search, task_lookup_done));
 
     lookup_count++;
     CHAN_OUT1(unsigned, lookup_count, lookup_count, SELF_OUT_CH(task_lookup_done));
@@ -1031,10 +3446,18 @@ void task_lookup_done()
     value_t key = *CHAN_IN1(value_t, key, CH(task_lookup, task_lookup_done));
     LOG("lookup done [%u]: key %04x member %u\r\n", lookup_count, key, member);
 //#endif
+#endif
 
-    unsigned member_count = *CHAN_IN2(bool, member_count,
+#ifdef BENCHMARK
+    unsigned member_count = *CHAN_IN3(unsigned, member_count,
+                                      CH(task_init, task_lookup_done),
+                                      CH(task_bench, task_lookup_done),
+                                      SELF_IN_CH(task_lookup_done));
+#else
+    unsigned member_count = *CHAN_IN2(unsigned, member_count,
                                       CH(task_init, task_lookup_done),
                                       SELF_IN_CH(task_lookup_done));
+#endif
 
 
     member_count += member;
@@ -1042,28 +3465,152 @@ void task_lookup_done()
 
     LOG("lookup done: lookups %u members %u\r\n", lookup_count, member_count);
 
-#ifdef CONT_POWER
+#ifdef BENCHMARK
+    bench_clock();
+
+    unsigned lookup_target = *CHAN_IN1(unsigned, lookup_target,
+                                       CH(task_bench, task_lookup_done));
+#else
+    unsigned lookup_target = NUM_LOOKUPS;
+#endif
+
+#if defined(CONT_POWER) && !defined(BENCHMARK)
     volatile uint32_t delay = 0x8ffff;
     while (delay--);
 #endif
 
-    if (lookup_count < NUM_LOOKUPS) {
+    if (lookup_count < lookup_target) {
+#if BATCH_SIZE > 1
+        unsigned batch_count = lookup_target - lookup_count;
+        if (batch_count > BATCH_SIZE)
+            batch_count = BATCH_SIZE;
+        CHAN_OUT1(unsigned, batch_count, batch_count,
+                  CH(task_lookup_done, task_generate_key));
+        task_t *next_task = TASK_REF(task_lookup_batch);
+#else
         task_t *next_task = TASK_REF(task_lookup);
+#endif
         CHAN_OUT1(task_t *, next_task, next_task, CH(task_lookup_done, task_generate_key));
         TRANSITION_TO_MT(task_generate_key);
     } else {
+#ifdef BENCHMARK
+        CHAN_OUT1(unsigned, member_count, member_count, CH(task_lookup_done, task_bench));
+        TRANSITION_TO_MT(task_bench);
+#endif
         CHAN_OUT1(unsigned, member_count, member_count,
                   CH(task_lookup_done, task_print_stats));
         TRANSITION_TO_MT(task_print_stats);
     }
 }
 
+#if BATCH_SIZE > 1
+void task_insert_batch()
+{
+    task_prologue();
+    LOG("TASK_INSERT_BATCH_cuckoo\r\n");
+
+    unsigned i;
+    unsigned inserted_count = 0;
+    fingerprint_t fp[BATCH_SIZE];
+    index_t index1[BATCH_SIZE], index2[BATCH_SIZE];
+
+    unsigned batch_count = *CHAN_IN1(unsigned, batch_count,
+                                     MC_IN_CH(ch_keys, task_generate_key, task_insert_batch));
+    unsigned batch_first = *CHAN_IN2(unsigned, batch_first,
+                                     MC_IN_CH(ch_keys, task_generate_key, task_insert_batch),
+                                     CH(task_insert_done, task_insert_batch));
+
+    // Hash the whole batch in one pass
+    for (i = batch_first; i < batch_count; ++i) {
+        value_t key = *CHAN_IN1(value_t, key[i],
+                                MC_IN_CH(ch_keys, task_generate_key, task_insert_batch));
+        calc_indexes(key, &fp[i], &index1[i], &index2[i]);
+
+        LOG("insert batch: key %04x fp %04x idx1 %u idx2 %u\r\n",
+            key, fp[i], index1[i], index2[i]);
+    }
+
+    // Stop short of a key that might not fit the update log, rather than
+    // fail it while its buckets still have room: it starts the next batch
+    num_batch_updates = 0;
+    for (i = batch_first; i < batch_count; ++i) {
+        if (i > batch_first && num_batch_updates + JOURNAL_SIZE > BATCH_MAX_UPDATES)
+            break;
+        inserted_count += batch_add(fp[i], index1[i], index2[i]);
+    }
+    unsigned batch_end = i;
+
+    // Commit: every touched bucket is written once for the whole batch
+    LOG("insert batch: %u inserted, %u buckets updated\r\n",
+        inserted_count, num_batch_updates);
+    for (i = 0; i < num_batch_updates; ++i) {
+        CHAN_OUT1(bucket_t, filter[batch_updates[i].index], batch_updates[i].bucket,
+                  SHARED_CH(ch_filter));
+#ifdef VERBOSE
+        unsigned index = batch_updates[i].index;
+        CHAN_OUT1(unsigned, journal[i], index, CH(task_insert_batch, task_insert_done));
+#endif
+    }
+#ifdef VERBOSE
+    CHAN_OUT1(unsigned, journal_len, num_batch_updates,
+              CH(task_insert_batch, task_insert_done));
+#endif
+
+    unsigned key_count = batch_end - batch_first;
+    unsigned carry_first = batch_end < batch_count ? batch_end : 0;
+    CHAN_OUT1(unsigned, batch_count, key_count, CH(task_insert_batch, task_insert_done));
+    CHAN_OUT1(unsigned, hit_count, inserted_count, CH(task_insert_batch, task_insert_done));
+    CHAN_OUT1(unsigned, carry_first, carry_first, CH(task_insert_batch, task_insert_done));
+    TRANSITION_TO_MT(task_insert_done);
+}
+
+void task_lookup_batch()
+{
+    task_prologue();
+    LOG("TASK_LOOKUP_BATCH_cuckoo\r\n");
+
+    unsigned i, j;
+    unsigned member_count = 0;
+    bucket_t bucket;
+
+    unsigned batch_count = *CHAN_IN1(unsigned, batch_count,
+                                     MC_IN_CH(ch_keys, task_generate_key, task_lookup_batch));
+
+    for (i = 0; i < batch_count; ++i) {
+        value_t key = *CHAN_IN1(value_t, key[i],
+                                MC_IN_CH(ch_keys, task_generate_key, task_lookup_batch));
+        fingerprint_t fp;
+        index_t index1, index2;
+        bool member = false;
+
+        calc_indexes(key, &fp, &index1, &index2);
+
+        for (j = 0; j < 2 * BUCKET_SIZE && !member; ++j) {
+            if (j % BUCKET_SIZE == 0) {
+                bucket = *CHAN_IN1(bucket_t, filter[j ? index2 : index1], SHARED_CH(ch_filter));
+            }
+            member = (bucket_get(&bucket, j % BUCKET_SIZE) == fp);
+        }
+
+        LOG("lookup batch: key %04x fp %04x member %u\r\n", key, fp, member);
+        if (!member) {
+            PRINTF("lookup: key %04x not member\r\n", key);
+        }
+        member_count += member;
+    }
+
+    CHAN_OUT1(unsigned, batch_count, batch_count, CH(task_lookup_batch, task_lookup_done));
+    CHAN_OUT1(unsigned, hit_count, member_count, CH(task_lookup_batch, task_lookup_done));
+    TRANSITION_TO_MT(task_lookup_done);
+}
+#endif // BATCH_SIZE
+
 void task_print_stats()
 {
     task_prologue();
     LOG("TASK_PRINT_STATS_cuckoo\r\n"); 
 
-    unsigned i;
+    unsigned i, j;
 
     unsigned inserted_count = *CHAN_IN1(unsigned, inserted_count,
                                      CH(task_insert_done, task_print_stats));
@@ -1072,101 +3619,510 @@ void task_print_stats()
 
     PRINTF("stats: inserts %u members %u total %u\r\n",
            inserted_count, member_count, NUM_INSERTS);
+#if STASH_SIZE > 0
+    unsigned stash_count = *CHAN_IN2(unsigned, stash_count,
+                                     MC_IN_CH(ch_stash_init, task_init, task_print_stats),
+                                     MC_IN_CH(ch_stash, task_relocate, task_print_stats));
+    PRINTF("stats: stashed %u of %u\r\n", stash_count, STASH_SIZE);
+#endif
 
     BLOCK_PRINTF_BEGIN();
     BLOCK_PRINTF("filter:\r\n");
     for (i = 0; i < NUM_BUCKETS; ++i) {
-        fingerprint_t fp = *CHAN_IN3(fingerprint_t, filter[i],
-                 MC_IN_CH(ch_filter, task_init, task_print_stats),
-                 MC_IN_CH(ch_filter_add, task_add, task_print_stats),
-                 MC_IN_CH(ch_filter_relocate, task_relocate, task_print_stats));
+        bucket_t bucket = *CHAN_IN1(bucket_t, filter[i], SHARED_CH(ch_filter));
 
-        BLOCK_PRINTF("%04x ", fp);
-        if (i > 0 && (i + 1) % 8 == 0)
-            BLOCK_PRINTF("\r\n");
+        for (j = 0; j < BUCKET_SIZE; ++j) {
+            BLOCK_PRINTF("%04x ", bucket_get(&bucket, j));
+            if ((SLOT(i, j) + 1) % 8 == 0)
+                BLOCK_PRINTF("\r\n");
+        }
     }
     BLOCK_PRINTF_END();
 
     TRANSITION_TO_MT(task_done);
 }
+
+#ifdef PROBE_LOOKUPS
+void task_probe()
+{
+    task_prologue();
+    LOG("TASK_PROBE_cuckoo\r\n");
+
+    value_t key = *CHAN_IN2(value_t, key, CH(task_init, task_probe),
+                                          CH(task_probe_search, task_probe));
+    unsigned probe_count = *CHAN_IN2(unsigned, probe_count,
+                                     CH(task_init, task_probe),
+                                     CH(task_probe_search, task_probe));
+    unsigned hit_count = *CHAN_IN2(unsigned, hit_count,
+                                   CH(task_init, task_probe),
+                                   CH(task_probe_search, task_probe));
+
+    key = next_key(key);
+    LOG("probe: key %04x\r\n", key);
+
+    CHAN_OUT1(value_t, FRAME(key), key, CALL_CH(ch_calc_indexes));
+    task_t *next_task = TASK_REF(task_probe_search);
+    CHAN_OUT1(task_t *, FRAME(next_task), next_task, CALL_CH(ch_calc_indexes));
+
+    CHAN_OUT1(value_t, key, key, CH(task_probe, task_probe_search));
+    CHAN_OUT1(unsigned, probe_count, probe_count, CH(task_probe, task_probe_search));
+    CHAN_OUT1(unsigned, hit_count, hit_count, CH(task_probe, task_probe_search));
+    TRANSITION_TO_MT(task_calc_indexes);
+}
+
+void task_probe_search()
+{
+    task_prologue();
+    LOG("TASK_PROBE_SEARCH_cuckoo\r\n");
+
+    unsigned j;
+    bool member = false;
+    bucket_t bucket;
+
+    index_t index1 = *CHAN_IN1(index_t, FRAME(index1), RET_CH(ch_calc_indexes));
+    index_t index2 = *CHAN_IN1(index_t, FRAME(index2), RET_CH(ch_calc_indexes));
+    fingerprint_t fp = *CHAN_IN1(fingerprint_t, FRAME(fingerprint), RET_CH(ch_calc_indexes));
+
+    for (j = 0; j < 2 * BUCKET_SIZE && !member; ++j) {
+        if (j % BUCKET_SIZE == 0)
+            bucket = *CHAN_IN1(bucket_t, filter[j ? index2 : index1], SHARED_CH(ch_filter));
+        member = (bucket_get(&bucket, j % BUCKET_SIZE) == fp);
+    }
+
+    value_t key = *CHAN_IN1(value_t, key, CH(task_probe, task_probe_search));
+    unsigned probe_count = *CHAN_IN1(unsigned, probe_count,
+                                     CH(task_probe, task_probe_search)) + 1;
+    unsigned hit_count = *CHAN_IN1(unsigned, hit_count,
+                                   CH(task_probe, task_probe_search)) + member;
+    LOG("probe search: key %04x fp %04x member %u\r\n", key, fp, member);
+
+    if (probe_count < PROBE_LOOKUPS) {
+        CHAN_OUT1(value_t, key, key, CH(task_probe_search, task_probe));
+        CHAN_OUT1(unsigned, probe_count, probe_count, CH(task_probe_search, task_probe));
+        CHAN_OUT1(unsigned, hit_count, hit_count, CH(task_probe_search, task_probe));
+        TRANSITION_TO_MT(task_probe);
+    }
+
+    PRINTF("stats: probes %u false positives %u\r\n", probe_count, hit_count);
+    TRANSITION_TO_MT(task_done);
+}
+#endif
+
+#ifdef BENCHMARK
+// The key 'count' steps into the sequence
+static value_t bench_key(unsigned count)
+{
+    value_t key = init_key;
+
+    while (count--)
+        key = next_key(key);
+    return key;
+}
+
+// The generator resumes after the keys inserted so far
+static void bench_start_inserts(unsigned level, unsigned insert_count)
+{
+    unsigned insert_target =
+        (uint32_t)NUM_SLOTS * (BENCH_LOAD_MIN + level * BENCH_LOAD_STEP) / 100;
+    unsigned zero = 0;
+    uint32_t zero_sum = 0;
+    value_t key = bench_key(insert_count);
+    task_t *next_task = TASK_REF(task_insert);
+
+    CHAN_OUT1(unsigned, insert_target, insert_target, CH(task_bench, task_insert_done));
+    CHAN_OUT1(uint32_t, reloc_sum, zero_sum, CH(task_bench, task_insert_done));
+    CHAN_OUT1(unsigned, reloc_max, zero, CH(task_bench, task_insert_done));
+    CHAN_OUT1(value_t, key, key, CH(task_bench, task_generate_key));
+    CHAN_OUT1(task_t *, next_task, next_task, CH(task_bench, task_generate_key));
+}
+
+// Looks up the lookup_target keys that follow 'key' in the sequence
+static void bench_start_lookups(value_t key, unsigned lookup_target)
+{
+    unsigned zero = 0;
+    task_t *next_task = TASK_REF(task_lookup);
+
+    CHAN_OUT1(unsigned, lookup_target, lookup_target, CH(task_bench, task_lookup_done));
+    CHAN_OUT1(unsigned, lookup_count, zero, CH(task_bench, task_lookup_done));
+    CHAN_OUT1(unsigned, member_count, zero, CH(task_bench, task_lookup_done));
+    CHAN_OUT1(value_t, key, key, CH(task_bench, task_generate_key));
+    CHAN_OUT1(task_t *, next_task, next_task, CH(task_bench, task_generate_key));
+}
+
+// Runs the load-factor sweep, as a chain of phases per level: inserts up to
+// the level's load, lookups of every key inserted so far, then lookups of
+// keys not inserted (yet). Each activation ends the running phase and starts
+// the next one.
+void task_bench()
+{
+    task_prologue();
+    LOG("TASK_BENCH_cuckoo\r\n");
+
+    bench_t bench = *CHAN_IN2(bench_t, bench, CH(task_init, task_bench),
+                              SELF_IN_CH(task_bench));
+    uint32_t elapsed = bench_clock() - bench.phase_start;
+
+    switch (bench.phase) {
+    case BENCH_PHASE_START:
+        PRINTF("bench,load_pct,inserts,failed,insert_us,inserts_per_s,"
+               "reloc_mean_x100,reloc_max,lookups,missed,neg_lookups,false_pos,"
+               "fp_per_10k,lookup_us,lookups_per_s\r\n");
+
+        bench_start_inserts(bench.level, 0);
+        bench.phase = BENCH_PHASE_INSERTS;
+        break;
+
+    case BENCH_PHASE_INSERTS: {
+        unsigned insert_count = *CHAN_IN1(unsigned, insert_count,
+                                          CH(task_insert_done, task_bench));
+        unsigned inserted_count = *CHAN_IN1(unsigned, inserted_count,
+                                            CH(task_insert_done, task_bench));
+        unsigned failed_count = insert_count - inserted_count;
+
+        bench.inserts = insert_count - bench.insert_count;
+        bench.failed = failed_count - bench.failed_count;
+        bench.insert_count = insert_count;
+        bench.failed_count = failed_count;
+        bench.insert_us = elapsed;
+        bench.reloc_sum = *CHAN_IN1(uint32_t, reloc_sum, CH(task_insert_done, task_bench));
+        bench.reloc_max = *CHAN_IN1(unsigned, reloc_max, CH(task_insert_done, task_bench));
+
+        bench_start_lookups(init_key, bench.insert_count);
+        bench.phase = BENCH_PHASE_POS_LOOKUPS;
+        break;
+    }
+
+    case BENCH_PHASE_POS_LOOKUPS: {
+        unsigned member_count = *CHAN_IN1(unsigned, member_count,
+                                          CH(task_lookup_done, task_bench));
+
+        bench.missed = bench.insert_count - member_count;
+        bench.pos_lookup_us = elapsed;
+
+        bench_start_lookups(bench_key(bench.insert_count), BENCH_NEG_LOOKUPS);
+        bench.phase = BENCH_PHASE_NEG_LOOKUPS;
+        break;
+    }
+
+    case BENCH_PHASE_NEG_LOOKUPS: {
+        unsigned false_pos = *CHAN_IN1(unsigned, member_count,
+                                       CH(task_lookup_done, task_bench));
+        unsigned load = BENCH_LOAD_MIN + bench.level * BENCH_LOAD_STEP;
+        uint32_t lookup_us = bench.pos_lookup_us + elapsed;
+        unsigned long reloc_mean_x100 = bench.inserts ?
+            (unsigned long)bench.reloc_sum * 100 / bench.inserts : 0;
+        unsigned long fp_per_10k =
+            (unsigned long)false_pos * 10000 / BENCH_NEG_LOOKUPS;
+
+        PRINTF("bench,%u,%u,%u,%lu,%lu,%lu,%u,%u,%u,%u,%u,%lu,%lu,%lu\r\n",
+               load, bench.inserts, bench.failed,
+               (unsigned long)bench.insert_us,
+               bench_rate(bench.inserts, bench.insert_us),
+               reloc_mean_x100, bench.reloc_max,
+               bench.insert_count, bench.missed,
+               BENCH_NEG_LOOKUPS, false_pos, fp_per_10k,
+               (unsigned long)lookup_us,
+               bench_rate(bench.insert_count + BENCH_NEG_LOOKUPS, lookup_us));
+
+        if (++bench.level == BENCH_LEVELS)
+            TRANSITION_TO_MT(task_done);
+
+        bench_start_inserts(bench.level, bench.insert_count);
+        bench.phase = BENCH_PHASE_INSERTS;
+        break;
+    }
+    }
+
+    bench.phase_start = bench_clock();
+    CHAN_OUT1(bench_t, bench, bench, SELF_OUT_CH(task_bench));
+    TRANSITION_TO_MT(task_generate_key);
+}
+#endif
 /*-------------------------------RSA tasks--------------------------------*/
 
 void task_pad()
 {
     int i;
     unsigned block_offset, message_length;
-    digit_t m, e;
+    digit_t m;
+    exponent_t e;
+    uint8_t bytes[KEY_SIZE_BYTES];
+    digit_t padded[NUM_DIGITS];
 
 #ifdef SHOW_COARSE_PROGRESS_ON_LED
     GPIO(PORT_LED_1, OUT) &= ~BIT(PIN_LED_1);
 #endif
 
-    block_offset = *CHAN_IN2(unsigned, block_offset, CH(task_init, task_pad),
+    block_offset = *CHAN_IN2(unsigned, LANE(block_offset), CH(task_init, task_pad),
                                            SELF_IN_CH(task_pad));
 
-    message_length = *CHAN_IN1(unsigned, message_length, CH(task_init, task_pad));
+    message_length = *CHAN_IN1(unsigned, LANE(message_length), CH(task_init, task_pad));
 
     LOG("pad: len=%u offset=%u\r\n", message_length, block_offset);
 
     if (block_offset >= message_length) {
         LOG("pad: message done\r\n");
+#if RSA_THREADS > 1
+        // Only the last lane to finish prints: tasks are atomic, so exactly
+        // one of them sees every flag set
+        bool lane_done = true;
+        CHAN_OUT1(bool, lane_done[RSA_LANE], lane_done,
+                  MC_OUT_CH(ch_lane_done, task_pad, task_pad));
+        for (i = 0; i < RSA_THREADS; ++i) {
+            lane_done = *CHAN_IN2(bool, lane_done[i],
+                                  MC_IN_CH(ch_lane_done, task_init, task_pad),
+                                  MC_IN_CH(ch_lane_done, task_pad, task_pad));
+            if (!lane_done) {
+                THREAD_END();
+                TRANSITION_TO_MT(task_pad);
+            }
+        }
+#endif
         TRANSITION_TO_MT(task_print_cyphertext);
     }
 
+#ifdef BLOCK_CYCLES
+    block_time_t block_start = block_clock();
+    CHAN_OUT1(block_time_t, LANE(block_start), block_start,
+              CH(task_pad, task_mult_block_get_result));
+#endif
+
     LOG("process block: padded block at offset=%u: ", block_offset);
-    for (i = 0; i < NUM_PAD_DIGITS; ++i)
-        LOG("%x ", PAD_DIGITS[i]);
+    for (i = 0; i < NUM_PAD_BYTES; ++i)
+        LOG("%x ", PAD_BYTES[i]);
     LOG("'");
-    for (i = NUM_DIGITS - NUM_PAD_DIGITS - 1; i >= 0; --i)
+    for (i = KEY_SIZE_BYTES - NUM_PAD_BYTES - 1; i >= 0; --i)
         LOG("%x ", PLAINTEXT[block_offset + i]);
     LOG("\r\n");
 
-    for (i = 0; i < NUM_DIGITS - NUM_PAD_DIGITS; ++i) {
+    for (i = 0; i < KEY_SIZE_BYTES - NUM_PAD_BYTES; ++i) {
         m = (block_offset + i < message_length) ? PLAINTEXT[block_offset + i] : 0xFF;
         LOG("For iteration %u m = %u \r\n",i,m); 
-        CHAN_OUT1(digit_t, base[i], m, MC_OUT_CH(ch_base, task_pad, task_mult_block,
-                                                                  task_square_base));
+        bytes[i] = m;
     }
     LOG("next loop: \r\n"); 
-    for (i = NUM_DIGITS - NUM_PAD_DIGITS; i < NUM_DIGITS; ++i) {
-        LOG("For iteration %u m = %u \r\n",i,PAD_DIGITS[i]); 
-        CHAN_OUT1(digit_t, base[i], PAD_DIGITS[i],
-                 MC_OUT_CH(ch_base, task_pad, task_mult_block, task_square_base));
+    for (i = KEY_SIZE_BYTES - NUM_PAD_BYTES; i < KEY_SIZE_BYTES; ++i) {
+        m = PAD_BYTES[i - (KEY_SIZE_BYTES - NUM_PAD_BYTES)];
+        LOG("For iteration %u m = %u \r\n",i,m); 
+        bytes[i] = m;
     }
 
+    for (i = 0; i < NUM_DIGITS; ++i)
+        padded[i] = bytes_to_digit(bytes, i);
+
+#ifdef MONTGOMERY
+    // Into Montgomery form: base * R^2 * R^-1 = base * R mod N
+    digit_t n[NUM_DIGITS], r2[NUM_DIGITS];
+    CHAN_IN_ARRAY1(digit_t, N, 0, n, NUM_DIGITS, MC_IN_CH(ch_modulus, task_init, task_pad));
+    CHAN_IN_ARRAY1(digit_t, R2, 0, r2, NUM_DIGITS, MC_IN_CH(ch_montgomery, task_init, task_pad));
+    digit_t n_prime = *CHAN_IN1(digit_t, n_prime,
+                                MC_IN_CH(ch_montgomery, task_init, task_pad));
+    mont_mult(padded, padded, r2, n, n_prime, NUM_DIGITS);
+#endif
+
+    CHAN_OUT_ARRAY1(digit_t, LANE(base), 0, padded, NUM_DIGITS,
+                    MC_OUT_CH(ch_base, task_pad, task_mult_block, task_square_base));
+
+#ifdef MONTGOMERY
+    digit_t one[NUM_DIGITS];
+    CHAN_IN_ARRAY1(digit_t, R1, 0, one, NUM_DIGITS,
+                   MC_IN_CH(ch_montgomery, task_init, task_pad));
+    CHAN_OUT_ARRAY1(digit_t, LANE(block), 0, one, NUM_DIGITS, CH(task_pad, task_mult_block));
+#else
     digit_t one = 1;
     digit_t zero = 0;
-    CHAN_OUT1(digit_t, block[0], one, CH(task_pad, task_mult_block));
-    for (i = 1; i < NUM_DIGITS; ++i)
-        CHAN_OUT1(digit_t, block[i], zero, CH(task_pad, task_mult_block));
+    CHAN_OUT1(digit_t, LANE(block[0]), one, CH(task_pad, task_mult_block));
+    CHAN_FILL_ARRAY1(digit_t, LANE(block), 1, zero, NUM_DIGITS - 1,
+                     CH(task_pad, task_mult_block));
+#endif
+
+    e = *CHAN_IN1(exponent_t, LANE(E), CH(task_init, task_pad));
+    CHAN_OUT1(exponent_t, LANE(E), e, CH(task_pad, task_exp));
+
+#if EXP_WINDOW > 1
+    exp_state_t exp_state = { 0, 0, -1, false };
+    while (e >> exp_state.bit > 1)
+        exp_state.bit++;
+    CHAN_OUT1(exp_state_t, LANE(exp_state), exp_state, CH(task_pad, task_exp));
+
+    unsigned table_index = 0;
+    CHAN_OUT1(unsigned, LANE(table_index), table_index, CH(task_pad, task_exp_table));
+#endif
+
+    block_offset += RSA_THREADS * (KEY_SIZE_BYTES - NUM_PAD_BYTES);
+    CHAN_OUT1(unsigned, LANE(block_offset), block_offset, SELF_OUT_CH(task_pad));
+
+#ifdef SHOW_COARSE_PROGRESS_ON_LED
+    GPIO(PORT_LED_1, OUT) |= BIT(PIN_LED_1);
+#endif
+#if EXP_WINDOW > 1
+    TRANSITION_TO_MT(task_exp_table);
+#else
+    TRANSITION_TO_MT(task_exp);
+#endif
+}
+
+#if EXP_WINDOW > 1
+// Builds the odd-power table, one mult_mod call per hop: base^2 first, then
+// each entry from the previous one times base^2.
+void task_exp_table()
+{
+    unsigned table_index;
+    task_t *next_task = TASK_REF(task_exp_table_get_result);
+
+    table_index = *CHAN_IN2(unsigned, LANE(table_index), CH(task_pad, task_exp_table),
+                            CH(task_exp_table_get_result, task_exp_table));
+    CHAN_OUT1(unsigned, LANE(table_index), table_index,
+              CH(task_exp_table, task_exp_table_get_result));
+
+    LOG("exp table: %u\r\n", table_index);
+
+    if (table_index == 0) {
+        CALL_OPERAND1(ch_square_mod, A, LANE(base), 0,
+                      MC_IN_CH(ch_base, task_pad, task_exp_table));
+        CHAN_OUT1(task_t *, LANE(next_task), next_task, CALL_CH(ch_square_mod));
+        TRANSITION_TO_MT(task_square_mod);
+    }
+
+    CALL_OPERAND1(ch_mult_mod, A, LANE(table), (table_index - 1) * NUM_DIGITS,
+                  MC_IN_CH(ch_exp_table, task_exp_table_get_result, task_exp_table));
+    CALL_OPERAND1(ch_mult_mod, B, LANE(base_sq), 0,
+                  MC_IN_CH(ch_exp_table, task_exp_table_get_result, task_exp_table));
+    CHAN_OUT1(task_t *, LANE(next_task), next_task, CALL_CH(ch_mult_mod));
+    TRANSITION_TO_MT(task_mult_mod);
+}
+
+void task_exp_table_get_result()
+{
+    unsigned table_index;
+    digit_t m[NUM_DIGITS];
+
+    table_index = *CHAN_IN1(unsigned, LANE(table_index),
+                            CH(task_exp_table, task_exp_table_get_result));
+
+    RESULT_IN(m);
+
+    if (table_index == 0) { // got base^2, and base^1 is the first entry
+        CHAN_OUT_ARRAY1(digit_t, LANE(base_sq), 0, m, NUM_DIGITS, MC_OUT_CH(ch_exp_table,
+                        task_exp_table_get_result, task_exp_table, task_exp_mult));
+        CHAN_IN_ARRAY1(digit_t, LANE(base), 0, m, NUM_DIGITS,
+                       MC_IN_CH(ch_base, task_pad, task_exp_table_get_result));
+    }
+    CHAN_OUT_ARRAY1(digit_t, LANE(table), table_index * NUM_DIGITS, m, NUM_DIGITS,
+                    MC_OUT_CH(ch_exp_table, task_exp_table_get_result,
+                              task_exp_table, task_exp_mult));
+
+    table_index++;
+    if (table_index < EXP_TABLE_SIZE) {
+        CHAN_OUT1(unsigned, LANE(table_index), table_index,
+                  CH(task_exp_table_get_result, task_exp_table));
+        TRANSITION_TO_MT(task_exp_table);
+    }
+    TRANSITION_TO_MT(task_exp);
+}
+
+// Left-to-right sliding window: decides the next square or table multiply
+// of the block, scanning the next window of the exponent when both are done
+void task_exp()
+{
+    exponent_t e;
+    exp_state_t st;
+    unsigned width, window;
+
+    e = *CHAN_IN1(exponent_t, LANE(E), CH(task_pad, task_exp));
+    st = *CHAN_IN2(exp_state_t, LANE(exp_state), CH(task_pad, task_exp), SELF_IN_CH(task_exp));
+
+    LOG("exp: e=%lx bit=%d squares=%u window=%d\r\n",
+        (unsigned long)e, st.bit, st.squares, st.window);
+
+    while (!st.squares && st.window < 0 && st.bit >= 0) {
+        if (!((e >> st.bit) & 0x1)) {
+            st.squares = 1;
+            st.bit--;
+        } else {
+            width = st.bit + 1 < EXP_WINDOW ? st.bit + 1 : EXP_WINDOW;
+            while (!((e >> (st.bit - width + 1)) & 0x1)) // end on a set bit
+                width--;
+            window = (e >> (st.bit - width + 1)) & ((1 << width) - 1);
+            st.squares = width;
+            st.window = window >> 1; // base^window is entry (window - 1) / 2
+            st.bit -= width;
+        }
+
+        if (!st.started) // squaring 1
+            st.squares = 0;
+    }
+
+    if (st.squares) {
+        st.squares--;
+        CHAN_OUT1(exp_state_t, LANE(exp_state), st, SELF_OUT_CH(task_exp));
+        TRANSITION_TO_MT(task_exp_square);
+    }
+
+    if (st.window >= 0) {
+        unsigned table_index = st.window;
+        CHAN_OUT1(unsigned, LANE(table_index), table_index, CH(task_exp, task_exp_mult));
+        st.window = -1;
+        st.started = true;
+        CHAN_OUT1(exp_state_t, LANE(exp_state), st, SELF_OUT_CH(task_exp));
+        TRANSITION_TO_MT(task_exp_mult);
+    }
+
+    // Exponent done: the block is in the return channel of the last call
+    exponent_t zero = 0;
+    CHAN_OUT1(exponent_t, LANE(E), zero, CH(task_exp, task_mult_block_get_result));
+    TRANSITION_TO_MT(task_mult_block_get_result);
+}
+
+void task_exp_square()
+{
+    CALL_OPERAND2(ch_square_mod, A, LANE(block), 0, CH(task_pad, task_mult_block),
+                  MC_IN_CH(ch_exp_block, task_exp_get_result, task_exp_square));
+    task_t *next_task = TASK_REF(task_exp_get_result);
+    CHAN_OUT1(task_t *, LANE(next_task), next_task, CALL_CH(ch_square_mod));
+    TRANSITION_TO_MT(task_square_mod);
+}
+
+void task_exp_mult()
+{
+    unsigned table_index;
 
-    e = *CHAN_IN1(digit_t, E, CH(task_init, task_pad));
-    CHAN_OUT1(digit_t, E, e, CH(task_pad, task_exp));
+    table_index = *CHAN_IN1(unsigned, LANE(table_index), CH(task_exp, task_exp_mult));
 
-    block_offset += NUM_DIGITS - NUM_PAD_DIGITS;
-    CHAN_OUT1(unsigned, block_offset, block_offset, SELF_OUT_CH(task_pad));
+    CALL_OPERAND2(ch_mult_mod, A, LANE(block), 0, CH(task_pad, task_mult_block),
+                  MC_IN_CH(ch_exp_block, task_exp_get_result, task_exp_mult));
+    CALL_OPERAND1(ch_mult_mod, B, LANE(table), table_index * NUM_DIGITS,
+                  MC_IN_CH(ch_exp_table, task_exp_table_get_result, task_exp_mult));
+    task_t *next_task = TASK_REF(task_exp_get_result);
+    CHAN_OUT1(task_t *, LANE(next_task), next_task, CALL_CH(ch_mult_mod));
+    TRANSITION_TO_MT(task_mult_mod);
+}
 
-#ifdef SHOW_COARSE_PROGRESS_ON_LED
-    GPIO(PORT_LED_1, OUT) |= BIT(PIN_LED_1);
-#endif
+void task_exp_get_result()
+{
+    digit_t m[NUM_DIGITS];
+
+    RESULT_IN(m);
+    CHAN_OUT_ARRAY1(digit_t, LANE(block), 0, m, NUM_DIGITS, MC_OUT_CH(ch_exp_block,
+                    task_exp_get_result, task_exp_square, task_exp_mult));
     TRANSITION_TO_MT(task_exp);
 }
-
+#else
 void task_exp()
 {
-    digit_t e;
+    exponent_t e;
     bool multiply;
 
-    e = *CHAN_IN2(digit_t, E, CH(task_pad, task_exp), SELF_IN_CH(task_exp));
-    LOG("exp: e=%x\r\n", e);
+    e = *CHAN_IN2(exponent_t, LANE(E), CH(task_pad, task_exp), SELF_IN_CH(task_exp));
+    LOG("exp: e=%lx\r\n", (unsigned long)e);
 
     // ASSERT: e > 0
 
     multiply = e & 0x1;
 
     e >>= 1;
-    CHAN_OUT1(digit_t, E, e, SELF_OUT_CH(task_exp));
-    CHAN_OUT1(digit_t, E, e, CH(task_exp, task_mult_block_get_result));
+    CHAN_OUT1(exponent_t, LANE(E), e, SELF_OUT_CH(task_exp));
+    CHAN_OUT1(exponent_t, LANE(E), e, CH(task_exp, task_mult_block_get_result));
 
     if (multiply) {
         TRANSITION_TO_MT(task_mult_block);
@@ -1174,163 +4130,247 @@ void task_exp()
         TRANSITION_TO_MT(task_square_base);
     }
 }
+#endif
 
 // TODO: is this task strictly necessary? it only makes a call. Can this call
 // be rolled into task_exp?
 void task_mult_block()
 {
-    int i;
-    digit_t b, m;
-
     LOG("mult block\r\n");
-    //LOG("WRITING FROM %x and %x with offset %x \r\n",
-    //  MC_IN_CH(ch_base,task_pad,task_mult_block) + 1, 
-    //  MC_IN_CH(ch_square_base, task_square_base_get_result, task_mult_block),
-    //  offsetof(struct msg_base,base));
-    // TODO: pass args to mult: message * base
-    for (i = 0; i < NUM_DIGITS; ++i) {
-        b = *CHAN_IN2(digit_t, base[i], MC_IN_CH(ch_base, task_pad, task_mult_block),
-                        MC_IN_CH(ch_square_base, task_square_base_get_result, task_mult_block));
-        m = *CHAN_IN2(digit_t, block[i], CH(task_pad, task_mult_block),
-                                CH(task_mult_block_get_result, task_mult_block));
-        
-        CHAN_OUT1(digit_t, A[i], b, CALL_CH(ch_mult_mod));
-
-        CHAN_OUT1(digit_t, B[i], m, CALL_CH(ch_mult_mod));
+    CALL_OPERAND2(ch_mult_mod, A, LANE(base), 0,
+                  MC_IN_CH(ch_base, task_pad, task_mult_block),
+                  MC_IN_CH(ch_square_base, task_square_base_get_result, task_mult_block));
+    CALL_OPERAND2(ch_mult_mod, B, LANE(block), 0, CH(task_pad, task_mult_block),
+                  CH(task_mult_block_get_result, task_mult_block));
 
-        LOG("mult block: a[%u]=%x b[%u]=%x\r\n", i, b, i, m);
-    }
+#ifdef VERBOSE
+    int i;
+    digit_t bd[NUM_DIGITS], md[NUM_DIGITS];
+    OPERAND_IN(ch_mult_mod, A, 0, bd, NUM_DIGITS);
+    OPERAND_IN(ch_mult_mod, B, 0, md, NUM_DIGITS);
+    for (i = 0; i < NUM_DIGITS; ++i)
+        LOG("mult block: a[%u]=%x b[%u]=%x\r\n", i, bd[i], i, md[i]);
+#endif
     task_t *next_task =TASK_REF(task_mult_block_get_result); 
-    CHAN_OUT1(task_t*, next_task, next_task, CALL_CH(ch_mult_mod));
+    CHAN_OUT1(task_t*, LANE(next_task), next_task, CALL_CH(ch_mult_mod));
     TRANSITION_TO_MT(task_mult_mod);
 }
 
 void task_mult_block_get_result()
 {
     int i;
-    digit_t m, e;
+    digit_t m[NUM_DIGITS];
+    exponent_t e;
     unsigned cyphertext_len;
     //LOG("TASK_MULT_BLOCK_rsa\r\n"); 
 
+    RESULT_IN(m);
+    CHAN_OUT_ARRAY1(digit_t, LANE(block), 0, m, NUM_DIGITS,
+                    CH(task_mult_block_get_result, task_mult_block));
+
     LOG("mult block get result: block: ");
-    for (i = NUM_DIGITS - 1; i >= 0; --i) { // reverse for printing
-        m = *CHAN_IN1(digit_t, product[i], RET_CH(ch_mult_mod));
-        LOG("%x ", m);
-        CHAN_OUT1(digit_t, block[i], m, CH(task_mult_block_get_result, task_mult_block));
-    }
+    for (i = NUM_DIGITS - 1; i >= 0; --i) // reverse for printing
+        LOG("%x ", m[i]);
     LOG("\r\n");
 
-    e = *CHAN_IN1(digit_t, E, CH(task_exp, task_mult_block_get_result));
+    e = *CHAN_IN1(exponent_t, LANE(E), CH(task_exp, task_mult_block_get_result));
 
     // On last iteration we don't need to square base
     if (e > 0) {
 
         // TODO: current implementation restricts us to send only to the next instantiation
         // of self, so for now, as a workaround, we proxy the value in every instantiation
-        cyphertext_len = *CHAN_IN2(unsigned, cyphertext_len,
+        cyphertext_len = *CHAN_IN2(unsigned, LANE(cyphertext_len),
                                    CH(task_init, task_mult_block_get_result),
                                    SELF_IN_CH(task_mult_block_get_result));
-        CHAN_OUT1(unsigned, cyphertext_len, cyphertext_len, 
+        CHAN_OUT1(unsigned, LANE(cyphertext_len), cyphertext_len, 
                                    SELF_OUT_CH(task_mult_block_get_result));
+#ifdef BLOCK_CYCLES
+        block_time_t block_time = *CHAN_IN2(block_time_t, LANE(block_time),
+                                            CH(task_init, task_mult_block_get_result),
+                                            SELF_IN_CH(task_mult_block_get_result));
+        CHAN_OUT1(block_time_t, LANE(block_time), block_time,
+                  SELF_OUT_CH(task_mult_block_get_result));
+#endif
 
         TRANSITION_TO_MT(task_square_base);
 
     } else { // block is finished, save it
 
-        cyphertext_len = *CHAN_IN2(unsigned, cyphertext_len,
+        cyphertext_len = *CHAN_IN2(unsigned, LANE(cyphertext_len),
                                    CH(task_init, task_mult_block_get_result),
                                    SELF_IN_CH(task_mult_block_get_result));
         LOG("mult block get result: cyphertext len=%u\r\n", cyphertext_len);
 
-        if (cyphertext_len + NUM_DIGITS <= CYPHERTEXT_SIZE) {
+#ifdef STREAM_CYPHERTEXT
+        // Into the lane's ring slot, which task_emit_block empties, so there
+        // is no buffer to overflow
+        unsigned block_index = cyphertext_len / NUM_DIGITS;
+        CHAN_OUT1(unsigned, LANE(block), block_index,
+                  CH(task_mult_block_get_result, task_emit_block));
+        bool fits = true;
+#else
+        bool fits = cyphertext_len + NUM_DIGITS <= CYPHERTEXT_SIZE;
+#endif
+
+        if (fits) {
 
-            for (i = 0; i < NUM_DIGITS; ++i) { // reverse for printing
-                // TODO: we could save this read by rolling this loop into the
-                // above loop, by paying with an extra conditional in the
-                // above-loop.
-                m = *CHAN_IN1(digit_t, product[i], RET_CH(ch_mult_mod));
-                CHAN_OUT1(digit_t, cyphertext[cyphertext_len], m,
-                         CH(task_mult_block_get_result, task_print_cyphertext));
-                cyphertext_len++;
-            }
+#ifdef MONTGOMERY
+            // Out of Montgomery form: block * 1 * R^-1
+            digit_t one[NUM_DIGITS] = { 1 }, n[NUM_DIGITS];
+            CHAN_IN_ARRAY1(digit_t, N, 0, n, NUM_DIGITS,
+                           MC_IN_CH(ch_modulus, task_init, task_mult_block_get_result));
+            digit_t n_prime = *CHAN_IN1(digit_t, n_prime,
+                    MC_IN_CH(ch_montgomery, task_init, task_mult_block_get_result));
+            mont_mult(m, m, one, n, n_prime, NUM_DIGITS);
+#endif
+
+#ifdef STREAM_CYPHERTEXT
+            CHAN_OUT_ARRAY1(digit_t, LANE(slot), 0, m, NUM_DIGITS,
+                            CH(task_mult_block_get_result, task_emit_block));
+#else
+            CHAN_OUT_ARRAY1(digit_t, cyphertext, cyphertext_len, m, NUM_DIGITS,
+                            CH(task_mult_block_get_result, task_print_cyphertext));
+#endif
+            cyphertext_len += NUM_DIGITS;
+#if RSA_THREADS > 1
+            cyphertext_len += (RSA_THREADS - 1) * NUM_DIGITS; // other lanes' blocks
+#endif
 
         } else {
             printf("WARN: block dropped: cyphertext overlow [%u > %u]\r\n",
-                   cyphertext_len + NUM_DIGITS, CYPHERTEXT_SIZE);
+                   cyphertext_len + NUM_DIGITS, (unsigned)CYPHERTEXT_SIZE);
             // carry on encoding, though
         }
 
         // TODO: implementation limitation: cannot multicast and send to self
         // in the same macro
-        CHAN_OUT1(unsigned, cyphertext_len, cyphertext_len, 
+        CHAN_OUT1(unsigned, LANE(cyphertext_len), cyphertext_len, 
                                   SELF_OUT_CH(task_mult_block_get_result));
-        CHAN_OUT1(unsigned, cyphertext_len, cyphertext_len,
+        CHAN_OUT1(unsigned, LANE(cyphertext_len), cyphertext_len,
                  CH(task_mult_block_get_result, task_print_cyphertext));
 
+#ifdef BLOCK_CYCLES
+        block_time_t block_time = *CHAN_IN2(block_time_t, LANE(block_time),
+                                            CH(task_init, task_mult_block_get_result),
+                                            SELF_IN_CH(task_mult_block_get_result));
+        block_time_t block_start = *CHAN_IN1(block_time_t, LANE(block_start),
+                                             CH(task_pad, task_mult_block_get_result));
+        block_time += block_clock() - block_start;
+        CHAN_OUT1(block_time_t, LANE(block_time), block_time,
+                  SELF_OUT_CH(task_mult_block_get_result));
+        CHAN_OUT1(block_time_t, LANE(block_time), block_time,
+                 CH(task_mult_block_get_result, task_print_cyphertext));
+#endif
+
         LOG("mult block get results: block done, cyphertext_len=%u\r\n", cyphertext_len);
+#ifdef STREAM_CYPHERTEXT
+        TRANSITION_TO_MT(task_emit_block);
+#else
         TRANSITION_TO_MT(task_pad);
+#endif
     }
 
 }
 
+#ifdef STREAM_CYPHERTEXT
+void task_emit_block()
+{
+    int i;
+    unsigned block;
+    digit_t d[NUM_DIGITS];
+    uint8_t bytes[KEY_SIZE_BYTES];
+
+    block = *CHAN_IN1(unsigned, LANE(block), CH(task_mult_block_get_result, task_emit_block));
+    CHAN_IN_ARRAY1(digit_t, LANE(slot), 0, d, NUM_DIGITS,
+                   CH(task_mult_block_get_result, task_emit_block));
+    for (i = 0; i < KEY_SIZE_BYTES; ++i) // LSB first
+        bytes[i] = (d[i / DIGIT_BYTES] >> (8 * (i % DIGIT_BYTES))) & 0xff;
+
+    printf("Cyphertext block %u:\r\n", block);
+    print_hex_ascii(bytes, KEY_SIZE_BYTES);
+
+    TRANSITION_TO_MT(task_pad);
+}
+#endif
+
 // TODO: is this task necessary? it seems to act as nothing but a proxy
-// TODO: is there opportunity for special zero-copy optimization here
 void task_square_base()
 {
-    int i;
-    digit_t b;
     //LOG("TASK_SQUARE_BASE__rsa\r\n"); 
 
     LOG("square base\r\n");
 
-    for (i = 0; i < NUM_DIGITS; ++i) {
-        b = *CHAN_IN2(digit_t, base[i], MC_IN_CH(ch_base, task_pad, task_square_base),
-                               MC_IN_CH(ch_square_base, task_square_base_get_result, 
-                               task_square_base));
-        CHAN_OUT1(digit_t, A[i], b, CALL_CH(ch_mult_mod));
-        CHAN_OUT1(digit_t, B[i], b, CALL_CH(ch_mult_mod));
+    CALL_OPERAND2(ch_square_mod, A, LANE(base), 0,
+                  MC_IN_CH(ch_base, task_pad, task_square_base),
+                  MC_IN_CH(ch_square_base, task_square_base_get_result, task_square_base));
 
-        LOG("square base: b[%u]=%x\r\n", i, b);
-    }
+#ifdef VERBOSE
+    int i;
+    digit_t bd[NUM_DIGITS];
+    OPERAND_IN(ch_square_mod, A, 0, bd, NUM_DIGITS);
+    for (i = 0; i < NUM_DIGITS; ++i)
+        LOG("square base: b[%u]=%x\r\n", i, bd[i]);
+#endif
     task_t * next_task =TASK_REF(task_square_base_get_result); 
-    CHAN_OUT1(task_t*, next_task, next_task, CALL_CH(ch_mult_mod));
-    TRANSITION_TO_MT(task_mult_mod);
+    CHAN_OUT1(task_t*, LANE(next_task), next_task, CALL_CH(ch_square_mod));
+    TRANSITION_TO_MT(task_square_mod);
 }
 
 // TODO: is there opportunity for special zero-copy optimization here
 void task_square_base_get_result()
 {
     int i;
-    digit_t b;
+    digit_t b[NUM_DIGITS];
     //LOG("TASK_SQUARE_BASE_GET_RESULT_rsa\r\n"); 
 
     LOG("square base get result\r\n");
 
-    for (i = 0; i < NUM_DIGITS; ++i) {
-        b = *CHAN_IN1(digit_t, product[i], RET_CH(ch_mult_mod));
-        LOG("suqare base get result: base[%u]=%x\r\n", i, b);
-        CHAN_OUT1(digit_t, base[i], b, MC_OUT_CH(ch_square_base, task_square_base_get_result,
-                                       task_square_base, task_mult_block));
-    }
+    RESULT_IN(b);
+    CHAN_OUT_ARRAY1(digit_t, LANE(base), 0, b, NUM_DIGITS, MC_OUT_CH(ch_square_base,
+                    task_square_base_get_result, task_square_base, task_mult_block));
+
+    for (i = 0; i < NUM_DIGITS; ++i)
+        LOG("suqare base get result: base[%u]=%x\r\n", i, b[i]);
 
     TRANSITION_TO_MT(task_exp);
 }
 
 void task_print_cyphertext()
 {
-    int i, j = 0;
     unsigned cyphertext_len;
-    digit_t c;
+#ifndef STREAM_CYPHERTEXT
+    int i, j = 0;
+    digit_t c, d[NUM_DIGITS];
     char line[PRINT_HEX_ASCII_COLS];
+#endif
     //LOG("TASK_PRINT_CYPHERTEXT_rsa\r\n"); 
 
-    cyphertext_len = *CHAN_IN1(unsigned, cyphertext_len,
+#if RSA_THREADS > 1
+    // Each lane's write position ends past its last block, and the
+    // blocks of the other lanes after it
+    unsigned l;
+    cyphertext_len = 0;
+    for (l = 0; l < RSA_THREADS; ++l) {
+        unsigned lane_end = *CHAN_IN1(unsigned, LANE_AT(l, cyphertext_len),
+                                      CH(task_mult_block_get_result, task_print_cyphertext));
+        lane_end -= (RSA_THREADS - 1) * NUM_DIGITS;
+        if (lane_end > cyphertext_len && lane_end <= CYPHERTEXT_SIZE)
+            cyphertext_len = lane_end;
+    }
+#else
+    cyphertext_len = *CHAN_IN1(unsigned, LANE(cyphertext_len),
                                CH(task_mult_block_get_result, task_print_cyphertext));
+#endif
     LOG("print cyphertext: len=%u\r\n", cyphertext_len);
 
+#ifndef STREAM_CYPHERTEXT // already out, block by block
     printf("Cyphertext:\r\n");
-    for (i = 0; i < cyphertext_len; ++i) {
-        c = *CHAN_IN1(digit_t, cyphertext[i], CH(task_mult_block_get_result, task_print_cyphertext));
+    for (i = 0; i < cyphertext_len * DIGIT_BYTES; ++i) { // bytes, LSB first
+        if (i % KEY_SIZE_BYTES == 0) // a block at a time
+            CHAN_IN_ARRAY1(digit_t, cyphertext, i / DIGIT_BYTES, d, NUM_DIGITS,
+                           CH(task_mult_block_get_result, task_print_cyphertext));
+        c = (d[(i / DIGIT_BYTES) % NUM_DIGITS] >> (8 * (i % DIGIT_BYTES))) & 0xff;
         printf("%02x ", c);
         line[j++] = c;
         if ((i + 1) % PRINT_HEX_ASCII_COLS == 0) {
@@ -1346,44 +4386,296 @@ void task_print_cyphertext()
         }
     }
     printf("\r\n");
+#endif
+
+#ifdef CRT_DECRYPT
+    crt_state_t crt_state = { 0, -1 }; // load block 0 first
+    unsigned crt_blocks = cyphertext_len / NUM_DIGITS;
+    unsigned crt_block = 0;
+    CHAN_OUT1(crt_state_t, crt_state, crt_state, CH(task_print_cyphertext, task_crt_exp_p));
+    CHAN_OUT1(crt_state_t, crt_state, crt_state, CH(task_print_cyphertext, task_crt_exp_q));
+    CHAN_OUT1(unsigned, crt_blocks, crt_blocks, CH(task_print_cyphertext, task_crt_exp_p));
+    CHAN_OUT1(unsigned, crt_blocks, crt_blocks, CH(task_print_cyphertext, task_crt_exp_q));
+    CHAN_OUT1(unsigned, crt_blocks, crt_blocks, CH(task_print_cyphertext, task_crt_combine));
+    CHAN_OUT1(unsigned, crt_block, crt_block, CH(task_print_cyphertext, task_crt_combine));
+#endif
+
+#ifdef BLOCK_CYCLES
+    block_time_t block_time = *CHAN_IN1(block_time_t, LANE(block_time),
+                                        CH(task_mult_block_get_result, task_print_cyphertext));
+    unsigned blocks = cyphertext_len / NUM_DIGITS;
+#ifdef MONTGOMERY
+    const char *reduction = "montgomery";
+#elif defined(BARRETT)
+    const char *reduction = "barrett";
+#else
+    const char *reduction = "division";
+#endif
+
+    printf("rsa,key_bits,digit_bits,reduction,blocks,"
+           BLOCK_TIME_UNIT "," BLOCK_TIME_UNIT "_per_block\r\n");
+    printf("rsa,%u,%u,%s,%u,%lu,%lu\r\n", KEY_SIZE_BITS, DIGIT_BITS, reduction, blocks,
+           (unsigned long)(block_time / 1000),
+           (unsigned long)(blocks ? block_time / 1000 / blocks : 0));
+#endif
 
 #ifdef SHOW_COARSE_PROGRESS_ON_LED
     blink(1, BLINK_MESSAGE_DONE, LED2);
+#endif
+#ifdef CRT_DECRYPT
+    // This thread takes the p half, a new one the q half
+    THREAD_CREATE(task_crt_exp_q);
+    TRANSITION_TO_MT(task_crt_exp_p);
 #endif
     THREAD_END(); 
     TRANSITION_TO_MT(task_print_cyphertext);
 }
 
+#ifdef CRT_DECRYPT
+void task_crt_exp_p()
+{
+    int i;
+    const crt_prime_t *k;
+    crt_state_t st;
+    unsigned blocks;
+    digit_t c[NUM_DIGITS], m[CRT_DIGITS];
+
+    k = CHAN_IN1(crt_prime_t, crt_p, MC_IN_CH(ch_crt, task_init, task_crt_exp_p));
+    st = *CHAN_IN2(crt_state_t, crt_state, CH(task_print_cyphertext, task_crt_exp_p),
+                   SELF_IN_CH(task_crt_exp_p));
+    blocks = *CHAN_IN1(unsigned, crt_blocks, CH(task_print_cyphertext, task_crt_exp_p));
+
+    LOG("crt p: block %u bit %d\r\n", st.block, st.bit);
+
+    if (st.block == blocks) {
+        bool done = true;
+        CHAN_OUT1(bool, crt_done, done, CH(task_crt_exp_p, task_crt_exp_q));
+
+        // The thread that finishes last combines the halves
+        done = *CHAN_IN2(bool, crt_done, CH(task_init, task_crt_exp_p),
+                         CH(task_crt_exp_q, task_crt_exp_p));
+        if (done)
+            TRANSITION_TO_MT(task_crt_combine);
+        THREAD_END();
+        TRANSITION_TO_MT(task_crt_exp_p);
+    }
+
+    if (st.bit < 0) {
+        CHAN_IN_ARRAY1(digit_t, cyphertext, st.block * NUM_DIGITS, c, NUM_DIGITS,
+                       CH(task_mult_block_get_result, task_print_cyphertext));
+        crt_load(&st, k, c);
+    } else if (crt_exp_bit(&st, k, m)) {
+        CHAN_OUT_ARRAY1(digit_t, m, (st.block - 1) * CRT_DIGITS, m, CRT_DIGITS,
+                        CH(task_crt_exp_p, task_crt_combine));
+        st.bit = -1;
+    }
+
+    CHAN_OUT1(crt_state_t, crt_state, st, SELF_OUT_CH(task_crt_exp_p));
+    TRANSITION_TO_MT(task_crt_exp_p);
+}
+
+// Same as task_crt_exp_p, for q
+void task_crt_exp_q()
+{
+    int i;
+    const crt_prime_t *k;
+    crt_state_t st;
+    unsigned blocks;
+    digit_t c[NUM_DIGITS], m[CRT_DIGITS];
+
+    k = CHAN_IN1(crt_prime_t, crt_q, MC_IN_CH(ch_crt, task_init, task_crt_exp_q));
+    st = *CHAN_IN2(crt_state_t, crt_state, CH(task_print_cyphertext, task_crt_exp_q),
+                   SELF_IN_CH(task_crt_exp_q));
+    blocks = *CHAN_IN1(unsigned, crt_blocks, CH(task_print_cyphertext, task_crt_exp_q));
+
+    LOG("crt q: block %u bit %d\r\n", st.block, st.bit);
+
+    if (st.block == blocks) {
+        bool done = true;
+        CHAN_OUT1(bool, crt_done, done, CH(task_crt_exp_q, task_crt_exp_p));
+
+        done = *CHAN_IN2(bool, crt_done, CH(task_init, task_crt_exp_q),
+                         CH(task_crt_exp_p, task_crt_exp_q));
+        if (done)
+            TRANSITION_TO_MT(task_crt_combine);
+        THREAD_END();
+        TRANSITION_TO_MT(task_crt_exp_q);
+    }
+
+    if (st.bit < 0) {
+        CHAN_IN_ARRAY1(digit_t, cyphertext, st.block * NUM_DIGITS, c, NUM_DIGITS,
+                       CH(task_mult_block_get_result, task_print_cyphertext));
+        crt_load(&st, k, c);
+    } else if (crt_exp_bit(&st, k, m)) {
+        CHAN_OUT_ARRAY1(digit_t, m, (st.block - 1) * CRT_DIGITS, m, CRT_DIGITS,
+                        CH(task_crt_exp_q, task_crt_combine));
+        st.bit = -1;
+    }
+
+    CHAN_OUT1(crt_state_t, crt_state, st, SELF_OUT_CH(task_crt_exp_q));
+    TRANSITION_TO_MT(task_crt_exp_q);
+}
+
+// Garner: m = m_q + q * (q^-1 (m_p - m_q) mod p), one block per hop
+void task_crt_combine()
+{
+    int i, j;
+    unsigned block, blocks, offset;
+    const crt_prime_t *kp, *kq;
+    digit_t mp[CRT_DIGITS], mq[CRT_DIGITS], qinv[CRT_DIGITS], h[CRT_DIGITS];
+    digit_t m[NUM_DIGITS] = { 0 };
+    uint8_t bytes[KEY_SIZE_BYTES - NUM_PAD_BYTES];
+    ddigit_t cs;
+    digit_t borrow;
+
+    kp = CHAN_IN1(crt_prime_t, crt_p, MC_IN_CH(ch_crt, task_init, task_crt_combine));
+    kq = CHAN_IN1(crt_prime_t, crt_q, MC_IN_CH(ch_crt, task_init, task_crt_combine));
+    block = *CHAN_IN2(unsigned, crt_block, CH(task_print_cyphertext, task_crt_combine),
+                      SELF_IN_CH(task_crt_combine));
+    blocks = *CHAN_IN1(unsigned, crt_blocks, CH(task_print_cyphertext, task_crt_combine));
+
+    LOG("crt combine: block %u\r\n", block);
+
+    if (block == blocks)
+        TRANSITION_TO_MT(task_crt_print);
+
+    CHAN_IN_ARRAY1(digit_t, m, block * CRT_DIGITS, mp, CRT_DIGITS,
+                   CH(task_crt_exp_p, task_crt_combine));
+    CHAN_IN_ARRAY1(digit_t, m, block * CRT_DIGITS, mq, CRT_DIGITS,
+                   CH(task_crt_exp_q, task_crt_combine));
+    CHAN_IN_ARRAY1(digit_t, qinv, 0, qinv, CRT_DIGITS,
+                   MC_IN_CH(ch_crt, task_init, task_crt_combine));
+
+    // h = (m_p - m_q) mod p, with m_q < q < p
+    borrow = 0;
+    for (i = 0; i < CRT_DIGITS; ++i) {
+        cs = (ddigit_t)mq[i] + borrow;
+        borrow = mp[i] < cs;
+        h[i] = ((ddigit_t)mp[i] + ((ddigit_t)borrow << DIGIT_BITS) - cs) & DIGIT_MASK;
+    }
+    if (borrow) {
+        cs = 0;
+        for (i = 0; i < CRT_DIGITS; ++i) {
+            cs += (ddigit_t)h[i] + kp->n[i];
+            h[i] = cs & DIGIT_MASK;
+            cs >>= DIGIT_BITS;
+        }
+    }
+
+    // h = h q^-1 mod p: the second multiply by R^2 cancels both R^-1
+    mont_mult(h, h, qinv, kp->n, kp->n_prime, CRT_DIGITS);
+    mont_mult(h, h, kp->r2, kp->n, kp->n_prime, CRT_DIGITS);
+
+    // m = m_q + h q
+    for (i = 0; i < CRT_DIGITS; ++i)
+        m[i] = mq[i];
+    for (i = 0; i < CRT_DIGITS; ++i) {
+        cs = 0;
+        for (j = 0; j < CRT_DIGITS; ++j) {
+            cs += m[i + j] + (ddigit_t)h[i] * kq->n[j];
+            m[i + j] = cs & DIGIT_MASK;
+            cs >>= DIGIT_BITS;
+        }
+        for (j = i + CRT_DIGITS; cs && j < NUM_DIGITS; ++j) {
+            cs += m[j];
+            m[j] = cs & DIGIT_MASK;
+            cs >>= DIGIT_BITS;
+        }
+    }
+
+    offset = block * (KEY_SIZE_BYTES - NUM_PAD_BYTES);
+    for (i = 0; i < KEY_SIZE_BYTES - NUM_PAD_BYTES && offset + i < sizeof(PLAINTEXT); ++i)
+        bytes[i] = (m[i / DIGIT_BYTES] >> (8 * (i % DIGIT_BYTES))) & 0xff;
+    CHAN_OUT_ARRAY1(uint8_t, plaintext, offset, bytes, i, CH(task_crt_combine, task_crt_print));
+
+    block++;
+    CHAN_OUT1(unsigned, crt_block, block, SELF_OUT_CH(task_crt_combine));
+    TRANSITION_TO_MT(task_crt_combine);
+}
+
+void task_crt_print()
+{
+    unsigned i, mismatches = 0;
+    unsigned message_length = sizeof(PLAINTEXT) - 1;
+    uint8_t plaintext[sizeof(PLAINTEXT)];
+
+    CHAN_IN_ARRAY1(uint8_t, plaintext, 0, plaintext, message_length,
+                   CH(task_crt_combine, task_crt_print));
+    for (i = 0; i < message_length; ++i) {
+        if (plaintext[i] != PLAINTEXT[i])
+            mismatches++;
+    }
+
+    printf("Decrypted:\r\n");
+    print_hex_ascii(plaintext, message_length);
+    if (mismatches)
+        printf("decrypt: %u of %u bytes differ\r\n", mismatches, message_length);
+    else
+        printf("decrypt: OK\r\n");
+
+    THREAD_END();
+    TRANSITION_TO_MT(task_crt_print);
+}
+#endif
+
 // TODO: this task also looks like a proxy: is it avoidable?
 void task_mult_mod()
 {
     int i;
-    digit_t a, b;
     //LOG("TASK_MULT_MOD_rsa\r\n"); 
 
     LOG("mult mod\r\n");
 
-    for (i = 0; i < NUM_DIGITS; ++i) {
-        a = *CHAN_IN1(digit_t, A[i], CALL_CH(ch_mult_mod));
-        b = *CHAN_IN1(digit_t, B[i], CALL_CH(ch_mult_mod));
+#ifdef MONTGOMERY
+    digit_t a[NUM_DIGITS], b[NUM_DIGITS], n[NUM_DIGITS], r[NUM_DIGITS];
 
-        LOG("mult mod: i=%u a=%x b=%x\r\n", i, a, b);
+    OPERAND_IN(ch_mult_mod, A, 0, a, NUM_DIGITS);
+    OPERAND_IN(ch_mult_mod, B, 0, b, NUM_DIGITS);
+    CHAN_IN_ARRAY1(digit_t, N, 0, n, NUM_DIGITS, MC_IN_CH(ch_modulus, task_init, task_mult_mod));
+    digit_t n_prime = *CHAN_IN1(digit_t, n_prime,
+                                MC_IN_CH(ch_montgomery, task_init, task_mult_mod));
 
-        CHAN_OUT1(digit_t, A[i], a, CH(task_mult_mod, task_mult));
-        CHAN_OUT1(digit_t, B[i], b, CH(task_mult_mod, task_mult));
-    }
+    mont_mult(r, a, b, n, n_prime, NUM_DIGITS);
+
+    for (i = 0; i < NUM_DIGITS; ++i)
+        LOG("mult mod: r[%u]=%x\r\n", i, r[i]);
+    RETURN_DIGITS(r);
+
+    const task_t *next_task = *CHAN_IN1(task_t *, LANE(next_task), CALL_CH(ch_mult_mod));
+    transition_to_mt(next_task);
+#else
+    // The multiply reads the operands from the call channel (OPERAND_IN), so
+    // they are not copied here
+#ifdef VERBOSE
+    digit_t a[NUM_DIGITS], b[NUM_DIGITS];
+    OPERAND_IN(ch_mult_mod, A, 0, a, NUM_DIGITS);
+    OPERAND_IN(ch_mult_mod, B, 0, b, NUM_DIGITS);
+    for (i = 0; i < NUM_DIGITS; ++i)
+        LOG("mult mod: i=%u a=%x b=%x\r\n", i, a[i], b[i]);
+#endif
+
+#ifdef MULT_KARATSUBA
+    unsigned stage = 0;
+    CHAN_OUT1(unsigned, LANE(stage), stage, CH(task_mult_mod, task_karatsuba));
+
+    TRANSITION_TO_MT(task_karatsuba);
+#else
     unsigned dummy = 0; 
-    CHAN_OUT1(unsigned, digit, dummy , CH(task_mult_mod, task_mult));
-    CHAN_OUT1(unsigned, carry, dummy, CH(task_mult_mod, task_mult));
+    acc_t carry = 0;
+    CHAN_OUT1(unsigned, LANE(digit), dummy , CH(task_mult_mod, task_mult));
+    CHAN_OUT1(acc_t, LANE(carry), carry, CH(task_mult_mod, task_mult));
 
     TRANSITION_TO_MT(task_mult);
+#endif
+#endif
 }
 
 void task_mult()
 {
-    int i;
-    digit_t a, b, c;
-    digit_t dp, p, carry;
+    int i, lo, hi;
+    digit_t a[NUM_DIGITS], b[NUM_DIGITS], r;
+    ddigit_t dp;
+    acc_t p, c, carry;
     int digit;
     //LOG("TASK_MULT_rsa\r\n"); 
 
@@ -1391,49 +4683,336 @@ void task_mult()
     blink(1, BLINK_DURATION_TASK / 4, LED1);
 #endif
 
-    digit = *CHAN_IN2(int, digit, CH(task_mult_mod, task_mult), SELF_IN_CH(task_mult));
-    carry = *CHAN_IN2(digit_t, carry, CH(task_mult_mod, task_mult), SELF_IN_CH(task_mult));
+    digit = *CHAN_IN2(int, LANE(digit), CH(task_mult_mod, task_mult), SELF_IN_CH(task_mult));
+    carry = *CHAN_IN2(acc_t, LANE(carry), CH(task_mult_mod, task_mult), SELF_IN_CH(task_mult));
 
     LOG("mult: digit=%u carry=%x\r\n", digit, carry);
 
+    // A[digit - i] B[i] for lo <= i <= hi: a holds A[digit - hi .. digit - lo]
+    lo = digit < NUM_DIGITS ? 0 : digit - (NUM_DIGITS - 1);
+    hi = digit < NUM_DIGITS ? digit : NUM_DIGITS - 1;
+    OPERAND_IN(ch_mult_mod, A, digit - hi, a, hi - lo + 1);
+    OPERAND_IN(ch_mult_mod, B, lo, b, hi - lo + 1);
+
     p = carry;
     c = 0;
-    for (i = 0; i < NUM_DIGITS; ++i) {
-        if (digit - i >= 0 && digit - i < NUM_DIGITS) {
-            a = *CHAN_IN1(digit_t, A[digit - i], CH(task_mult_mod, task_mult));
-            b = *CHAN_IN1(digit_t, B[i], CH(task_mult_mod, task_mult));
-            dp = a * b;
+    for (i = 0; i <= hi - lo; ++i) {
+        dp = (ddigit_t)a[hi - lo - i] * b[i];
 
-            c += dp >> DIGIT_BITS;
-            p += dp & DIGIT_MASK;
+        c += dp >> DIGIT_BITS;
+        p += dp & DIGIT_MASK;
 
-            LOG("mult: i=%u a=%x b=%x p=%x\r\n", i, a, b, p);
-        }
+        LOG("mult: i=%u a=%x b=%x p=%x\r\n", lo + i, a[hi - lo - i], b[i], p);
     }
 
     c += p >> DIGIT_BITS;
-    p &= DIGIT_MASK;
+    r = p & DIGIT_MASK;
 
-    LOG("mult: c=%x p=%x\r\n", c, p);
+    LOG("mult: c=%x p=%x\r\n", c, r);
 
-    CHAN_OUT1(digit_t, product[digit], p, MC_OUT_CH(ch_product, task_mult,
+    CHAN_OUT1(digit_t, LANE(product[digit]), r, MC_OUT_CH(ch_product, task_mult,
              task_reduce_digits,
              task_reduce_n_divisor, task_reduce_normalizable, task_reduce_normalize));
 
-    CHAN_OUT1(digit_t, product[digit], p, CALL_CH(ch_print_product));
+    PRINT_PRODUCT_DIGIT(digit, r);
 
     digit++;
 
     if (digit < NUM_DIGITS_x2) {
-        CHAN_OUT1(digit_t, carry, c, SELF_OUT_CH(task_mult));
-        CHAN_OUT1(int, digit, digit, SELF_OUT_CH(task_mult));
+        CHAN_OUT1(acc_t, LANE(carry), c, SELF_OUT_CH(task_mult));
+        CHAN_OUT1(int, LANE(digit), digit, SELF_OUT_CH(task_mult));
         TRANSITION_TO_MT(task_mult);
     } else {
-        task_t *next_task =TASK_REF(task_reduce_digits);  
-        CHAN_OUT1(task_t *, next_task, next_task , CALL_CH(ch_print_product));
-        TRANSITION_TO_MT(task_print_product);
+#ifdef BARRETT
+        TRANSITION_VIA_PRINT_PRODUCT(TASK_REF(task_reduce_barrett_quotient));
+#else
+        TRANSITION_VIA_PRINT_PRODUCT(TASK_REF(task_reduce_digits));
+#endif
+    }
+}
+
+#ifdef MULT_KARATSUBA
+// One half-size product per hop: a0 * b0, a1 * b1, (a0 + a1) * (b0 + b1)
+void task_karatsuba()
+{
+    int i;
+    unsigned stage, n;
+    digit_t a[KARATSUBA_HI + 1], b[KARATSUBA_HI + 1];
+    digit_t al[KARATSUBA_LO], bl[KARATSUBA_LO]; // low halves, for a0 + a1
+    digit_t z[2 * (KARATSUBA_HI + 1)];
+    digit_t scratch[KARATSUBA_SCRATCH];
+    ddigit_t ca = 0, cb = 0;
+
+    stage = *CHAN_IN2(unsigned, LANE(stage), CH(task_mult_mod, task_karatsuba),
+                      SELF_IN_CH(task_karatsuba));
+
+    LOG("karatsuba: stage %u\r\n", stage);
+
+    if (stage == 0) {
+        n = KARATSUBA_LO;
+        OPERAND_IN(ch_mult_mod, A, 0, a, n);
+        OPERAND_IN(ch_mult_mod, B, 0, b, n);
+    } else {
+        n = stage == 1 ? KARATSUBA_HI : KARATSUBA_HI + 1;
+        OPERAND_IN(ch_mult_mod, A, KARATSUBA_LO, a, KARATSUBA_HI);
+        OPERAND_IN(ch_mult_mod, B, KARATSUBA_LO, b, KARATSUBA_HI);
+        if (stage == 2) {
+            OPERAND_IN(ch_mult_mod, A, 0, al, KARATSUBA_LO);
+            OPERAND_IN(ch_mult_mod, B, 0, bl, KARATSUBA_LO);
+        }
+        for (i = 0; i < KARATSUBA_HI; ++i) {
+            ca += a[i];
+            cb += b[i];
+            if (stage == 2 && i < KARATSUBA_LO) {
+                ca += al[i];
+                cb += bl[i];
+            }
+            a[i] = ca & DIGIT_MASK;
+            b[i] = cb & DIGIT_MASK;
+            ca >>= DIGIT_BITS;
+            cb >>= DIGIT_BITS;
+        }
+        a[KARATSUBA_HI] = ca;
+        b[KARATSUBA_HI] = cb;
+    }
+
+    karatsuba_mult(z, a, b, n, scratch);
+
+    if (stage == 0)
+        CHAN_OUT_ARRAY1(digit_t, LANE(z0), 0, z, 2 * n, CH(task_karatsuba, task_karatsuba_combine));
+    else if (stage == 1)
+        CHAN_OUT_ARRAY1(digit_t, LANE(z2), 0, z, 2 * n, CH(task_karatsuba, task_karatsuba_combine));
+    else
+        CHAN_OUT_ARRAY1(digit_t, LANE(z1), 0, z, 2 * n, CH(task_karatsuba, task_karatsuba_combine));
+
+    if (stage == 2)
+        TRANSITION_TO_MT(task_karatsuba_combine);
+
+    stage++;
+    CHAN_OUT1(unsigned, LANE(stage), stage, SELF_OUT_CH(task_karatsuba));
+    TRANSITION_TO_MT(task_karatsuba);
+}
+
+// product = z0 + (z1 - z0 - z2) * b^lo + z2 * b^(2 lo), out like task_mult's
+void task_karatsuba_combine()
+{
+    int i;
+    digit_t r[NUM_DIGITS_x2], z1[2 * (KARATSUBA_HI + 1)];
+
+    LOG("karatsuba: combine\r\n");
+
+    CHAN_IN_ARRAY1(digit_t, LANE(z0), 0, r, 2 * KARATSUBA_LO,
+                   CH(task_karatsuba, task_karatsuba_combine));
+    CHAN_IN_ARRAY1(digit_t, LANE(z2), 0, r + 2 * KARATSUBA_LO, 2 * KARATSUBA_HI,
+                   CH(task_karatsuba, task_karatsuba_combine));
+    CHAN_IN_ARRAY1(digit_t, LANE(z1), 0, z1, 2 * (KARATSUBA_HI + 1),
+                   CH(task_karatsuba, task_karatsuba_combine));
+
+    karatsuba_middle(r, z1, NUM_DIGITS);
+
+    CHAN_OUT_ARRAY1(digit_t, LANE(product), 0, r, NUM_DIGITS_x2, MC_OUT_CH(ch_product, task_mult,
+                    task_reduce_digits,
+                    task_reduce_n_divisor, task_reduce_normalizable, task_reduce_normalize));
+    PRINT_PRODUCT_DIGITS(0, r, NUM_DIGITS_x2);
+
+#ifdef BARRETT
+    TRANSITION_VIA_PRINT_PRODUCT(TASK_REF(task_reduce_barrett_quotient));
+#else
+    TRANSITION_VIA_PRINT_PRODUCT(TASK_REF(task_reduce_digits));
+#endif
+}
+#endif
+
+// Same call convention as task_mult_mod, and the result comes back on its
+// return channel, but with a single operand
+void task_square_mod()
+{
+    int i;
+    const task_t *next_task;
+
+    LOG("square mod\r\n");
+
+    next_task = *CHAN_IN1(task_t *, LANE(next_task), CALL_CH(ch_square_mod));
+
+#ifdef MONTGOMERY
+    digit_t a[NUM_DIGITS], n[NUM_DIGITS], r[NUM_DIGITS];
+
+    OPERAND_IN(ch_square_mod, A, 0, a, NUM_DIGITS);
+    CHAN_IN_ARRAY1(digit_t, N, 0, n, NUM_DIGITS, MC_IN_CH(ch_modulus, task_init, task_square_mod));
+    digit_t n_prime = *CHAN_IN1(digit_t, n_prime,
+                                MC_IN_CH(ch_montgomery, task_init, task_square_mod));
+
+    mont_square(r, a, n, n_prime, NUM_DIGITS);
+
+    for (i = 0; i < NUM_DIGITS; ++i)
+        LOG("square mod: r[%u]=%x\r\n", i, r[i]);
+    RETURN_DIGITS(r);
+
+    transition_to_mt(next_task);
+#else
+    // The reduce chain returns to the caller of ch_mult_mod
+    CHAN_OUT1(task_t *, LANE(next_task), next_task, CALL_CH(ch_mult_mod));
+
+    unsigned digit = 0;
+    acc_t carry = 0;
+    CHAN_OUT1(unsigned, LANE(digit), digit, CH(task_square_mod, task_square));
+    CHAN_OUT1(acc_t, LANE(carry), carry, CH(task_square_mod, task_square));
+
+    TRANSITION_TO_MT(task_square);
+#endif
+}
+
+// Digit 'digit' of A^2, like task_mult, but each cross product A[i] A[j],
+// i < j, is computed once and doubled, so a square takes about half the
+// digit products of a multiply.
+void task_square()
+{
+    int i, lo;
+    digit_t a[NUM_DIGITS], r;
+    ddigit_t dp;
+    acc_t p, c, carry;
+    int digit;
+
+    digit = *CHAN_IN2(int, LANE(digit), CH(task_square_mod, task_square), SELF_IN_CH(task_square));
+    carry = *CHAN_IN2(acc_t, LANE(carry), CH(task_square_mod, task_square), SELF_IN_CH(task_square));
+
+    LOG("square: digit=%u carry=%x\r\n", digit, carry);
+
+    // a holds A[lo .. digit - lo], every digit this column touches
+    lo = digit < NUM_DIGITS ? 0 : digit - (NUM_DIGITS - 1);
+    OPERAND_IN(ch_square_mod, A, lo, a, digit - 2 * lo + 1);
+
+    p = 0;
+    c = 0;
+    for (i = lo; 2 * i < digit; ++i) {
+        dp = (ddigit_t)a[i - lo] * a[digit - i - lo];
+
+        c += dp >> DIGIT_BITS;
+        p += dp & DIGIT_MASK;
+
+        LOG("square: i=%u a=%x b=%x p=%x\r\n", i, a[i - lo], a[digit - i - lo], p);
+    }
+    c <<= 1;
+    p = (p << 1) + carry;
+
+    if (digit % 2 == 0 && digit / 2 < NUM_DIGITS) {
+        dp = (ddigit_t)a[digit / 2 - lo] * a[digit / 2 - lo];
+
+        c += dp >> DIGIT_BITS;
+        p += dp & DIGIT_MASK;
+    }
+
+    c += p >> DIGIT_BITS;
+    r = p & DIGIT_MASK;
+
+    LOG("square: c=%x p=%x\r\n", c, r);
+
+    // Into the product channels of task_mult, so the reduce chain reads a
+    // square like any other product
+    CHAN_OUT1(digit_t, LANE(product[digit]), r, MC_OUT_CH(ch_product, task_mult,
+             task_reduce_digits,
+             task_reduce_n_divisor, task_reduce_normalizable, task_reduce_normalize));
+
+    PRINT_PRODUCT_DIGIT(digit, r);
+
+    digit++;
+
+    if (digit < NUM_DIGITS_x2) {
+        CHAN_OUT1(acc_t, LANE(carry), c, SELF_OUT_CH(task_square));
+        CHAN_OUT1(int, LANE(digit), digit, SELF_OUT_CH(task_square));
+        TRANSITION_TO_MT(task_square);
+    } else {
+#ifdef BARRETT
+        TRANSITION_VIA_PRINT_PRODUCT(TASK_REF(task_reduce_barrett_quotient));
+#else
+        TRANSITION_VIA_PRINT_PRODUCT(TASK_REF(task_reduce_digits));
+#endif
+    }
+}
+
+#ifdef BARRETT
+// q = floor(floor(x / b^(k-1)) * mu / b^(k+1)), where x is the product: at
+// most 2 above floor(x / N)
+void task_reduce_barrett_quotient()
+{
+    int i, j;
+    digit_t x[NUM_DIGITS + 1], mu[NUM_DIGITS + 1];
+    digit_t t[2 * NUM_DIGITS + 2] = { 0 };
+    ddigit_t cs;
+
+    LOG("reduce: barrett: quotient\r\n");
+
+    CHAN_IN_ARRAY1(digit_t, LANE(product), NUM_DIGITS - 1, x, NUM_DIGITS + 1,
+                   MC_IN_CH(ch_product, task_mult, task_reduce_barrett_quotient));
+    CHAN_IN_ARRAY1(digit_t, mu, 0, mu, NUM_DIGITS + 1,
+                   MC_IN_CH(ch_barrett, task_init, task_reduce_barrett_quotient));
+
+    for (i = 0; i <= NUM_DIGITS; ++i) {
+        cs = 0;
+        for (j = 0; j <= NUM_DIGITS; ++j) {
+            cs += t[i + j] + (ddigit_t)x[i] * mu[j];
+            t[i + j] = cs & DIGIT_MASK;
+            cs >>= DIGIT_BITS;
+        }
+        t[i + NUM_DIGITS + 1] = cs;
+    }
+
+    for (i = 0; i <= NUM_DIGITS; ++i)
+        LOG("reduce: barrett: q[%u]=%x\r\n", i, t[NUM_DIGITS + 1 + i]);
+    CHAN_OUT_ARRAY1(digit_t, LANE(q), 0, t + NUM_DIGITS + 1, NUM_DIGITS + 1,
+                    CH(task_reduce_barrett_quotient, task_reduce_barrett_subtract));
+
+    TRANSITION_TO_MT(task_reduce_barrett_subtract);
+}
+
+// r = (x - q * N) mod b^(k+1), which is below 3N, then r -= N until r < N
+void task_reduce_barrett_subtract()
+{
+    int i, j;
+    digit_t q[NUM_DIGITS + 1], n[NUM_DIGITS], r[NUM_DIGITS + 1];
+    digit_t qn[NUM_DIGITS + 1] = { 0 };
+    digit_t borrow;
+    ddigit_t cs, s;
+
+    LOG("reduce: barrett: subtract\r\n");
+
+    CHAN_IN_ARRAY1(digit_t, LANE(q), 0, q, NUM_DIGITS + 1,
+                   CH(task_reduce_barrett_quotient, task_reduce_barrett_subtract));
+    CHAN_IN_ARRAY1(digit_t, LANE(product), 0, r, NUM_DIGITS + 1,
+                   MC_IN_CH(ch_product, task_mult, task_reduce_barrett_subtract));
+    CHAN_IN_ARRAY1(digit_t, N, 0, n, NUM_DIGITS,
+                   MC_IN_CH(ch_modulus, task_init, task_reduce_barrett_subtract));
+
+    // Only the low k + 1 digits of q * N
+    for (i = 0; i <= NUM_DIGITS; ++i) {
+        cs = 0;
+        for (j = 0; j < NUM_DIGITS && i + j <= NUM_DIGITS; ++j) {
+            cs += qn[i + j] + (ddigit_t)q[i] * n[j];
+            qn[i + j] = cs & DIGIT_MASK;
+            cs >>= DIGIT_BITS;
+        }
+        if (i + j <= NUM_DIGITS)
+            qn[i + j] = cs;
+    }
+
+    borrow = 0;
+    for (i = 0; i <= NUM_DIGITS; ++i) {
+        s = (ddigit_t)qn[i] + borrow;
+        borrow = r[i] < s;
+        r[i] = ((ddigit_t)r[i] + ((ddigit_t)borrow << DIGIT_BITS) - s) & DIGIT_MASK;
     }
+
+    while (barrett_sub_if_geq(r, n))
+        ; // at most twice
+
+    for (i = 0; i < NUM_DIGITS; ++i)
+        LOG("reduce: barrett: r[%u]=%x\r\n", i, r[i]);
+    RETURN_DIGITS(r);
+
+    const task_t *next_task = *CHAN_IN1(task_t *, LANE(next_task), CALL_CH(ch_mult_mod));
+    transition_to_mt(next_task);
 }
+#endif
 
 void task_reduce_digits()
 {
@@ -1447,7 +5026,7 @@ void task_reduce_digits()
     d = 2 * NUM_DIGITS;
     do {
         d--;
-        m = *CHAN_IN1(digit_t, product[d], MC_IN_CH(ch_product, task_mult, task_reduce_digits));
+        m = *CHAN_IN1(digit_t, LANE(product[d]), MC_IN_CH(ch_product, task_mult, task_reduce_digits));
         LOG("reduce digits: p[%u]=%x\r\n", d, m);
     } while (m == 0 && d > 0);
 
@@ -1457,7 +5036,7 @@ void task_reduce_digits()
     }
     LOG("reduce: digits: d = %u\r\n", d);
 
-    CHAN_OUT1(int, digit, d, MC_OUT_CH(ch_digit, task_reduce_digits,
+    CHAN_OUT1(int, LANE(digit), d, MC_OUT_CH(ch_digit, task_reduce_digits,
                                  task_reduce_normalizable, task_reduce_normalize,
                                  task_reduce_quotient));
 
@@ -1467,7 +5046,8 @@ void task_reduce_digits()
 void task_reduce_normalizable()
 {
     int i;
-    unsigned m, n, d, offset;
+    digit_t m, n;
+    unsigned d, offset;
     bool normalizable = true;
     //LOG("TASK_REDUCE_NORMALIZABLE_rsa\r\n"); 
 
@@ -1499,18 +5079,25 @@ void task_reduce_normalizable()
     // comparison/subtraction of the digits, we offset the index into the
     // product digits by (l-k) = NUM_DIGITS.
 
-    d = *CHAN_IN1(unsigned, digit, 
-                    MC_IN_CH(ch_digit, task_reduce_digits, task_reduce_noramlizable));
+    d = *CHAN_IN1(unsigned, LANE(digit), 
+                    MC_IN_CH(ch_digit, task_reduce_digits, task_reduce_normalizable));
+
+    // A product with fewer digits than the modulus (small operands) is
+    // already reduced; the offset below would otherwise go negative.
+    if (d < NUM_DIGITS - 1) {
+        normalizable = false;
+        d = NUM_DIGITS - 1;
+    }
 
-    offset = d + 1 - NUM_DIGITS; // TODO: can this go below zero
+    offset = d + 1 - NUM_DIGITS;
     LOG("reduce: normalizable: d=%u offset=%u\r\n", d, offset);
 
-    CHAN_OUT1(unsigned, offset, offset, CH(task_reduce_normalizable, task_reduce_normalize));
+    CHAN_OUT1(unsigned, LANE(offset), offset, CH(task_reduce_normalizable, task_reduce_normalize));
 
-    for (i = d; i >= 0; --i) {
-        m = *CHAN_IN1(unsigned, product[i],
+    for (i = d; normalizable && i >= 0; --i) {
+        m = *CHAN_IN1(digit_t, LANE(product[i]),
                       MC_IN_CH(ch_product, task_mult, task_reduce_normalizable));
-        n = *CHAN_IN1(unsigned, N[i - offset], MC_IN_CH(ch_modulus, task_init,
+        n = *CHAN_IN1(digit_t, N[i - offset], MC_IN_CH(ch_modulus, task_init,
                                               task_reduce_normalizable));
 
         LOG("normalizable: m[%u]=%x n[%u]=%x\r\n", i, m, i - offset, n);
@@ -1526,15 +5113,11 @@ void task_reduce_normalizable()
     if (!normalizable && d == NUM_DIGITS - 1) {
         LOG("reduce: normalizable: reduction done: message < modulus\r\n");
 
-        // TODO: is this copy avoidable? a 'mult mod done' task doesn't help
-        // because we need to ship the data to it.
-        for (i = 0; i < NUM_DIGITS; ++i) {
-            m = *CHAN_IN1(unsigned, product[i],
-                          MC_IN_CH(ch_product, task_mult, task_reduce_normalizable));
-            CHAN_OUT1(unsigned, product[i], m, RET_CH(ch_mult_mod));
-        }
+        // The product is the result as it stands: return where it is
+        RETURN_IN_PLACE(LANE(product),
+                        MC_IN_CH(ch_product, task_mult, task_reduce_normalizable));
 
-        const task_t *next_task = *CHAN_IN1(task_t *, next_task, CALL_CH(ch_mult_mod));
+        const task_t *next_task = *CHAN_IN1(task_t *, LANE(next_task), CALL_CH(ch_mult_mod));
         transition_to_mt(next_task);
     }
 
@@ -1551,74 +5134,63 @@ void task_reduce_normalizable()
 void task_reduce_normalize()
 {
     int i;
-    digit_t m, n, d, s;
+    digit_t m[NUM_DIGITS_x2], n[NUM_DIGITS], d[NUM_DIGITS];
+    ddigit_t s;
     unsigned borrow, offset;
     const task_t *next_task;
     //LOG("TASK_REDUCE_NORMALIZE_rsa\r\n"); 
 
     LOG("normalize\r\n");
 
-    offset = *CHAN_IN1(unsigned, offset, CH(task_reduce_normalizable, task_reduce_normalize));
+    offset = *CHAN_IN1(unsigned, LANE(offset), CH(task_reduce_normalizable, task_reduce_normalize));
 
+#if PRINT_PRODUCT
     // To call the print task, we need to proxy the values we don't touch
-    for (i = 0; i < offset; ++i) {
-        m = *CHAN_IN1(digit_t, product[i], MC_IN_CH(ch_product, task_mult, task_reduce_normalize));
-        CHAN_OUT1(digit_t, product[i], m, CALL_CH(ch_print_product));
-    }
+    CHAN_IN_ARRAY1(digit_t, LANE(product), 0, m, offset,
+                   MC_IN_CH(ch_product, task_mult, task_reduce_normalize));
+    PRINT_PRODUCT_DIGITS(0, m, offset);
+#endif
+
+    CHAN_IN_ARRAY1(digit_t, LANE(product), offset, m + offset, NUM_DIGITS,
+                   MC_IN_CH(ch_product, task_mult, task_reduce_normalize));
+    CHAN_IN_ARRAY1(digit_t, N, 0, n, NUM_DIGITS,
+                   MC_IN_CH(ch_modulus, task_init, task_reduce_normalize));
 
     borrow = 0;
     for (i = 0; i < NUM_DIGITS; ++i) {
-        m = *CHAN_IN1(digit_t, product[i + offset],
-                      MC_IN_CH(ch_product, task_mult, task_reduce_normalize));
-        n = *CHAN_IN1(digit_t, N[i], MC_IN_CH(ch_modulus, task_init, task_reduce_normalize));
-
-        s = n + borrow;
-        if (m < s) {
-            m += 1 << DIGIT_BITS;
-            borrow = 1;
-        } else {
-            borrow = 0;
-        }
-        d = m - s;
+        s = (ddigit_t)n[i] + borrow;
+        borrow = m[i + offset] < s;
+        d[i] = (m[i + offset] + ((ddigit_t)borrow << DIGIT_BITS)) - s;
 
         LOG("normalize: m[%u]=%x n[%u]=%x b=%u d=%x\r\n",
-                i + offset, m, i, n, borrow, d);
-
-        CHAN_OUT1(digit_t, product[i + offset], d,
-                 MC_OUT_CH(ch_normalized_product, task_reduce_normalize,
-                           task_reduce_quotient, task_reduce_compare,
-                           task_reduce_add, task_reduce_subtract));
-
-        CHAN_OUT1(digit_t, product[i + offset], d, CALL_CH(ch_print_product));
+                i + offset, m[i + offset], i, n[i], borrow, d[i]);
     }
 
+    CHAN_OUT_ARRAY1(digit_t, LANE(product), offset, d, NUM_DIGITS,
+                    MC_OUT_CH(ch_normalized_product, task_reduce_normalize,
+                              task_reduce_quotient, task_reduce_compare,
+                              task_reduce_add, task_reduce_subtract));
+
     // To call the print task, we need to proxy the values we don't touch
-    for (i = offset + NUM_DIGITS; i < NUM_DIGITS_x2; ++i) {
-        digit_t dummy = 0; 
-        CHAN_OUT1(digit_t, product[i], dummy, CALL_CH(ch_print_product));
-    }
+    PRINT_PRODUCT_DIGITS(offset, d, NUM_DIGITS);
+    PRINT_PRODUCT_ZEROS(offset + NUM_DIGITS, NUM_DIGITS_x2 - (offset + NUM_DIGITS));
 
     if (offset > 0) { // l-1 > k-1 (loop bounds), where offset=l-k, where l=|m|,k=|n|
         next_task = TASK_REF(task_reduce_n_divisor);
     } else {
         LOG("reduce: normalize: reduction done: no digits to reduce\r\n");
-        // TODO: is this copy avoidable?
-        for (i = 0; i < NUM_DIGITS; ++i) {
-            m = *CHAN_IN1(digit_t, product[i],
-                          MC_IN_CH(ch_product, task_mult, task_reduce_normalize));
-            CHAN_OUT1(digit_t, product[i], m, RET_CH(ch_mult_mod));
-        }
-        next_task = *CHAN_IN1(task_t *, next_task, CALL_CH(ch_mult_mod));
+        RETURN_IN_PLACE(LANE(product),
+                        MC_IN_CH(ch_product, task_mult, task_reduce_normalize));
+        next_task = *CHAN_IN1(task_t *, LANE(next_task), CALL_CH(ch_mult_mod));
     }
 
-    CHAN_OUT1(task_t *, next_task, next_task, CALL_CH(ch_print_product));
-    TRANSITION_TO_MT(task_print_product);
+    TRANSITION_VIA_PRINT_PRODUCT(next_task);
 }
 
 void task_reduce_n_divisor()
 {
     digit_t n[2]; // [1]=N[msd], [0]=N[msd-1]
-    digit_t n_div;
+    ddigit_t n_div;
 
 #ifdef SHOW_PROGRESS_ON_LED
     blink(1, SEC_TO_CYCLES, LED2);
@@ -1628,14 +5200,14 @@ void task_reduce_n_divisor()
 
     n[1]  = *CHAN_IN1(digit_t, N[NUM_DIGITS - 1],
                       MC_IN_CH(ch_modulus, task_init, task_reduce_n_divisor));
-    n[0] = *CHAN_IN1(digit_t, N[NUM_DIGITS - 2], MC_IN_CH(ch_modulus, task_init, task_n_divisor));
+    n[0] = *CHAN_IN1(digit_t, N[NUM_DIGITS - 2], MC_IN_CH(ch_modulus, task_init, task_reduce_n_divisor));
 
     // Divisor, derived from modulus, for refining quotient guess into exact value
-    n_div = ((n[1]<< DIGIT_BITS) + n[0]);
+    n_div = (((ddigit_t)n[1] << DIGIT_BITS) + n[0]);
 
     LOG("reduce: n divisor: n[1]=%x n[0]=%x n_div=%x\r\n", n[1], n[0], n_div);
 
-    CHAN_OUT1(digit_t, n_div, n_div, CH(task_reduce_n_divisor, task_reduce_quotient));
+    CHAN_OUT1(ddigit_t, LANE(n_div), n_div, CH(task_reduce_n_divisor, task_reduce_quotient));
 
     TRANSITION_TO_MT(task_reduce_quotient);
 }
@@ -1644,34 +5216,24 @@ void task_reduce_quotient()
 {
     unsigned d;
     digit_t m[3]; // [2]=m[d], [1]=m[d-1], [0]=m[d-2]
-    digit_t m_n, n_div, q;
-    uint32_t qn, n_q; // must hold at least 3 digits
+    digit_t m_n, q;
+    ddigit_t n_div;
+    tdigit_t qn, n_q; // must hold at least 3 digits
 
 #ifdef SHOW_PROGRESS_ON_LED
     blink(1, BLINK_DURATION_TASK, LED2);
 #endif
 
-    d = *CHAN_IN2(unsigned, digit, MC_IN_CH(ch_digit, task_reduce_digits, task_reduce_quotient),
+    d = *CHAN_IN2(unsigned, LANE(digit), MC_IN_CH(ch_digit, task_reduce_digits, task_reduce_quotient),
                          SELF_IN_CH(task_reduce_quotient));
 
     LOG("reduce: quotient: d=%x\r\n", d);
 
-    m[2] = *CHAN_IN3(digit_t, product[d],
-                     MC_IN_CH(ch_product, task_mult, task_reduce_quotient),
-                     MC_IN_CH(ch_normalized_product, task_reduce_normalize, task_reduce_quotient),
-                     MC_IN_CH(ch_reduce_subtract_product, task_reduce_subtract,
-                              task_reduce_quotient));
-
-    m[1] = *CHAN_IN3(digit_t,product[d - 1],
-                     MC_IN_CH(ch_product, task_mult, task_reduce_quotient),
-                     MC_IN_CH(ch_normalized_product, task_reduce_normalize, task_reduce_quotient),
-                     MC_IN_CH(ch_reduce_subtract_product, task_reduce_subtract,
-                              task_reduce_quotient));
-    m[0] = *CHAN_IN3(digit_t,product[d - 2],
-                     MC_IN_CH(ch_product, task_mult, task_reduce_quotient),
-                     MC_IN_CH(ch_normalized_product, task_reduce_normalize, task_reduce_quotient),
-                     MC_IN_CH(ch_reduce_subtract_product, task_reduce_subtract,
-                              task_reduce_quotient));
+    CHAN_IN_ARRAY3(digit_t, LANE(product), d - 2, m, 3,
+                   MC_IN_CH(ch_product, task_mult, task_reduce_quotient),
+                   MC_IN_CH(ch_normalized_product, task_reduce_normalize, task_reduce_quotient),
+                   MC_IN_CH(ch_reduce_subtract_product, task_reduce_subtract,
+                            task_reduce_quotient));
     // NOTE: we asserted that NUM_DIGITS >= 2, so p[d-2] is safe
 
     m_n = *CHAN_IN1(digit_t,N[NUM_DIGITS - 1],
@@ -1681,9 +5243,9 @@ void task_reduce_quotient()
 
     // Choose an initial guess for quotient
     if (m[2] == m_n) {
-        q = (1 << DIGIT_BITS) - 1;
+        q = DIGIT_MASK;
     } else {
-        q = ((m[2] << DIGIT_BITS) + m[1]) / m_n;
+        q = (((ddigit_t)m[2] << DIGIT_BITS) + m[1]) / m_n;
     }
 
     LOG("reduce: quotient: q0=%x\r\n", q);
@@ -1693,19 +5255,23 @@ void task_reduce_quotient()
     // NOTE: An alternative to composing the digits into one variable, is to
     // have a loop that does the comparison digit by digit to implement the
     // condition of the while loop below.
-    n_q = ((uint32_t)m[2] << (2 * DIGIT_BITS)) + (m[1] << DIGIT_BITS) + m[0];
+    n_q = ((tdigit_t)m[2] << (2 * DIGIT_BITS)) + ((ddigit_t)m[1] << DIGIT_BITS) + m[0];
 
     LOG("reduce: quotient: m[d]=%x m[d-1]=%x m[d-2]=%x n_q=%x%x\r\n",
            m[2], m[1], m[0], (uint16_t)((n_q >> 16) & 0xffff), (uint16_t)(n_q & 0xffff));
 
-    n_div = *CHAN_IN1(digit_t,n_div, CH(task_reduce_n_divisor, task_reduce_quotient));
+    n_div = *CHAN_IN1(ddigit_t, LANE(n_div), CH(task_reduce_n_divisor, task_reduce_quotient));
 
     LOG("reduce: quotient: n_div=%x q0=%x\r\n", n_div, q);
 
     q++;
     do {
         q--;
+#if DIGIT_BITS == 8
         qn = mult16(n_div, q);
+#else
+        qn = (tdigit_t)n_div * q;
+#endif
         LOG("reduce: quotient: q=%x qn=%x%x\r\n", q,
               (uint16_t)((qn >> 16) & 0xffff), (uint16_t)(qn & 0xffff));
     } while (qn > n_q);
@@ -1714,14 +5280,14 @@ void task_reduce_quotient()
     // which we determine and fix in the 'compare' and 'add' steps.
     LOG("reduce: quotient: q=%x\r\n", q);
 
-    CHAN_OUT1(digit_t, quotient, q, CH(task_reduce_quotient, task_reduce_multiply));
+    CHAN_OUT1(digit_t, LANE(quotient), q, CH(task_reduce_quotient, task_reduce_multiply));
 
-    CHAN_OUT1(unsigned, digit, d, MC_OUT_CH(ch_reduce_digit, task_reduce_quotient,
+    CHAN_OUT1(unsigned, LANE(digit), d, MC_OUT_CH(ch_reduce_digit, task_reduce_quotient,
                                  task_reduce_multiply, task_reduce_add,
                                  task_reduce_subtract));
 
     d--;
-    CHAN_OUT1(unsigned, digit, d, SELF_OUT_CH(task_reduce_quotient));
+    CHAN_OUT1(unsigned, LANE(digit), d, SELF_OUT_CH(task_reduce_quotient));
 
     TRANSITION_TO_MT(task_reduce_multiply);
 }
@@ -1730,16 +5296,17 @@ void task_reduce_quotient()
 void task_reduce_multiply()
 {
     int i;
-    digit_t m, q, n;
-    unsigned c, d, offset;
+    digit_t m[NUM_DIGITS_x2], q, n[NUM_DIGITS];
+    ddigit_t c, t;
+    unsigned d, offset;
 
 #ifdef SHOW_PROGRESS_ON_LED
     blink(1, BLINK_DURATION_TASK, LED2);
 #endif
 
-    d = *CHAN_IN1(unsigned,digit, MC_IN_CH(ch_reduce_digit,
+    d = *CHAN_IN1(unsigned,LANE(digit), MC_IN_CH(ch_reduce_digit,
                                   task_reduce_quotient, task_reduce_multiply));
-    q = *CHAN_IN1(digit_t, quotient, CH(task_reduce_quotient, task_reduce_multiply));
+    q = *CHAN_IN1(digit_t, LANE(quotient), CH(task_reduce_quotient, task_reduce_multiply));
 
     //LOG("reduce: multiply: d=%x q=%x\r\n", d, q);
 
@@ -1752,10 +5319,10 @@ void task_reduce_multiply()
 
     // For calling the print task we need to proxy to it values that
     // we do not modify
-    for (i = 0; i < offset; ++i) {
-        digit_t dummy = 0; 
-        CHAN_OUT1(digit_t, product[i], dummy, CALL_CH(ch_print_product));
-    }
+    PRINT_PRODUCT_ZEROS(0, offset);
+
+    CHAN_IN_ARRAY1(digit_t, N, 0, n, NUM_DIGITS,
+                   MC_IN_CH(ch_modulus, task_init, task_reduce_multiply));
 
     // TODO: could convert the loop into a self-edge
     c = 0;
@@ -1764,30 +5331,26 @@ void task_reduce_multiply()
         // This condition creates the left-shifted zeros.
         // TODO: consider adding number of digits to go along with the 'product' field,
         // then we would not have to zero out the MSDs
-        m = c;
+        t = c;
         if (i < offset + NUM_DIGITS) {
-            n = *CHAN_IN1(digit_t, N[i - offset],
-                          MC_IN_CH(ch_modulus, task_init, task_reduce_multiply));
-            m += q * n;
+            t += (ddigit_t)q * n[i - offset];
         } else {
-            n = 0;
             // TODO: could break out of the loop  in this case (after CHAN_OUT)
         }
 
-        LOG("reduce: multiply: n[%u]=%x q=%x c=%x m[%u]=%x\r\n",
-               i - offset, n, q, c, i, m);
+        LOG("reduce: multiply: n[%u]=%x q=%x c=%x m[%u]=%x\r\n", i - offset,
+               i < offset + NUM_DIGITS ? n[i - offset] : 0, q, c, i, t);
 
-        c = m >> DIGIT_BITS;
-        m &= DIGIT_MASK;
+        c = t >> DIGIT_BITS;
+        m[i] = t & DIGIT_MASK;
+    }
 
-        CHAN_OUT1(digit_t, product[i], m, MC_OUT_CH(ch_qn, task_reduce_multiply,
-                                          task_reduce_compare, task_reduce_subtract));
+    CHAN_OUT_ARRAY1(digit_t, LANE(product), offset, m + offset, NUM_DIGITS_x2 - offset,
+                    MC_OUT_CH(ch_qn, task_reduce_multiply,
+                              task_reduce_compare, task_reduce_subtract));
+    PRINT_PRODUCT_DIGITS(offset, m + offset, NUM_DIGITS_x2 - offset);
 
-        CHAN_OUT1(digit_t, product[i], m, CALL_CH(ch_print_product));
-    }
-    task_t *next_task =TASK_REF(task_reduce_compare);  
-    CHAN_OUT1(task_t *,next_task, next_task , CALL_CH(ch_print_product));
-    TRANSITION_TO_MT(task_print_product);
+    TRANSITION_VIA_PRINT_PRODUCT(TASK_REF(task_reduce_compare));
 }
 
 void task_reduce_compare()
@@ -1806,7 +5369,7 @@ void task_reduce_compare()
     // TODO: this loop might not have to go down to zero, but to NUM_DIGITS
     // TODO: consider adding number of digits to go along with the 'product' field
     for (i = NUM_DIGITS_x2 - 1; i >= 0; --i) {
-        m = *CHAN_IN3(digit_t, product[i],
+        m = *CHAN_IN3(digit_t, LANE(product[i]),
                       MC_IN_CH(ch_product, task_mult, task_reduce_compare),
                       MC_IN_CH(ch_normalized_product, task_reduce_normalize, task_reduce_compare),
                       // TODO: do we need 'ch_reduce_add_product' here? We do not if
@@ -1814,7 +5377,7 @@ void task_reduce_compare()
                       // 'task_reduce_add', which, I think, is the case.
                       MC_IN_CH(ch_reduce_subtract_product, task_reduce_subtract,
                                task_reduce_compare));
-        qn = *CHAN_IN1(digit_t, product[i],
+        qn = *CHAN_IN1(digit_t, LANE(product[i]),
                        MC_IN_CH(ch_qn, task_reduce_multiply, task_reduce_compare));
 
         LOG("reduce: compare: m[%u]=%x qn[%u]=%x\r\n", i, m, i, qn);
@@ -1845,80 +5408,75 @@ void task_reduce_compare()
 void task_reduce_add()
 {
     int i, j;
-    digit_t m, n, c, r;
+    digit_t m[NUM_DIGITS_x2], n[NUM_DIGITS], r[NUM_DIGITS_x2], nj;
+    ddigit_t c, t;
     unsigned d, offset;
 
 #ifdef SHOW_PROGRESS_ON_LED
     blink(1, BLINK_DURATION_TASK, LED2);
 #endif
 
-    d = *CHAN_IN1(unsigned, digit, MC_IN_CH(ch_reduce_digit,
+    d = *CHAN_IN1(unsigned, LANE(digit), MC_IN_CH(ch_reduce_digit,
                                   task_reduce_quotient, task_reduce_compare));
 
     // Part of this task is to shift modulus by radix^(digit - NUM_DIGITS)
     offset = d - NUM_DIGITS;
-    digit_t dummy = 0; 
     //LOG("reduce: add: d=%u offset=%u\r\n", d, offset);
 
     // For calling the print task we need to proxy to it values that
     // we do not modify
-    for (i = 0; i < offset; ++i) {
-        CHAN_OUT1(digit_t, product[i], dummy, CALL_CH(ch_print_product));
-    }
+    PRINT_PRODUCT_ZEROS(0, offset);
 
-    // For calling the print task we need to proxy to it values that
-    // we do not modify
-    for (i = 0; i < offset; ++i) {
-        CHAN_OUT1(digit_t, product[i], dummy, CALL_CH(ch_print_product));
-    }
+    CHAN_IN_ARRAY3(digit_t, LANE(product), offset, m + offset, NUM_DIGITS_x2 - offset,
+                   MC_IN_CH(ch_product, task_mult, task_reduce_add),
+                   MC_IN_CH(ch_normalized_product, task_reduce_normalize, task_reduce_add),
+                   MC_IN_CH(ch_reduce_subtract_product,
+                            task_reduce_subtract, task_reduce_add));
+    CHAN_IN_ARRAY1(digit_t, N, 0, n, NUM_DIGITS,
+                   MC_IN_CH(ch_modulus, task_init, task_reduce_add));
 
     // TODO: coult transform this loop into a self-edge
     c = 0;
     for (i = offset; i < 2 * NUM_DIGITS; ++i) {
-        m = *CHAN_IN3(digit_t, product[i],
-                      MC_IN_CH(ch_product, task_mult, task_reduce_add),
-                      MC_IN_CH(ch_normalized_product, task_reduce_normalize, task_reduce_add),
-                      MC_IN_CH(ch_reduce_subtract_product,
-                               task_reduce_subtract, task_reduce_add));
-
         // Shifted index of the modulus digit
         j = i - offset;
 
         if (i < offset + NUM_DIGITS) {
-            n = *CHAN_IN1(digit_t, N[j], MC_IN_CH(ch_modulus, task_init, task_reduce_add));
+            nj = n[j];
         } else {
-            n = 0;
+            nj = 0;
             j = 0; // a bit ugly, we want 'nan', but ok, since for output only
             // TODO: could break out of the loop in this case (after CHAN_OUT)
         }
 
-        r = c + m + n;
+        t = c + m[i] + nj;
 
-        LOG("reduce: add: m[%u]=%x n[%u]=%x c=%x r=%x\r\n", i, m, j, n, c, r);
+        LOG("reduce: add: m[%u]=%x n[%u]=%x c=%x r=%x\r\n", i, m[i], j, nj, c, t);
 
-        c = r >> DIGIT_BITS;
-        r &= DIGIT_MASK;
-
-        CHAN_OUT1(digit_t, product[i], r, CH(task_reduce_add, task_reduce_subtract));
-        CHAN_OUT1(digit_t, product[i], r, CALL_CH(ch_print_product));
+        c = t >> DIGIT_BITS;
+        r[i] = t & DIGIT_MASK;
     }
-    task_t *next_task =TASK_REF(task_reduce_subtract);  
-    CHAN_OUT1(task_t *,next_task, next_task , CALL_CH(ch_print_product));
-    TRANSITION_TO_MT(task_print_product);
+
+    CHAN_OUT_ARRAY1(digit_t, LANE(product), offset, r + offset, NUM_DIGITS_x2 - offset,
+                    CH(task_reduce_add, task_reduce_subtract));
+    PRINT_PRODUCT_DIGITS(offset, r + offset, NUM_DIGITS_x2 - offset);
+
+    TRANSITION_VIA_PRINT_PRODUCT(TASK_REF(task_reduce_subtract));
 }
 
 // TODO: re-use task_reduce_normalize?
 void task_reduce_subtract()
 {
     int i;
-    digit_t m, s, r, qn;
+    digit_t m[NUM_DIGITS_x2], qn[NUM_DIGITS_x2], r;
+    ddigit_t s;
     unsigned d, borrow, offset;
 
 #ifdef SHOW_PROGRESS_ON_LED
     blink(1, BLINK_DURATION_TASK, LED2);
 #endif
 
-    d = *CHAN_IN1(unsigned, digit, MC_IN_CH(ch_reduce_digit, task_reduce_quotient,
+    d = *CHAN_IN1(unsigned, LANE(digit), MC_IN_CH(ch_reduce_digit, task_reduce_quotient,
                                   task_reduce_subtract));
 
     // The qn product had been shifted by this offset, no need to subtract the zeros
@@ -1926,93 +5484,79 @@ void task_reduce_subtract()
 
     //LOG("reduce: subtract: d=%u offset=%u\r\n", d, offset);
 
-    // For calling the print task we need to proxy to it values that
-    // we do not modify
-    for (i = 0; i < offset; ++i) {
-        m = *CHAN_IN4(digit_t, product[i],
-                      MC_IN_CH(ch_product, task_mult, task_reduce_subtract),
-                      MC_IN_CH(ch_normalized_product, task_reduce_normalize, task_reduce_subtract),
-                      CH(task_reduce_add, task_reduce_subtract),
-                      SELF_IN_CH(task_reduce_subtract));
-        digit_t dummy = 0; 
-        CHAN_OUT1(digit_t, product[i], dummy, CALL_CH(ch_print_product));
-    }
+    CHAN_IN_ARRAY4(digit_t, LANE(product), 0, m, NUM_DIGITS_x2,
+                   MC_IN_CH(ch_product, task_mult, task_reduce_subtract),
+                   MC_IN_CH(ch_normalized_product, task_reduce_normalize, task_reduce_subtract),
+                   CH(task_reduce_add, task_reduce_subtract),
+                   SELF_IN_CH(task_reduce_subtract));
+    CHAN_IN_ARRAY1(digit_t, LANE(product), offset, qn + offset, NUM_DIGITS_x2 - offset,
+                   MC_IN_CH(ch_qn, task_reduce_multiply, task_reduce_subtract));
 
     // TODO: could transform this loop into a self-edge
     borrow = 0;
-    for (i = 0; i < 2 * NUM_DIGITS; ++i) {
-        m = *CHAN_IN4(digit_t, product[i],
-                      MC_IN_CH(ch_product, task_mult, task_reduce_subtract),
-                      MC_IN_CH(ch_normalized_product, task_reduce_normalize, task_reduce_subtract),
-                      CH(task_reduce_add, task_reduce_subtract),
-                      SELF_IN_CH(task_reduce_subtract));
-
-        // For calling the print task we need to proxy to it values that we do not modify
-        if (i >= offset) {
-            qn = *CHAN_IN1(digit_t, product[i],
-                           MC_IN_CH(ch_qn, task_reduce_multiply, task_reduce_subtract));
-
-            s = qn + borrow;
-            if (m < s) {
-                m += 1 << DIGIT_BITS;
-                borrow = 1;
-            } else {
-                borrow = 0;
-            }
-            r = m - s;
+    for (i = offset; i < 2 * NUM_DIGITS; ++i) {
+        s = (ddigit_t)qn[i] + borrow;
+        borrow = m[i] < s;
+        r = (m[i] + ((ddigit_t)borrow << DIGIT_BITS)) - s;
 
-            LOG("reduce: subtract: m[%u]=%x qn[%u]=%x b=%u r=%x\r\n",
-                   i, m, i, qn, borrow, r);
+        LOG("reduce: subtract: m[%u]=%x qn[%u]=%x b=%u r=%x\r\n",
+               i, m[i], i, qn[i], borrow, r);
 
-            CHAN_OUT1(digit_t, product[i], r, 
-                      MC_OUT_CH(ch_reduce_subtract_product, task_reduce_subtract,
-                                              task_reduce_quotient, task_reduce_compare));
-            CHAN_OUT1(digit_t, product[i], r, SELF_OUT_CH(task_reduce_subtract));
-        } else {
-            r = m;
-        }
-        CHAN_OUT1(digit_t, product[i], r, CALL_CH(ch_print_product));
+        m[i] = r; // digits below the offset pass through as they are
+    }
+
+    CHAN_OUT_ARRAY1(digit_t, LANE(product), offset, m + offset, NUM_DIGITS_x2 - offset,
+                    MC_OUT_CH(ch_reduce_subtract_product, task_reduce_subtract,
+                              task_reduce_quotient, task_reduce_compare));
+    CHAN_OUT_ARRAY1(digit_t, LANE(product), offset, m + offset, NUM_DIGITS_x2 - offset,
+                    SELF_OUT_CH(task_reduce_subtract));
 
-        if (d == NUM_DIGITS) // reduction done
-            CHAN_OUT1(digit_t, product[i], r, RET_CH(ch_mult_mod));
+    // For calling the print task we need to proxy to it values that we do not modify
+    PRINT_PRODUCT_DIGITS(0, m, NUM_DIGITS_x2);
+
+    if (d == NUM_DIGITS) { // reduction done: offset is 0, so all of m went out above
+#ifdef CHAN_ARRAY_REF1
+        RETURN_IN_PLACE(LANE(product),
+                        MC_OUT_CH(ch_reduce_subtract_product, task_reduce_subtract,
+                                  task_reduce_quotient, task_reduce_compare));
+#else
+        RETURN_DIGITS(m);
+#endif
     }
 
     if (d > NUM_DIGITS) {
-        task_t *next_task =TASK_REF(task_reduce_quotient);  
-        CHAN_OUT1(task_t *, next_task, next_task , CALL_CH(ch_print_product));
+        TRANSITION_VIA_PRINT_PRODUCT(TASK_REF(task_reduce_quotient));
     } else { // reduction finished: exit from the reduce hypertask (after print)
         LOG("reduce: subtract: reduction done\r\n");
 
         // TODO: Is it ok to get the next task directly from call channel?
         //       If not, all we have to do is have reduce task proxy it.
         //       Also, do we need a dedicated epilogue task?
-        const task_t *next_task = *CHAN_IN1(task_t *, next_task, CALL_CH(ch_mult_mod));
-        CHAN_OUT1(task_t *, next_task, next_task, CALL_CH(ch_print_product));
+        const task_t *next_task = *CHAN_IN1(task_t *, LANE(next_task), CALL_CH(ch_mult_mod));
+        TRANSITION_VIA_PRINT_PRODUCT(next_task);
     }
-
-    TRANSITION_TO_MT(task_print_product);
 }
 
-// TODO: eliminate from control graph when not verbose
+#if PRINT_PRODUCT
 void task_print_product()
 {
     const task_t* next_task;
     //LOG("TASK_PRINT_PRODUCT_rsa\r\n"); 
 #ifdef VERBOSE
     int i;
-    digit_t m;
+    digit_t m[NUM_DIGITS_x2];
 
+    CHAN_IN_ARRAY1(digit_t, LANE(product), 0, m, NUM_DIGITS_x2, CALL_CH(ch_print_product));
     LOG("print: P=");
-    for (i = (NUM_DIGITS_x2) - 1; i >= 0; --i) {
-        m = *CHAN_IN1(digit_t, product[i], CALL_CH(ch_print_product));
-        LOG("%x ", m);
-    }
+    for (i = (NUM_DIGITS_x2) - 1; i >= 0; --i)
+        LOG("%x ", m[i]);
     LOG("\r\n");
 #endif
 
-    next_task = *CHAN_IN1(task_t *, next_task, CALL_CH(ch_print_product));
+    next_task = *CHAN_IN1(task_t *, LANE(next_task), CALL_CH(ch_print_product));
     transition_to_mt(next_task);
 }
+#endif
 
 
 
@@ -2060,6 +5604,13 @@ void init()
     GPIO(PORT_DEBUG, DIR) |= BIT(PIN_DEBUG_1) ; 
     GPIO(PORT_DEBUG, OUT) &= ~BIT(PIN_DEBUG_1); 
 #endif
+
+#if defined(BENCHMARK) && defined(__MSP430__)
+    TA0CTL = TASSEL__SMCLK | ID__8 | MC__CONTINUOUS | TACLR; // bench_clock()
+#endif
+#if defined(BLOCK_CYCLES) && defined(__MSP430__)
+    TA1CTL = TASSEL__SMCLK | MC__CONTINUOUS | TACLR | TAIE; // block_clock()
+#endif
     PRINTF(".%u.\r\n", curctx->task->idx);
 }
 